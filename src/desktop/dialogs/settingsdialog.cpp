@@ -263,6 +263,7 @@ void SettingsDialog::restoreSettings()
 	m_ui->brushCursorBox->setCurrentIndex(cfg.value("brushcursor").toInt());
 	m_ui->toolToggleShortcut->setChecked(cfg.value("tooltoggle", true).toBool());
 	m_ui->shareBrushSlotColor->setChecked(cfg.value("sharebrushslotcolor", false).toBool());
+	m_ui->adaptiveSpacing->setChecked(cfg.value("adaptivespacing", false).toBool());
 
 	m_ui->insecurePasswordStorage->setChecked(cfg.value("insecurepasswordstorage", false).toBool());
 
@@ -381,6 +382,7 @@ void SettingsDialog::rememberSettings()
 	cfg.setValue("settings/brushcursor", m_ui->brushCursorBox->currentIndex());
 	cfg.setValue("settings/tooltoggle", m_ui->toolToggleShortcut->isChecked());
 	cfg.setValue("settings/sharebrushslotcolor", m_ui->shareBrushSlotColor->isChecked());
+	cfg.setValue("settings/adaptivespacing", m_ui->adaptiveSpacing->isChecked());
 	cfg.setValue("settings/insecurepasswordstorage", m_ui->insecurePasswordStorage->isChecked());
 
 	cfg.beginGroup("settings/input");
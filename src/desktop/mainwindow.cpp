@@ -751,6 +751,7 @@ void MainWindow::updateSettings()
 	cfg.beginGroup("settings");
 	m_view->setBrushCursorStyle(cfg.value("brushcursor").toInt());
 	static_cast<tools::BrushSettings*>(m_dockToolSettings->getToolSettingsPage(tools::Tool::FREEHAND))->setShareBrushSlotColor(cfg.value("sharebrushslotcolor", false).toBool());
+	m_doc->toolCtrl()->setAdaptiveSpacing(cfg.value("adaptivespacing", false).toBool());
 }
 
 void MainWindow::updateLayerViewMode()
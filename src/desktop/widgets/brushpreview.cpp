@@ -22,7 +22,7 @@
 #ifndef DESIGNER_PLUGIN
 #include "core/point.h"
 #include "core/layerstack.h"
-#include "core/layerstackpixmapcacheobserver.h"
+#include "core/layerstackobserver.h"
 #include "core/layer.h"
 #include "core/floodfill.h"
 #include "brushes/shapes.h"
@@ -34,140 +34,108 @@
 #include <QPaintEvent>
 #include <QPainter>
 #include <QEvent>
+#include <QThreadPool>
+#include <QDataStream>
+#include <QScopedPointer>
 
 namespace widgets {
 
-BrushPreview::BrushPreview(QWidget *parent, Qt::WindowFlags f)
-	: QFrame(parent,f)
-{
-	setAttribute(Qt::WA_NoSystemBackground);
-	setMinimumSize(32,32);
-}
-
-BrushPreview::~BrushPreview() {
 #ifndef DESIGNER_PLUGIN
-	delete m_previewCache;
-	delete m_preview;
-#endif
-}
+namespace {
 
-void BrushPreview::setBrush(const brushes::ClassicBrush &brush)
-{
-	m_brush = brush;
-	m_needupdate = true;
-	update();
-}
-
-void BrushPreview::setPreviewShape(PreviewShape shape)
-{
-	if(m_shape != shape) {
-		m_shape = shape;
-		m_needupdate = true;
-		update();
-	}
-}
+static const int PREVIEW_CACHE_SIZE = 8 * 1024; // in kilobytes
 
-void BrushPreview::setFloodFillTolerance(int tolerance)
-{
-	if(m_fillTolerance != tolerance) {
-		m_fillTolerance = tolerance;
-		m_needupdate = true;
-		update();
-	}
-}
+//! Everything that affects the appearance of the preview
+struct PreviewParams {
+	brushes::ClassicBrush brush;
+	BrushPreview::PreviewShape shape;
+	QSize size;
+	int fillTolerance;
+	int fillExpansion;
+	bool underFill;
 
-void BrushPreview::setFloodFillExpansion(int expansion)
-{
-	if(m_fillExpansion != expansion) {
-		m_fillExpansion = expansion;
-		m_needupdate = true;
-		update();
+	QByteArray cacheKey() const
+	{
+		QByteArray key;
+		QDataStream ds(&key, QIODevice::WriteOnly);
+		ds << brush << int(shape) << size << fillTolerance << fillExpansion << underFill;
+		return key;
 	}
-}
-
-void BrushPreview::setUnderFill(bool underfill)
+};
+
+/**
+ * @brief Flattens a layer stack into an image
+ *
+ * This is like LayerStackPixmapCacheObserver, except that it paints onto a
+ * QImage, which (unlike a QPixmap) can be used outside the GUI thread.
+ */
+class PreviewImageObserver : public paintcore::LayerStackObserver
 {
-	if(m_underFill != underfill) {
-		m_underFill = underfill;
-		m_needupdate = true;
-		update();
+public:
+	QImage render()
+	{
+		QImage image(layerStack()->size(), QImage::Format_ARGB32_Premultiplied);
+		paintChangedTiles(image.rect(), &image);
+		return image;
 	}
-}
-
-void BrushPreview::resizeEvent(QResizeEvent *)
-{ 
-	m_needupdate = true;
-}
-
-void BrushPreview::changeEvent(QEvent *)
-{
-	m_needupdate = true;
-	update();
-}
-
-void BrushPreview::paintEvent(QPaintEvent *event)
-{
-#ifndef DESIGNER_PLUGIN
-	if(m_needupdate)
-		updatePreview();
-
-	QPainter painter(this);
-	painter.drawPixmap(event->rect(), m_previewCache->getPixmap(event->rect()), event->rect());
-#endif
-}
 
-void BrushPreview::updatePreview()
+protected:
+	void areaChanged(const QRect &) override { }
+	void resized(int, int, const QSize &) override { }
+};
+
+/**
+ * @brief Render the preview
+ *
+ * A private layer stack is used, so this can be run in a background thread.
+ *
+ * The rendering is cancelled (and a null image returned) when
+ * the latest generation no longer matches the given one.
+ */
+QImage renderPreview(const PreviewParams &params, const QAtomicInt &latest, int generation)
 {
-#ifndef DESIGNER_PLUGIN
-	if(!m_preview) {
-		m_preview = new paintcore::LayerStack;
-		m_previewCache = new paintcore::LayerStackPixmapCacheObserver(this);
-		m_previewCache->attachToLayerStack(m_preview);
-	}
+	typedef BrushPreview::PreviewShape Shape;
 
-	auto layerstack = m_preview->editor(0);
+	const auto isCancelled = [&latest, generation]() { return latest.load() != generation; };
 
-	if(m_preview->width() == 0) {
-		const QSize size = contentsRect().size();
-		layerstack.resize(0, size.width(), size.height(), 0);
-		layerstack.createLayer(0, 0, QColor(0,0,0), false, false, QString());
+	QScopedPointer<paintcore::LayerStack> preview(new paintcore::LayerStack);
+	auto layerstack = preview->editor(0);
 
-	} else if(m_preview->width() != contentsRect().width() || m_preview->height() != contentsRect().height()) {
-		layerstack.resize(0, contentsRect().width() - m_preview->width(), contentsRect().height() - m_preview->height(), 0);
-	}
+	layerstack.resize(0, params.size.width(), params.size.height(), 0);
+	layerstack.createLayer(0, 0, QColor(0,0,0), false, false, QString());
 
 	const QRectF previewRect {
-		m_preview->width()/8.0,
-		m_preview->height()/4.0,
-		m_preview->width()-m_preview->width()/4.0,
-		m_preview->height()-m_preview->height()/2.0
+		preview->width()/8.0,
+		preview->height()/4.0,
+		preview->width()-preview->width()/4.0,
+		preview->height()-preview->height()/2.0
 	};
 
 	paintcore::PointVector pointvector;
 
-	switch(m_shape) {
-	case Stroke: pointvector = brushes::shapes::sampleStroke(previewRect); break;
-	case Line:
+	switch(params.shape) {
+	case Shape::Stroke: pointvector = brushes::shapes::sampleStroke(previewRect); break;
+	case Shape::Line:
 		pointvector
 			<< paintcore::Point(previewRect.left(), previewRect.top(), 1.0)
 			<< paintcore::Point(previewRect.right(), previewRect.bottom(), 1.0);
 		break;
-	case Rectangle: pointvector = brushes::shapes::rectangle(previewRect); break;
-	case Ellipse: pointvector = brushes::shapes::ellipse(previewRect); break;
-	case FloodFill:
-	case FloodErase: pointvector = brushes::shapes::sampleBlob(previewRect); break;
+	case Shape::Rectangle: pointvector = brushes::shapes::rectangle(previewRect); break;
+	case Shape::Ellipse: pointvector = brushes::shapes::ellipse(previewRect); break;
+	case Shape::FloodFill:
+	case Shape::FloodErase: pointvector = brushes::shapes::sampleBlob(previewRect); break;
 	}
 
-	QColor bgColor = icon::isDark(m_brush.color()) ? QColor(250, 250, 250) : QColor(32, 32, 32);
+	QColor bgColor = icon::isDark(params.brush.color()) ? QColor(250, 250, 250) : QColor(32, 32, 32);
 	QColor layerColor = Qt::transparent;
 	enum class LayerFill {
 		Solid,
 		RainbowBars,
 		RainbowDabs
 	};
-	auto fgStyle = m_brush.smudge1()>0 ? LayerFill::RainbowBars : LayerFill::Solid;
+	auto fgStyle = params.brush.smudge1()>0 ? LayerFill::RainbowBars : LayerFill::Solid;
 
-	brushes::ClassicBrush brush = m_brush;
+	brushes::ClassicBrush brush = params.brush;
 
 	if(brush.blendingMode() == paintcore::BlendMode::MODE_ERASE) {
 		layerColor = bgColor;
@@ -176,18 +144,18 @@ void BrushPreview::updatePreview()
 	} else if(brush.blendingMode() == paintcore::BlendMode::MODE_COLORERASE) {
 		// Color-erase mode: use fg color as background
 		bgColor = Qt::transparent;
-		layerColor = brushColor();
+		layerColor = params.brush.color();
 
 	} else if(!paintcore::findBlendMode(brush.blendingMode()).flags.testFlag(paintcore::BlendMode::IncrOpacity)) {
 		fgStyle = LayerFill::RainbowDabs;
 		bgColor = Qt::transparent;
 	}
 
-	if(m_shape == FloodFill) {
+	if(params.shape == Shape::FloodFill) {
 		brush.setColor(bgColor);
 		bgColor = Qt::transparent;
 
-	} else if(m_shape == FloodErase) {
+	} else if(params.shape == Shape::FloodErase) {
 		layerColor = brush.color();
 		brush.setColor(bgColor);
 		bgColor = Qt::transparent;
@@ -246,13 +214,19 @@ void BrushPreview::updatePreview()
 		brushes::BrushEngine brushengine;
 		brushengine.setBrush(1, 1, brush);
 
-		for(int i=0;i<pointvector.size();++i)
+		for(int i=0;i<pointvector.size();++i) {
+			if(isCancelled())
+				return QImage();
 			brushengine.strokeTo(pointvector[i], layer.layer());
+		}
 		brushengine.endStroke();
 
 		const auto dabs = brushengine.takeDabs();
-		for(int i=0;i<dabs.size();++i)
+		for(int i=0;i<dabs.size();++i) {
+			if(isCancelled())
+				return QImage();
 			brushes::drawBrushDabsDirect(*dabs.at(i), layer);
+		}
 
 		layer.mergeSublayer(1);
 	}
@@ -260,24 +234,196 @@ void BrushPreview::updatePreview()
 	// Do the flood fill
 	// In flood fill mode, the shape drawn with the brush creates
 	// a closed area that will be filled here.
-	if(m_shape == FloodFill || m_shape == FloodErase) {
+	if(params.shape == Shape::FloodFill || params.shape == Shape::FloodErase) {
+		if(isCancelled())
+			return QImage();
+
 		paintcore::FillResult fr = paintcore::floodfill(
-			m_preview,
+			preview.data(),
 			previewRect.center().toPoint(),
-			m_shape == FloodFill ? brushColor() : QColor(),
-			m_fillTolerance,
+			params.shape == Shape::FloodFill ? params.brush.color() : QColor(),
+			params.fillTolerance,
 			0,
 			false,
 			360000);
 
-		if(m_fillExpansion>0)
-			fr = paintcore::expandFill(fr, m_fillExpansion, brushColor());
+		if(params.fillExpansion>0)
+			fr = paintcore::expandFill(fr, params.fillExpansion, params.brush.color());
 		if(!fr.image.isNull())
-			layer.putImage(fr.x, fr.y, fr.image, m_shape == FloodFill ? (m_underFill ? paintcore::BlendMode::MODE_BEHIND : paintcore::BlendMode::MODE_NORMAL) : paintcore::BlendMode::MODE_ERASE);
+			layer.putImage(fr.x, fr.y, fr.image, params.shape == Shape::FloodFill ? (params.underFill ? paintcore::BlendMode::MODE_BEHIND : paintcore::BlendMode::MODE_NORMAL) : paintcore::BlendMode::MODE_ERASE);
 	}
 
-	m_needupdate=false;
+	PreviewImageObserver observer;
+	observer.attachToLayerStack(preview.data());
+	return observer.render();
+}
+
+class PreviewRenderer : public QRunnable
+{
+public:
+	PreviewRenderer(BrushPreview *target, const PreviewParams &params, const QAtomicInt &latest, int generation)
+		: m_target(target), m_params(params), m_latest(latest), m_generation(generation)
+	{
+	}
+
+	void run() override
+	{
+		if(m_latest.load() != m_generation)
+			return;
+
+		const QImage image = renderPreview(m_params, m_latest, m_generation);
+		if(!image.isNull()) {
+			// Note: the widget waits for all renderers to finish before it is destroyed
+			QMetaObject::invokeMethod(m_target, "previewRendered", Qt::QueuedConnection,
+				Q_ARG(QImage, image),
+				Q_ARG(QByteArray, m_params.cacheKey()),
+				Q_ARG(int, m_generation)
+			);
+		}
+	}
+
+private:
+	BrushPreview *m_target;
+	PreviewParams m_params;
+	const QAtomicInt &m_latest;
+	int m_generation;
+};
+
+}
 #endif
+
+BrushPreview::BrushPreview(QWidget *parent, Qt::WindowFlags f)
+	: QFrame(parent,f), m_renderPool(new QThreadPool(this))
+{
+	setAttribute(Qt::WA_NoSystemBackground);
+	setMinimumSize(32,32);
+
+	// Only the latest preview is interesting, so there is no point in rendering more than one at a time
+	m_renderPool->setMaxThreadCount(1);
+#ifndef DESIGNER_PLUGIN
+	m_previewCache.setMaxCost(PREVIEW_CACHE_SIZE);
+#endif
+}
+
+BrushPreview::~BrushPreview() {
+	// Cancel the current rendering job (if any) and wait for it to finish
+	m_generation.fetchAndAddOrdered(1);
+	m_renderPool->clear();
+	m_renderPool->waitForDone();
+}
+
+void BrushPreview::setBrush(const brushes::ClassicBrush &brush)
+{
+	m_brush = brush;
+	m_needupdate = true;
+	update();
+}
+
+void BrushPreview::setPreviewShape(PreviewShape shape)
+{
+	if(m_shape != shape) {
+		m_shape = shape;
+		m_needupdate = true;
+		update();
+	}
+}
+
+void BrushPreview::setFloodFillTolerance(int tolerance)
+{
+	if(m_fillTolerance != tolerance) {
+		m_fillTolerance = tolerance;
+		m_needupdate = true;
+		update();
+	}
+}
+
+void BrushPreview::setFloodFillExpansion(int expansion)
+{
+	if(m_fillExpansion != expansion) {
+		m_fillExpansion = expansion;
+		m_needupdate = true;
+		update();
+	}
+}
+
+void BrushPreview::setUnderFill(bool underfill)
+{
+	if(m_underFill != underfill) {
+		m_underFill = underfill;
+		m_needupdate = true;
+		update();
+	}
+}
+
+void BrushPreview::resizeEvent(QResizeEvent *)
+{ 
+	m_needupdate = true;
+}
+
+void BrushPreview::changeEvent(QEvent *)
+{
+	m_needupdate = true;
+	update();
+}
+
+void BrushPreview::paintEvent(QPaintEvent *event)
+{
+#ifndef DESIGNER_PLUGIN
+	if(m_needupdate)
+		updatePreview();
+
+	QPainter painter(this);
+	if(m_preview.size() != contentsRect().size())
+		painter.fillRect(event->rect(), palette().color(QPalette::Window));
+	painter.drawImage(event->rect(), m_preview, event->rect());
+#endif
+}
+
+void BrushPreview::updatePreview()
+{
+#ifndef DESIGNER_PLUGIN
+	const PreviewParams params {
+		m_brush,
+		m_shape,
+		contentsRect().size(),
+		m_fillTolerance,
+		m_fillExpansion,
+		m_underFill
+	};
+
+	m_needupdate = false;
+
+	// Superseded jobs will notice the generation change and cancel themselves
+	const int generation = m_generation.fetchAndAddOrdered(1) + 1;
+	m_renderPool->clear();
+
+	const QByteArray key = params.cacheKey();
+	const QImage *cached = m_previewCache.object(key);
+	if(cached) {
+		m_preview = *cached;
+		return;
+	}
+
+	m_renderPool->start(new PreviewRenderer(this, params, m_generation, generation));
+#endif
+}
+
+void BrushPreview::previewRendered(const QImage &image, const QByteArray &key, int generation)
+{
+	// Note: results of superseded renders are cached too, since
+	// the user might well go back to the same settings.
+	m_previewCache.insert(key, new QImage(image), qMax(1, int(
+#if QT_VERSION < QT_VERSION_CHECK(5, 10, 0)
+		image.byteCount()
+#else
+		image.sizeInBytes()
+#endif
+		/ 1024)));
+
+	if(generation == m_generation.load()) {
+		m_preview = image;
+		update();
+	}
 }
 
 void BrushPreview::mouseDoubleClickEvent(QMouseEvent*)
@@ -23,6 +23,9 @@
 #include "../../libclient/core/blendmodes.h"
 
 #include <QFrame>
+#include <QCache>
+#include <QImage>
+#include <QAtomicInt>
 
 #ifdef DESIGNER_PLUGIN
 #include <QtUiPlugin/QDesignerExportWidget>
@@ -31,16 +34,15 @@
 #endif
 
 class QMenu;
-
-namespace paintcore {
-	class LayerStack;
-	class LayerStackPixmapCacheObserver;
-}
+class QThreadPool;
 
 namespace widgets {
 
 /**
  * @brief Brush previewing widget
+ *
+ * The preview is rendered asynchronously in a background thread.
+ * Until the new preview is ready, the previous one is shown.
  */
 class QDESIGNER_WIDGET_EXPORT BrushPreview : public QFrame {
 	Q_OBJECT
@@ -82,14 +84,18 @@ protected:
 	void changeEvent(QEvent *);
 	void mouseDoubleClickEvent(QMouseEvent*);
 
+private slots:
+	void previewRendered(const QImage &image, const QByteArray &key, int generation);
+
 private:
 	void updatePreview();
-	void updateBackground();
 
 	brushes::ClassicBrush m_brush;
 
-	paintcore::LayerStack *m_preview = nullptr;
-	paintcore::LayerStackPixmapCacheObserver *m_previewCache = nullptr;
+	QImage m_preview;
+	QCache<QByteArray, QImage> m_previewCache;
+	QThreadPool *m_renderPool;
+	QAtomicInt m_generation;
 
 	QColor m_bg = Qt::white;
 	PreviewShape m_shape = Stroke;
@@ -37,6 +37,13 @@ public:
 
 	void setBrush(int contextId, int layerId, const ClassicBrush &brush);
 
+	/**
+	 * @brief Enable adaptive dab spacing (when supported by the brush engine)
+	 *
+	 * See ClassicBrushState::setAdaptiveSpacing
+	 */
+	void setAdaptiveSpacing(bool adaptive) { m_classic.setAdaptiveSpacing(adaptive); }
+
 	void strokeTo(const paintcore::Point &p, const paintcore::Layer *sourceLayer) override { Q_ASSERT(m_activeEngine); m_activeEngine->strokeTo(p, sourceLayer); }
 	void endStroke() override { Q_ASSERT(m_activeEngine); m_activeEngine->endStroke(); }
 	protocol::MessageList takeDabs() override { Q_ASSERT(m_activeEngine); return m_activeEngine->takeDabs(); }
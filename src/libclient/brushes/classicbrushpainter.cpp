@@ -21,7 +21,7 @@
 #include "core/brushmask.h"
 #include "core/layer.h"
 
-#include <QCache>
+#include <QAtomicPointer>
 #include <QtMath>
 
 namespace brushes {
@@ -32,7 +32,7 @@ template<typename T> T square(T x) { return x*x; }
 
 typedef QVector<float> LUT;
 static const int LUT_RADIUS = 128;
-static QCache<int, LUT> LUT_CACHE;
+static const int LUT_LEVELS = 101;
 
 // Generate a lookup table for Gimp style exponential brush shape
 // The value at r² (where r is distance from brush center, scaled to LUT_RADIUS) is
@@ -52,14 +52,49 @@ static LUT makeGimpStyleBrushLUT(float hardness)
 	return lut;
 }
 
-static LUT cachedGimpStyleBrushLUT(float hardness)
+/**
+ * @brief A bank of brush shape lookup tables for every hardness level
+ *
+ * The tables are generated when first needed and are immutable after that.
+ * They are published with an atomic compare-and-swap, so lookups need neither
+ * locking nor copying and are safe to do from multiple threads.
+ */
+class LUTBank
 {
-	const int h = hardness * 100;
-	Q_ASSERT(h>=0 && h<=100);
-	if(!LUT_CACHE.contains(h))
-		LUT_CACHE.insert(h, new LUT(makeGimpStyleBrushLUT(hardness)));
+public:
+	~LUTBank()
+	{
+		for(int i=0;i<LUT_LEVELS;++i)
+			delete m_luts[i].load();
+	}
+
+	//! Get the lookup table for the given hardness level (0..100)
+	const LUT &get(int level)
+	{
+		Q_ASSERT(level>=0 && level<LUT_LEVELS);
+		const LUT *lut = m_luts[level].loadAcquire();
+		if(!lut) {
+			// If another thread beats us to it, we just discard our copy
+			const LUT *newLut = new LUT(makeGimpStyleBrushLUT(level / 100.0f));
+			if(m_luts[level].testAndSetOrdered(nullptr, newLut)) {
+				lut = newLut;
+			} else {
+				delete newLut;
+				lut = m_luts[level].loadAcquire();
+			}
+		}
+		return *lut;
+	}
+
+private:
+	QAtomicPointer<const LUT> m_luts[LUT_LEVELS];
+};
 
-	return *LUT_CACHE[h];
+static LUTBank LUT_BANK;
+
+static const LUT &gimpStyleBrushLUT(float hardness)
+{
+	return LUT_BANK.get(hardness * 100);
 }
 
 static paintcore::BrushStamp makeMask(qreal r, qreal hardness, qreal opacity)
@@ -81,7 +116,7 @@ static paintcore::BrushStamp makeMask(qreal r, qreal hardness, qreal opacity)
 		data[4] = opacity;
 
 	} else {
-		const LUT lut = cachedGimpStyleBrushLUT(hardness);
+		const LUT &lut = gimpStyleBrushLUT(hardness);
 		const float lut_scale = square((LUT_RADIUS-1) / r);
 
 		float offset;
@@ -137,7 +172,7 @@ static paintcore::BrushStamp makeHighresMask(qreal r, qreal hardness, qreal opac
 	}
 	const int stampOffset = -diameter/2;
 
-	const LUT lut = cachedGimpStyleBrushLUT(hardness);
+	const LUT &lut = gimpStyleBrushLUT(hardness);
 	const float lut_scale = square((LUT_RADIUS-1) / r);
 
 	QVector<uchar> data(square(diameter));
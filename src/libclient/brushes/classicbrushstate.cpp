@@ -27,6 +27,7 @@ namespace brushes {
 ClassicBrushState::ClassicBrushState()
 	: m_contextId(0), m_layerId(0),
 	  m_length(0), m_smudgeDistance(0), m_pendown(false),
+	  m_adaptiveSpacing(false), m_canAdaptSpacing(false),
 	  m_lastDab(nullptr), m_lastDabX(0), m_lastDabY(0)
 {
 }
@@ -56,6 +57,21 @@ void ClassicBrushState::setBrush(const ClassicBrush &brush)
 	m_brush.setColor(c);
 	m_smudgedColor = c;
 
+	// Adaptive spacing is safe when each dab fully saturates the
+	// indirect sublayer under it: i.e. the brush is hard and opaque.
+	// Only a hardness of exactly 100% qualifies: dab hardness is sent
+	// in 1/255 steps and anything below 255 selects a softer brush shape.
+	// Even at 99%, the outer ~7% of the dab radius is a soft band (2 px on
+	// a 64 px brush) where the overlap of densely spaced dabs still builds
+	// up opacity, so spreading them out would visibly thin the stroke edge.
+	// At 100% the mask is a hard step and only the antialiased edge pixel
+	// can differ.
+	m_canAdaptSpacing = c.alpha() > 0
+		&& !m_brush.useOpacityPressure()
+		&& m_brush.hardness1() >= 1.0
+		&& (!m_brush.useHardnessPressure() || m_brush.hardness2() >= 1.0)
+		;
+
 	if(m_pendown)
 		qWarning("Brush changed mid-stroke!");
 }
@@ -78,7 +94,7 @@ void ClassicBrushState::strokeTo(const paintcore::Point &to, const paintcore::La
 		dy = dy / dist;
 		const qreal dp = (to.pressure() - m_lastPoint.pressure()) / dist;
 
-		const qreal spacing0 = qMax(1.0, m_brush.spacingDist(m_lastPoint.pressure()));
+		const qreal spacing0 = spacingAt(m_lastPoint.pressure());
 		qreal i;
 		if(m_length>=spacing0)
 			i = 0;
@@ -90,7 +106,7 @@ void ClassicBrushState::strokeTo(const paintcore::Point &to, const paintcore::La
 		paintcore::Point p(m_lastPoint.x() + dx*i, m_lastPoint.y() + dy*i, qBound(0.0, m_lastPoint.pressure() + dp*i, 1.0));
 
 		while(i<=dist) {
-			const qreal spacing = qMax(1.0, m_brush.spacingDist(p.pressure()));
+			const qreal spacing = spacingAt(p.pressure());
 			const qreal smudge = m_brush.smudge(p.pressure());
 
 			if(++m_smudgeDistance > m_brush.resmudge() && smudge>0 && sourceLayer) {
@@ -134,6 +150,22 @@ void ClassicBrushState::strokeTo(const paintcore::Point &to, const paintcore::La
 	m_lastPoint = to;
 }
 
+qreal ClassicBrushState::spacingAt(qreal pressure) const
+{
+	const qreal spacing = qMax(1.0, m_brush.spacingDist(pressure));
+	if(!m_adaptiveSpacing || !m_canAdaptSpacing)
+		return spacing;
+
+	// Two overlapping circles of radius r at distance d leave a dip of
+	// r - sqrt(r² - (d/2)²) in the outline between them. Pick the largest
+	// distance where the dip stays within one dab coordinate unit (1/4 px)
+	static const qreal TOLERANCE = 0.25;
+	const qreal r = m_brush.size(pressure) / 2.0;
+	const qreal maxSpacing = 2 * sqrt(qMax(0.0, 2 * r * TOLERANCE - TOLERANCE * TOLERANCE));
+
+	return qMax(spacing, maxSpacing);
+}
+
 void ClassicBrushState::addDab(const paintcore::Point &point, quint32 color)
 {
 	const int x = point.x() * 4;
@@ -176,6 +208,14 @@ void ClassicBrushState::addDab(const paintcore::Point &point, quint32 color)
 
 void ClassicBrushState::endStroke()
 {
+	// With adaptive spacing, the last dab can be a whole (wide) spacing short
+	// of the pen-up point. Finish the stroke with a dab at the end, so the
+	// stroke is as long as with the regular spacing.
+	if(m_pendown && m_adaptiveSpacing && m_canAdaptSpacing && m_smudgedColor.isValid()) {
+		if(int(m_lastPoint.x() * 4) != m_lastDabX || int(m_lastPoint.y() * 4) != m_lastDabY)
+			addDab(m_lastPoint, m_smudgedColor.rgba());
+	}
+
 	m_pendown = false;
 	m_length = 0;
 	m_smudgeDistance = 0;
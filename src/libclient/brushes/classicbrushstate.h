@@ -59,6 +59,23 @@ public:
 	 */
 	void setLayer(int id) { m_layerId = id; }
 
+	/**
+	 * @brief Enable adaptive dab spacing
+	 *
+	 * When enabled, the dab spacing of fully hard (100%) brushes in indirect mode is
+	 * widened up to the point where the outline of the stroke would start to
+	 * visibly scallop. (Overlapping dabs in such strokes merely saturate the
+	 * sublayer, so the extra dabs do not change the result.) This reduces the
+	 * number of dabs sent, especially with large brushes and small spacing.
+	 * An extra dab is placed at the end of the stroke, so the wider spacing
+	 * doesn't make strokes shorter.
+	 *
+	 * The generated messages are ordinary DrawDabsClassic messages, so
+	 * receivers need no support for this.
+	 */
+	void setAdaptiveSpacing(bool adaptive) { m_adaptiveSpacing = adaptive; }
+	bool isAdaptiveSpacing() const { return m_adaptiveSpacing; }
+
 	/**
 	 * @brief Start or continue a stroke
 	 * @param sourceLayer layer to pick up color from (when smudging)
@@ -89,6 +106,7 @@ public:
 
 private:
 	void addDab(const paintcore::Point &point, quint32 color);
+	qreal spacingAt(qreal pressure) const;
 
 	ClassicBrush m_brush;      // the current brush
 	int m_contextId;           // user context ID
@@ -97,6 +115,8 @@ private:
 	int m_smudgeDistance;      // dabs since last smudge color sampling
 	QColor m_smudgedColor;     // effective color (nonzero alpha indicates indirect drawing mode)
 	bool m_pendown;            // brush stroke in progress?
+	bool m_adaptiveSpacing;    // use adaptive dab spacing when possible
+	bool m_canAdaptSpacing;    // is the current brush one where adaptive spacing can be used?
 	paintcore::Point m_lastPoint;
 
 	protocol::MessageList m_dabs;
@@ -51,6 +51,109 @@ paintcore::BrushMask makeSquarePixelBrushMask(int diameter, uchar opacity)
 	return paintcore::BrushMask(diameter, QVector<uchar>(square(diameter), opacity));
 }
 
+namespace {
+
+// Maximum size of a merged dab run's bounding rectangle (unless the brush is bigger than this)
+static const int MAX_RUN_AREA = 128 * 128;
+
+// Blending modes where compositing a fully opaque mask twice gives
+// the same result as compositing it once.
+bool isIdempotentBlendMode(paintcore::BlendMode::Mode mode)
+{
+	switch(mode) {
+	case paintcore::BlendMode::MODE_NORMAL:
+	case paintcore::BlendMode::MODE_ERASE:
+	case paintcore::BlendMode::MODE_BEHIND:
+	case paintcore::BlendMode::MODE_REPLACE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Find a run of dabs that can be composited as a single mask.
+ *
+ * Dabs in a run are fully opaque and have the same size. The run is cut
+ * short when its bounding rectangle grows too big or too empty (e.g. a
+ * long diagonal line), since then the merged mask would be more expensive
+ * to composite than the individual dabs.
+ *
+ * @param dabs the dab vector
+ * @param index index of the first dab of the run
+ * @param x position of the first dab
+ * @param y position of the first dab
+ * @param bounds the bounding rectangle of the run is returned here
+ * @return index past the last dab of the run
+ */
+int findDabRun(const protocol::PixelBrushDabVector &dabs, int index, int x, int y, QRect &bounds)
+{
+	const int size = dabs.at(index).size;
+	const int offset = size / 2;
+	const int maxArea = qMax(MAX_RUN_AREA, size * size * 4);
+
+	bounds = QRect(x-offset, y-offset, size, size);
+	int coveredArea = size * size;
+	int end = index + 1;
+
+	while(end < dabs.size()) {
+		const protocol::PixelBrushDab &d = dabs.at(end);
+		if(d.size != size || d.opacity != 255)
+			break;
+
+		x += d.x;
+		y += d.y;
+		const QRect b = bounds.united(QRect(x-offset, y-offset, size, size));
+		const int area = b.width() * b.height();
+		coveredArea += size * size;
+
+		if(area > maxArea || area > coveredArea * 4)
+			break;
+
+		bounds = b;
+		++end;
+	}
+
+	return end;
+}
+
+/**
+ * Composite a run of dabs found with findDabRun.
+ *
+ * The union of the dab masks is drawn into a single coverage mask, which
+ * is then composited in one go, so each pixel of the layer is touched only
+ * once no matter how densely the dabs overlap.
+ */
+void drawDabRun(const protocol::PixelBrushDab *dabs, int count, int x, int y, bool square, const QRect &bounds, const QColor &color, paintcore::BlendMode::Mode blendmode, paintcore::EditableLayer &layer)
+{
+	const int size = dabs[0].size;
+	const int offset = size / 2;
+	const int stride = bounds.width();
+	const paintcore::BrushMask mask = square ? makeSquarePixelBrushMask(size, 255) : makeRoundPixelBrushMask(size, 255);
+
+	QVector<uchar> coverage(bounds.width() * bounds.height(), 0);
+
+	for(int i=0;i<count;++i) {
+		if(i>0) {
+			x += dabs[i].x;
+			y += dabs[i].y;
+		}
+
+		const uchar *src = mask.data();
+		uchar *dest = coverage.data() + (y - offset - bounds.top()) * stride + (x - offset - bounds.left());
+		for(int my=0;my<size;++my) {
+			for(int mx=0;mx<size;++mx)
+				dest[mx] |= src[mx];
+			src += size;
+			dest += stride;
+		}
+	}
+
+	layer.putMask(bounds.left(), bounds.top(), bounds.width(), bounds.height(), coverage.constData(), color, blendmode);
+}
+
+}
+
 void drawPixelBrushDabs(const protocol::DrawDabsPixel &dabs, paintcore::EditableLayer layer, int sublayer)
 {
 	if(dabs.dabs().isEmpty()) {
@@ -70,15 +173,37 @@ void drawPixelBrushDabs(const protocol::DrawDabsPixel &dabs, paintcore::Editable
 		blendmode = paintcore::BlendMode::MODE_NORMAL;
 	}
 
+	const bool canMerge = isIdempotentBlendMode(blendmode);
+	const protocol::PixelBrushDabVector &dv = dabs.dabs();
+
 	paintcore::BrushMask mask;
 	int lastSize = -1, lastOpacity = 0;
 
 	int lastX = dabs.originX();
 	int lastY = dabs.originY();
-	for(const protocol::PixelBrushDab &d : dabs.dabs()) {
+	int i = 0;
+	while(i < dv.size()) {
+		const protocol::PixelBrushDab &d = dv.at(i);
 		const int nextX = lastX + d.x;
 		const int nextY = lastY + d.y;
 
+		// Hard dabs overlapping each other can be merged into a single mask
+		if(canMerge && d.opacity == 255 && d.size > 0) {
+			QRect bounds;
+			const int end = findDabRun(dv, i, nextX, nextY, bounds);
+			if(end - i > 1) {
+				drawDabRun(dv.constData() + i, end - i, nextX, nextY, dabs.isSquare(), bounds, color, blendmode, layer);
+
+				lastX = nextX;
+				lastY = nextY;
+				for(++i;i<end;++i) {
+					lastX += dv.at(i).x;
+					lastY += dv.at(i).y;
+				}
+				continue;
+			}
+		}
+
 		if(d.size != lastSize|| d.opacity != lastOpacity) {
 			// The mask is often reusable
 			mask = dabs.isSquare() ? makeSquarePixelBrushMask(d.size, d.opacity) : makeRoundPixelBrushMask(d.size, d.opacity);
@@ -95,6 +220,7 @@ void drawPixelBrushDabs(const protocol::DrawDabsPixel &dabs, paintcore::Editable
 
 		lastX = nextX;
 		lastY = nextY;
+		++i;
 	}
 }
 
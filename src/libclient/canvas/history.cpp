@@ -19,20 +19,82 @@
 
 #include "history.h"
 #include "../libshared/net/undo.h"
+#include "../libshared/net/recording.h"
+
+#include <algorithm>
 
 namespace canvas {
 
 using namespace protocol;
 
+// Size of a history storage chunk. A message is never split between chunks.
+static const int CHUNK_SIZE = 1024 * 1024;
+
 History::History()
-	: m_offset(0), m_bytes(0)
+	: m_indexStart(0), m_firstChunk(0), m_offset(0), m_bytes(0)
+{
+}
+
+MessagePtr History::at(int pos) const
+{
+	const Entry &e = entry(pos);
+	const QByteArray &chunk = m_chunks.at(e.chunk - m_firstChunk);
+	const uchar *data = reinterpret_cast<const uchar*>(chunk.constData()) + e.offset;
+
+	NullableMessageRef msg = Message::deserialize(data, e.length, true);
+	if(msg.isNull()) {
+		// Shouldn't happen, since everything in the history was serializable
+		qWarning("History: couldn't decode message %d (type %d)", pos, e.type);
+		const int len = qMin(e.length - Message::HEADER_LEN + 1, 0xffff);
+		uchar *payload = new uchar[len];
+		payload[0] = e.type;
+		memcpy(payload+1, data+Message::HEADER_LEN, len-1);
+		return MessagePtr(new Filtered(e.contextId, payload, len));
+	}
+
+	msg->setUndoState(MessageUndoState(e.undoState));
+	return MessagePtr::fromNullable(msg);
+}
+
+void History::setUndoState(int pos, MessageUndoState state)
 {
+	Q_ASSERT(isValidIndex(pos));
+	Entry &e = m_index[pos - m_offset + m_indexStart];
+	if(e.undoable)
+		e.undoState = state;
 }
 
 void History::append(MessagePtr msg)
 {
-	m_messages.append(msg);
-	m_bytes += msg->length();
+	const int len = msg->length();
+
+	if(m_chunks.isEmpty() || m_chunks.last().size() + len > CHUNK_SIZE) {
+		m_chunks.append(QByteArray());
+		m_chunks.last().reserve(qMax(CHUNK_SIZE, len));
+	}
+
+	QByteArray &chunk = m_chunks.last();
+	const int offset = chunk.size();
+	chunk.resize(offset + len);
+	msg->serialize(chunk.data() + offset);
+
+	m_index.append(Entry {
+		m_firstChunk + m_chunks.size() - 1,
+		quint32(offset),
+		quint8(msg->type()),
+		msg->contextId(),
+		quint8(msg->undoState()),
+		msg->isUndoable(),
+		len
+	});
+	m_bytes += len;
+
+	const int pos = end() - 1;
+	m_contextMessages[msg->contextId()].append(pos);
+	if(msg->type() == MSG_UNDOPOINT) {
+		m_contextUndoPoints[msg->contextId()].append(pos);
+		m_undoPoints.append(pos);
+	}
 }
 
 void History::cleanup(int indexlimit)
@@ -40,17 +102,99 @@ void History::cleanup(int indexlimit)
 	Q_ASSERT(indexlimit <= end());
 
 	while(m_offset < indexlimit) {
-		m_bytes -= m_messages.takeFirst()->length();
+		m_bytes -= m_index.at(m_indexStart++).length;
 		++m_offset;
 	}
+
+	// Release the chunks that are no longer needed.
+	// The last chunk is kept, since new messages are still added to it.
+	const int firstNeeded = m_indexStart < m_index.size()
+		? m_index.at(m_indexStart).chunk
+		: m_firstChunk + m_chunks.size() - 1;
+
+	if(firstNeeded > m_firstChunk) {
+		m_chunks.remove(0, firstNeeded - m_firstChunk);
+		m_firstChunk = firstNeeded;
+	}
+
+	// Compact the index once the unused part dominates
+	if(m_indexStart > 1024 && m_indexStart > m_index.size() / 2) {
+		m_index.remove(0, m_indexStart);
+		m_indexStart = 0;
+	}
+
+	for(int i=0;i<256;++i) {
+		trim(m_contextMessages[i], m_offset);
+		trim(m_contextUndoPoints[i], m_offset);
+	}
+	trim(m_undoPoints, m_offset);
+}
+
+void History::trim(QVector<int> &list, int offset)
+{
+	// Positions older than the offset are ignored by range(),
+	// so they only need to be removed once they start taking up space
+	if(list.isEmpty() || list.first() >= offset)
+		return;
+
+	const int stale = int(std::lower_bound(list.constBegin(), list.constEnd(), offset) - list.constBegin());
+	if(stale == list.size())
+		list.clear();
+	else if(stale > 64 && stale > list.size() / 2)
+		list.remove(0, stale);
+}
+
+History::Positions History::range(const QVector<int> &list, int from, int to) const
+{
+	const int *first = std::lower_bound(list.constBegin(), list.constEnd(), qMax(from, m_offset));
+	const int *last = std::lower_bound(first, list.constEnd(), qMax(to, m_offset));
+	return Positions(first, last);
+}
+
+int History::findUndoPoint(int pos, int n) const
+{
+	Q_ASSERT(n > 0);
+	const Positions ups = undoPoints(m_offset, pos+1);
+	if(ups.size() < n)
+		return -1;
+	return *(ups.end() - n);
 }
 
 void History::resetTo(int newoffset)
 {
 	Q_ASSERT(newoffset >= 0);
 	m_offset = newoffset;
-	m_messages.clear();
+	m_firstChunk += m_chunks.size();
+	m_chunks.clear();
+	m_index.clear();
+	m_indexStart = 0;
 	m_bytes = 0;
+
+	for(int i=0;i<256;++i) {
+		m_contextMessages[i].clear();
+		m_contextUndoPoints[i].clear();
+	}
+	m_undoPoints.clear();
+}
+
+qint64 History::memoryUsage() const
+{
+	qint64 size = qint64(m_index.capacity()) * sizeof(Entry);
+	for(const QByteArray &chunk : m_chunks)
+		size += chunk.capacity();
+	for(int i=0;i<256;++i)
+		size += qint64(m_contextMessages[i].capacity() + m_contextUndoPoints[i].capacity()) * sizeof(int);
+	size += qint64(m_undoPoints.capacity()) * sizeof(int);
+	return size;
+}
+
+MessageList History::toList() const
+{
+	MessageList list;
+	list.reserve(end() - offset());
+	for(int i=offset();i<end();++i)
+		list << at(i);
+	return list;
 }
 
 }
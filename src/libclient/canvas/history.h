@@ -21,6 +21,8 @@
 #define CANVAS_HISTORY_H
 
 #include <QList>
+#include <QVector>
+#include <QByteArray>
 
 #include "../libshared/net/message.h"
 
@@ -32,9 +34,29 @@ namespace canvas {
  * The whole session history might not be in memory, but it
  * should always contain enough messages to reach
  * end of the Undo history.
+ *
+ * To keep the memory footprint of long sessions small, the messages
+ * are stored in serialized form in large contiguous chunks. An index
+ * of the message header fields and undo states is kept on the side,
+ * so the history can be searched without decoding the messages.
+ * The messages themselves are decoded on demand by at().
  */
 class History {
 public:
+	//! A range of message positions
+	class Positions {
+	public:
+		Positions(const int *first, const int *last) : m_first(first), m_last(last) { }
+
+		const int *begin() const { return m_first; }
+		const int *end() const { return m_last; }
+		bool isEmpty() const { return m_first == m_last; }
+		int size() const { return int(m_last - m_first); }
+
+	private:
+		const int *m_first, *m_last;
+	};
+
 	History();
 
 	/**
@@ -51,7 +73,7 @@ public:
 	 * @brief Get the end index of the stream
 	 * @return
 	 */
-	int end() const { return m_offset + m_messages.size(); }
+	int end() const { return m_offset + m_index.size() - m_indexStart; }
 
 	/**
 	 * @brief Check if a message at the given index is in memory
@@ -62,8 +84,28 @@ public:
 
 	/**
 	 * @brief at Get the message at the given index
+	 *
+	 * The message is decoded from the stored data. Changes made to the returned
+	 * message are not reflected in the history: use setUndoState() to change
+	 * the undo state of a stored message.
 	 */
-	protocol::MessagePtr at(int pos) const { return m_messages.at(pos-m_offset); }
+	protocol::MessagePtr at(int pos) const;
+
+	//! Get the type of the message at the given index
+	protocol::MessageType type(int pos) const { return protocol::MessageType(entry(pos).type); }
+
+	//! Get the context ID of the message at the given index
+	uint8_t contextId(int pos) const { return entry(pos).contextId; }
+
+	//! Get the undo state of the message at the given index
+	protocol::MessageUndoState undoState(int pos) const { return protocol::MessageUndoState(entry(pos).undoState); }
+
+	/**
+	 * @brief Change the undo state of the message at the given index
+	 *
+	 * Like Message::setUndoState, this does nothing if the message is not undoable.
+	 */
+	void setUndoState(int pos, protocol::MessageUndoState state);
 
 	/**
 	 * @brief Add a new command to the stream
@@ -92,16 +134,89 @@ public:
 	 */
 	uint lengthInBytes() const { return m_bytes; }
 
+	/**
+	 * @brief Get the approximate amount of memory used by the history
+	 * @return memory usage in bytes
+	 */
+	qint64 memoryUsage() const;
+
+	/**
+	 * @brief Get the positions of the messages by the given user
+	 *
+	 * @param ctxId the user's context ID
+	 * @param from start of the range (inclusive)
+	 * @param to end of the range (exclusive)
+	 * @return positions in ascending order
+	 */
+	Positions messagesBy(uint8_t ctxId, int from, int to) const { return range(m_contextMessages[ctxId], from, to); }
+
+	/**
+	 * @brief Get the positions of the undo points made by the given user
+	 *
+	 * @param ctxId the user's context ID
+	 * @param from start of the range (inclusive)
+	 * @param to end of the range (exclusive)
+	 * @return positions in ascending order
+	 */
+	Positions undoPointsBy(uint8_t ctxId, int from, int to) const { return range(m_contextUndoPoints[ctxId], from, to); }
+
+	/**
+	 * @brief Get the positions of all undo points
+	 *
+	 * @param from start of the range (inclusive)
+	 * @param to end of the range (exclusive)
+	 * @return positions in ascending order
+	 */
+	Positions undoPoints(int from, int to) const { return range(m_undoPoints, from, to); }
+
+	/**
+	 * @brief Find the Nth undo point counting backwards from the given position
+	 *
+	 * @param pos the position to start from (inclusive)
+	 * @param n 1 for the first undo point at or before pos, 2 for the one before it, etc.
+	 * @return position of the undo point or -1 if not in memory
+	 */
+	int findUndoPoint(int pos, int n) const;
+
 	/**
 	 * @brief return the whole stream as a list
+	 *
+	 * Note: this decodes every stored message
 	 * @return list of messages
 	 */
-	protocol::MessageList toList() const { return m_messages; }
+	protocol::MessageList toList() const;
 
 private:
-	protocol::MessageList m_messages;
+	struct Entry {
+		int chunk;          // serial number of the chunk the message is in
+		quint32 offset;     // position of the message in the chunk
+		quint8 type;
+		quint8 contextId;
+		quint8 undoState;
+		bool undoable;
+		int length;         // serialized length (header included)
+	};
+
+	Positions range(const QVector<int> &list, int from, int to) const;
+	static void trim(QVector<int> &list, int offset);
+
+	const Entry &entry(int pos) const {
+		Q_ASSERT(isValidIndex(pos));
+		return m_index.at(pos - m_offset + m_indexStart);
+	}
+
+	QVector<QByteArray> m_chunks;
+	QVector<Entry> m_index;
+	int m_indexStart; // removing from the front of the index is done lazily
+	int m_firstChunk; // serial number of m_chunks.first()
 	int m_offset;
 	uint m_bytes;
+
+	// Message positions indexed by context ID, so a user's
+	// messages can be found without going through everyone's
+	QVector<int> m_contextMessages[256];
+	QVector<int> m_contextUndoPoints[256];
+	QVector<int> m_undoPoints;
 };
 
 }
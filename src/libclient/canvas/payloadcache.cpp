@@ -0,0 +1,129 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "payloadcache.h"
+
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+
+namespace canvas {
+
+struct PayloadCache::Pending {
+	QByteArray compressed;
+	QByteArray result;
+	QSemaphore done;
+	int expectedLength;
+};
+
+class PayloadCache::DecompressRunnable : public QRunnable
+{
+public:
+	explicit DecompressRunnable(const QSharedPointer<Pending> &pending)
+		: m_pending(pending)
+	{ }
+
+	void run() override
+	{
+		m_pending->result = qUncompress(m_pending->compressed);
+		m_pending->done.release();
+	}
+
+private:
+	QSharedPointer<Pending> m_pending;
+};
+
+PayloadCache::PayloadCache(int budget)
+	: m_cache(budget), m_pendingBytes(0), m_hits(0)
+{
+}
+
+PayloadCache::~PayloadCache()
+{
+	// Runnables still in the thread pool hold their own reference
+	// to the pending job, so there is no need to wait for them.
+}
+
+QByteArray PayloadCache::decompress(const QByteArray &compressed)
+{
+	const QByteArray *cached = m_cache.object(compressed);
+	if(cached) {
+		++m_hits;
+		return *cached;
+	}
+
+	QByteArray data;
+
+	const QSharedPointer<Pending> pending = m_pending.take(compressed);
+	if(pending) {
+		pending->done.acquire();
+		data = pending->result;
+		m_pendingBytes -= pending->expectedLength;
+
+	} else {
+		data = qUncompress(compressed);
+	}
+
+	if(!data.isEmpty())
+		m_cache.insert(compressed, new QByteArray(data), data.length());
+
+	return data;
+}
+
+void PayloadCache::prefetch(const QByteArray &compressed, int expectedLength)
+{
+	if(compressed.isEmpty() || expectedLength <= 0)
+		return;
+
+	if(m_pendingBytes + expectedLength > m_cache.maxCost())
+		return;
+
+	if(m_pending.contains(compressed) || m_cache.contains(compressed))
+		return;
+
+	QSharedPointer<Pending> pending(new Pending);
+	pending->compressed = compressed;
+	pending->expectedLength = expectedLength;
+
+	m_pending[compressed] = pending;
+	m_pendingBytes += expectedLength;
+
+	QThreadPool::globalInstance()->start(new DecompressRunnable(pending));
+}
+
+void PayloadCache::release(const QByteArray &compressed)
+{
+	const QSharedPointer<Pending> pending = m_pending.take(compressed);
+	if(pending)
+		m_pendingBytes -= pending->expectedLength;
+}
+
+void PayloadCache::clearPrefetches()
+{
+	m_pending.clear();
+	m_pendingBytes = 0;
+}
+
+void PayloadCache::clear()
+{
+	clearPrefetches();
+	m_cache.clear();
+}
+
+}
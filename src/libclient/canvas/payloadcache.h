@@ -0,0 +1,110 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CANVAS_PAYLOADCACHE_H
+#define CANVAS_PAYLOADCACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QHash>
+#include <QSharedPointer>
+
+namespace canvas {
+
+/**
+ * @brief A cache of decompressed image payloads
+ *
+ * PutImage, PutTile and CanvasBackground messages carry zlib compressed
+ * pixel data. The same messages are executed again on every undo and
+ * local fork rollback that replays them, so the decompressed data is cached
+ * here, keyed by the compressed payload. (Messages are re-created from the
+ * serialized history on replay, so the message object itself can't hold
+ * the cache.)
+ *
+ * Payloads can also be decompressed ahead of time in the global thread pool.
+ * This is used during catch-up, when many messages are waiting in the queue.
+ */
+class PayloadCache
+{
+public:
+	/**
+	 * @brief Construct a cache
+	 * @param budget maximum size of the cached decompressed data in bytes
+	 */
+	explicit PayloadCache(int budget);
+	~PayloadCache();
+
+	PayloadCache(const PayloadCache&) = delete;
+	PayloadCache &operator=(const PayloadCache&) = delete;
+
+	/**
+	 * @brief Get the decompressed content of a payload
+	 *
+	 * If the payload is not cached or being prefetched, it is decompressed now.
+	 * An empty array is returned if decompression fails.
+	 */
+	QByteArray decompress(const QByteArray &compressed);
+
+	/**
+	 * @brief Start decompressing a payload in the background
+	 *
+	 * Nothing is done if the payload is already cached or the prefetch
+	 * budget is exhausted.
+	 *
+	 * @param compressed the compressed payload
+	 * @param expectedLength the expected decompressed size (used for budgeting)
+	 */
+	void prefetch(const QByteArray &compressed, int expectedLength);
+
+	/**
+	 * @brief Drop a prefetched payload that will not be used
+	 *
+	 * This frees the payload's share of the prefetch budget.
+	 * Nothing is done if the payload is not being prefetched.
+	 */
+	void release(const QByteArray &compressed);
+
+	//! Forget all prefetches that haven't been used yet
+	void clearPrefetches();
+
+	//! Forget everything
+	void clear();
+
+	//! Number of decompressions avoided (for statistics)
+	int hits() const { return m_hits; }
+
+	//! Number of payloads prefetched and not yet used
+	int pendingCount() const { return m_pending.size(); }
+
+	//! Expected decompressed size of the payloads prefetched and not yet used
+	int pendingBytes() const { return m_pendingBytes; }
+
+private:
+	struct Pending;
+	class DecompressRunnable;
+
+	QCache<QByteArray, QByteArray> m_cache;
+	QHash<QByteArray, QSharedPointer<Pending>> m_pending;
+	int m_pendingBytes;
+	int m_hits;
+};
+
+}
+
+#endif
@@ -23,6 +23,45 @@ using protocol::MessagePtr;
 
 namespace canvas {
 
+namespace {
+
+// Size of the spatial index buckets (in pixels)
+static const int BUCKET_SIZE = 128;
+
+// Areas touching more buckets than this are not put in the spatial index
+static const int MAX_BUCKETS = 256;
+
+int bucketOf(int coordinate)
+{
+	return coordinate >= 0 ? coordinate / BUCKET_SIZE : (coordinate - BUCKET_SIZE + 1) / BUCKET_SIZE;
+}
+
+quint64 bucketKey(int layer, int bx, int by)
+{
+	// Coordinates are truncated to 24 bits. Hash collisions just
+	// cause some extra intersection tests, so that's fine.
+	return (quint64(quint16(layer)) << 48) | (quint64(by & 0xffffff) << 24) | quint64(bx & 0xffffff);
+}
+
+//! Iterate through the index buckets touched by the given rectangle
+template<typename Func> void forEachBucket(int layer, const QRect &rect, Func func)
+{
+	const int bx0 = bucketOf(rect.left());
+	const int bx1 = bucketOf(rect.right());
+	const int by0 = bucketOf(rect.top());
+	const int by1 = bucketOf(rect.bottom());
+	for(int by=by0;by<=by1;++by)
+		for(int bx=bx0;bx<=bx1;++bx)
+			func(bucketKey(layer, bx, by));
+}
+
+bool isLarge(const QRect &rect)
+{
+	return qint64(bucketOf(rect.right()) - bucketOf(rect.left()) + 1) * (bucketOf(rect.bottom()) - bucketOf(rect.top()) + 1) > MAX_BUCKETS;
+}
+
+}
+
 bool AffectedArea::isConcurrentWith(const AffectedArea &other) const
 {
 	if(m_domain == EVERYTHING || other.m_domain == EVERYTHING)
@@ -45,6 +84,7 @@ void LocalFork::setOffset(int offset)
 
 void LocalFork::addLocalMessage(MessagePtr msg, const AffectedArea &area)
 {
+	indexArea(area, m_firstSerial + m_areas.size());
 	m_messages.append(msg);
 	m_areas.append(area);
 }
@@ -54,6 +94,127 @@ void LocalFork::clear()
 	m_fallenBehind = 0;
 	m_messages.clear();
 	m_areas.clear();
+
+	m_firstSerial = 0;
+	m_everything = 0;
+	m_layerAttrs.clear();
+	m_annotations.clear();
+	m_pixels.clear();
+	m_largePixels.clear();
+}
+
+void LocalFork::removeFirst()
+{
+	unindexArea(m_areas.first(), m_firstSerial);
+	++m_firstSerial;
+	m_messages.removeFirst();
+	m_areas.removeFirst();
+}
+
+void LocalFork::indexArea(const AffectedArea &area, int serial)
+{
+	switch(area.domain()) {
+	case AffectedArea::USERATTRS: break;
+	case AffectedArea::EVERYTHING: ++m_everything; break;
+	case AffectedArea::LAYERATTRS: ++m_layerAttrs[area.layer()]; break;
+	case AffectedArea::ANNOTATION: ++m_annotations[area.layer()]; break;
+	case AffectedArea::PIXELS:
+		if(area.bounds().isEmpty())
+			break;
+		if(isLarge(area.bounds()))
+			m_largePixels[area.layer()].append(serial);
+		else
+			forEachBucket(area.layer(), area.bounds(), [this, serial](quint64 key) { m_pixels[key].append(serial); });
+		break;
+	}
+}
+
+void LocalFork::unindexArea(const AffectedArea &area, int serial)
+{
+	// Since areas are always removed from the front of the fork,
+	// the area being removed is always the oldest in its bucket.
+	const auto removeSerial = [serial](QHash<quint64, QVector<int>> &index, quint64 key) {
+		auto i = index.find(key);
+		if(i != index.end()) {
+			i->removeOne(serial);
+			if(i->isEmpty())
+				index.erase(i);
+		}
+	};
+
+	switch(area.domain()) {
+	case AffectedArea::USERATTRS: break;
+	case AffectedArea::EVERYTHING: --m_everything; break;
+	case AffectedArea::LAYERATTRS:
+		if(--m_layerAttrs[area.layer()] <= 0)
+			m_layerAttrs.remove(area.layer());
+		break;
+	case AffectedArea::ANNOTATION:
+		if(--m_annotations[area.layer()] <= 0)
+			m_annotations.remove(area.layer());
+		break;
+	case AffectedArea::PIXELS:
+		if(area.bounds().isEmpty())
+			break;
+		if(isLarge(area.bounds())) {
+			auto i = m_largePixels.find(area.layer());
+			if(i != m_largePixels.end()) {
+				i->removeOne(serial);
+				if(i->isEmpty())
+					m_largePixels.erase(i);
+			}
+		} else {
+			forEachBucket(area.layer(), area.bounds(), [this, &removeSerial](quint64 key) { removeSerial(m_pixels, key); });
+		}
+		break;
+	}
+}
+
+bool LocalFork::isConcurrentWith(const AffectedArea &area) const
+{
+	// This is equivalent to checking area.isConcurrentWith(a) for every area in the fork
+	if(m_everything > 0)
+		return false;
+
+	switch(area.domain()) {
+	case AffectedArea::EVERYTHING: return false;
+	case AffectedArea::USERATTRS: return true;
+	case AffectedArea::LAYERATTRS: return !m_layerAttrs.contains(area.layer());
+	case AffectedArea::ANNOTATION: return !m_annotations.contains(area.layer());
+	case AffectedArea::PIXELS: break;
+	}
+
+	const QRect &bounds = area.bounds();
+	const auto intersects = [this, &bounds](const QVector<int> &serials) {
+		for(const int serial : serials) {
+			if(m_areas.at(serial - m_firstSerial).bounds().intersects(bounds))
+				return true;
+		}
+		return false;
+	};
+
+	if(intersects(m_largePixels.value(area.layer())))
+		return false;
+
+	if(isLarge(bounds)) {
+		// Checking the buckets would be slower than going through the areas
+		for(const AffectedArea &a : m_areas) {
+			if(!area.isConcurrentWith(a))
+				return false;
+		}
+		return true;
+	}
+
+	bool concurrent = true;
+	forEachBucket(area.layer(), bounds, [this, &intersects, &concurrent](quint64 key) {
+		if(concurrent) {
+			const auto i = m_pixels.constFind(key);
+			if(i != m_pixels.constEnd() && intersects(*i))
+				concurrent = false;
+		}
+	});
+
+	return concurrent;
 }
 
 LocalFork::MessageAction LocalFork::handleReceivedMessage(MessagePtr msg, const AffectedArea &area)
@@ -67,8 +228,7 @@ LocalFork::MessageAction LocalFork::handleReceivedMessage(MessagePtr msg, const
 	// Check if this is our own message that has finished its roundtrip
 	if(msg->contextId() == m_messages.first()->contextId()) {
 		if(msg.equals(m_messages.first())) {
-			m_messages.removeFirst();
-			m_areas.removeFirst();
+			removeFirst();
 			if(m_messages.isEmpty())
 				m_fallenBehind = 0;
 			return ALREADYDONE;
@@ -95,13 +255,7 @@ LocalFork::MessageAction LocalFork::handleReceivedMessage(MessagePtr msg, const
 		}
 	}
 
-	for(const AffectedArea &a : m_areas) {
-		if(!area.isConcurrentWith(a)) {
-			return ROLLBACK;
-		}
-	}
-
-	return CONCURRENT;
+	return isConcurrentWith(area) ? CONCURRENT : ROLLBACK;
 }
 
 }
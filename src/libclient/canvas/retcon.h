@@ -24,6 +24,8 @@
 
 #include <QRect>
 #include <QList>
+#include <QHash>
+#include <QVector>
 
 namespace canvas {
 
@@ -51,6 +53,10 @@ public:
 
 	bool isConcurrentWith(const AffectedArea &other) const;
 
+	Domain domain() const { return m_domain; }
+	int layer() const { return m_layer; }
+	const QRect &bounds() const { return m_bounds; }
+
 private:
 	Domain m_domain;
 	int m_layer;
@@ -75,7 +81,7 @@ public:
 		ROLLBACK     // message was not concurrent with the local fork: rollback is needed
 	};
 
-	LocalFork() : m_offset(0), m_maxFallBehind(0), m_fallenBehind(0) { }
+	LocalFork() : m_offset(0), m_maxFallBehind(0), m_fallenBehind(0), m_firstSerial(0), m_everything(0) { }
 
 	/**
 	 * @brief Set the maximum number of messages the local fork is allowed to fall behind the mainline history
@@ -148,11 +154,27 @@ public:
 	void clear();
 
 private:
+	void indexArea(const AffectedArea &area, int serial);
+	void unindexArea(const AffectedArea &area, int serial);
+	void removeFirst();
+	bool isConcurrentWith(const AffectedArea &area) const;
+
 	protocol::MessageList m_messages;
 	QList<AffectedArea> m_areas;
 	int m_offset;
 	int m_maxFallBehind;
 	int m_fallenBehind;
+
+	// Index of the areas, so received messages don't need to be
+	// checked against every area in the local fork one by one.
+	// Areas are identified by serial numbers: the serial number
+	// of m_areas[i] is m_firstSerial+i
+	int m_firstSerial;
+	int m_everything; // number of EVERYTHING domain areas
+	QHash<int, int> m_layerAttrs; // layer ID -> number of LAYERATTRS areas
+	QHash<int, int> m_annotations; // annotation ID -> number of ANNOTATION areas
+	QHash<quint64, QVector<int>> m_pixels; // (layer, bucket) -> PIXELS areas touching the bucket
+	QHash<int, QVector<int>> m_largePixels; // layer -> PIXELS areas too large to put in buckets
 };
 
 }
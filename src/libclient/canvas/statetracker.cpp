@@ -41,16 +41,213 @@
 #include <QElapsedTimer>
 #include <QSettings>
 #include <QPainter>
+#include <QBitArray>
+
+#include <algorithm>
 
 namespace canvas {
 
+namespace {
+
+// Fixed replay cost of any message (in the same units as pixels)
+static const qint64 MESSAGE_COST = 64;
+
+// Initial guess of the replay rate (pixels per millisecond) before any measurements are made
+static const qreal DEFAULT_REPLAY_RATE = 20000;
+
+// Minimum cost of work done for a replay rate measurement to be meaningful
+static const qint64 MIN_RATE_SAMPLE_COST = 100000;
+
+// How often the canvas is refreshed during catch-up (milliseconds)
+static const int CATCHUP_CHECKPOINT_INTERVAL = 250;
+
+// Memory budget for decompressed image payloads
+static const int PAYLOAD_CACHE_SIZE = 64 * 1024 * 1024;
+
+/**
+ * @brief Estimate how expensive it is to execute the given command
+ *
+ * The cost is roughly the number of pixels the command composites.
+ */
+qint64 estimateCost(const protocol::Message &msg)
+{
+	using namespace protocol;
+	switch(msg.type()) {
+	case MSG_DRAWDABS_CLASSIC: {
+		qint64 cost = 0;
+		for(const ClassicBrushDab &d : static_cast<const DrawDabsClassic&>(msg).dabs())
+			cost += (qint64(d.size) * d.size) >> 16;
+		return MESSAGE_COST + cost;
+	}
+	case MSG_DRAWDABS_PIXEL:
+	case MSG_DRAWDABS_PIXEL_SQUARE: {
+		qint64 cost = 0;
+		for(const PixelBrushDab &d : static_cast<const DrawDabsPixel&>(msg).dabs())
+			cost += d.size * d.size;
+		return MESSAGE_COST + cost;
+	}
+	case MSG_PEN_UP:
+		// Merging the sublayer: actual size not known in advance
+		return MESSAGE_COST + paintcore::Tile::LENGTH * 4;
+	case MSG_PUTIMAGE: {
+		const PutImage &m = static_cast<const PutImage&>(msg);
+		return MESSAGE_COST + qint64(m.width()) * m.height();
+	}
+	case MSG_PUTTILE:
+	case MSG_CANVAS_BACKGROUND:
+	case MSG_LAYER_CREATE:
+		return MESSAGE_COST + paintcore::Tile::LENGTH;
+	case MSG_FILLRECT: {
+		const FillRect &m = static_cast<const FillRect&>(msg);
+		return MESSAGE_COST + qint64(m.width()) * m.height();
+	}
+	case MSG_REGION_MOVE: {
+		const QRect b = static_cast<const MoveRegion&>(msg).sourceBounds();
+		return MESSAGE_COST + qint64(b.width()) * b.height() * 2;
+	}
+	default:
+		return MESSAGE_COST;
+	}
+}
+
+}
+
+namespace {
+
+enum class ReplayDomain {
+	Nothing,    // command does not touch layer pixels
+	Pixels,     // command touches the pixels inside the given bounds
+	Unsupported // command cannot be selectively replayed
+};
+
+/**
+ * @brief Find out which layer pixels a command touches
+ *
+ * This is used for selective undo replay. Note the difference to affectedArea():
+ * indirect dabs have bounds, and commands that change the layer stack's
+ * structure are not supported at all.
+ *
+ * @param msg the command
+ * @param canvas canvas bounds
+ * @param layer the affected layer's ID is returned here
+ * @param bounds the affected area (clipped to the canvas) is returned here
+ */
+ReplayDomain replayDomain(const protocol::Message &msg, const QRect &canvas, int &layer, QRect &bounds)
+{
+	using namespace protocol;
+
+	switch(msg.type()) {
+	case MSG_DRAWDABS_CLASSIC:
+	case MSG_DRAWDABS_PIXEL:
+	case MSG_DRAWDABS_PIXEL_SQUARE:
+		bounds = static_cast<const DrawDabs&>(msg).bounds();
+		break;
+	case MSG_PUTIMAGE: {
+		const PutImage &m = static_cast<const PutImage&>(msg);
+		bounds = QRect(m.x(), m.y(), m.width(), m.height());
+		break;
+	}
+	case MSG_PUTTILE: {
+		const PutTile &m = static_cast<const PutTile&>(msg);
+		if(m.sublayer() != 0 || m.repeat() != 0)
+			return ReplayDomain::Unsupported;
+		bounds = QRect(m.column() * paintcore::Tile::SIZE, m.row() * paintcore::Tile::SIZE, paintcore::Tile::SIZE, paintcore::Tile::SIZE);
+		break;
+	}
+	case MSG_FILLRECT: {
+		const FillRect &m = static_cast<const FillRect&>(msg);
+		bounds = QRect(m.x(), m.y(), m.width(), m.height());
+		break;
+	}
+	case MSG_REGION_MOVE: {
+		const MoveRegion &m = static_cast<const MoveRegion&>(msg);
+		bounds = m.sourceBounds().united(m.targetBounds());
+		break;
+	}
+	case MSG_LAYER_ATTR:
+		if(static_cast<const LayerAttributes&>(msg).sublayer() != 0)
+			return ReplayDomain::Unsupported;
+		return ReplayDomain::Nothing;
+
+	case MSG_PEN_UP:
+	case MSG_UNDOPOINT:
+	case MSG_LAYER_VISIBILITY:
+	case MSG_LAYER_RETITLE:
+	case MSG_LAYER_ORDER:
+	case MSG_CANVAS_BACKGROUND:
+	case MSG_ANNOTATION_CREATE:
+	case MSG_ANNOTATION_RESHAPE:
+	case MSG_ANNOTATION_EDIT:
+	case MSG_ANNOTATION_DELETE:
+		return ReplayDomain::Nothing;
+
+	default:
+		return ReplayDomain::Unsupported;
+	}
+
+	layer = msg.layer();
+	bounds &= canvas;
+	return bounds.isEmpty() ? ReplayDomain::Nothing : ReplayDomain::Pixels;
+}
+
+}
+
 struct StateSavepoint::Data : public QSharedData {
 	int streampointer = 0;
 	qint64 timestamp = 0;
+	qint64 streamCost = 0; // estimated cost of replaying the history up to this point
 	paintcore::Savepoint canvas;
 	QVector<LayerListItem> layermodel;
+
+	// Sorted IDs of the tiles referenced by this savepoint (generated on demand)
+	mutable QVector<quintptr> tiles;
 };
 
+namespace {
+
+void collectTileIds(const paintcore::Layer *layer, QVector<quintptr> &ids)
+{
+	for(const paintcore::Tile &t : layer->tiles()) {
+		if(!t.isNull())
+			ids << reinterpret_cast<quintptr>(t.constData());
+	}
+	for(const paintcore::Layer *sublayer : layer->sublayers())
+		collectTileIds(sublayer, ids);
+}
+
+const QVector<quintptr> &savepointTiles(const StateSavepoint &sp)
+{
+	if(sp->tiles.isEmpty()) {
+		for(const paintcore::Layer *l : sp->canvas.layers)
+			collectTileIds(l, sp->tiles);
+		if(!sp->canvas.background.isNull())
+			sp->tiles << reinterpret_cast<quintptr>(sp->canvas.background.constData());
+
+		std::sort(sp->tiles.begin(), sp->tiles.end());
+		sp->tiles.erase(std::unique(sp->tiles.begin(), sp->tiles.end()), sp->tiles.end());
+	}
+	return sp->tiles;
+}
+
+// Count the tiles in a that are in neither b nor c. (All vectors must be sorted.)
+int countUniqueTiles(const QVector<quintptr> &a, const QVector<quintptr> &b, const QVector<quintptr> &c)
+{
+	int count = 0;
+	auto bi = b.constBegin();
+	auto ci = c.constBegin();
+	for(const quintptr t : a) {
+		while(bi != b.constEnd() && *bi < t)
+			++bi;
+		while(ci != c.constEnd() && *ci < t)
+			++ci;
+		if((bi == b.constEnd() || *bi != t) && (ci == c.constEnd() || *ci != t))
+			++count;
+	}
+	return count;
+}
+
+}
+
 StateSavepoint::StateSavepoint()
 {
 }
@@ -148,10 +345,22 @@ StateTracker::StateTracker(paintcore::LayerStack *image, LayerListModel *layerli
 		m_layerlist(layerlist),
 		m_myId(myId),
 		m_myLastLayer(-1),
+		m_payloadCache(PAYLOAD_CACHE_SIZE),
 		_showallmarkers(false),
 		m_hasParticipated(false),
 		m_localPenDown(false),
-		m_isQueued(false)
+		m_selectiveReplay(QSettings().value("settings/selectivereplay", true).toBool()),
+		m_savepointBudget(qMax(1, QSettings().value("settings/savepointbudget", 100).toInt())),
+		m_savepointMemoryBudget(qMax(1, QSettings().value("settings/savepointmemory", 256).toInt()) * qint64(1024 * 1024)),
+		m_replayCost(0),
+		m_streamCost(0),
+		m_totalCost(0),
+		m_replayRate(DEFAULT_REPLAY_RATE),
+		m_rollbackCount(0),
+		m_fastRollbackCount(0),
+		m_replayedMessages(0),
+		m_isQueued(false),
+		m_catchingUp(false)
 {
 	connect(m_layerlist, &LayerListModel::layerOpacityPreview, this, &StateTracker::previewLayerOpacity);
 
@@ -179,6 +388,8 @@ void StateTracker::reset()
 	m_hasParticipated = false;
 	m_localPenDown = false;
 	m_msgqueue.clear();
+	m_payloadCache.clearPrefetches();
+	m_catchingUp = false;
 	m_localfork.clear();
 	m_layerlist->clear();
 
@@ -224,6 +435,11 @@ void StateTracker::localCommand(protocol::MessagePtr msg)
 
 void StateTracker::receiveQueuedCommand(protocol::MessagePtr msg)
 {
+	// If there is a backlog (e.g. we're catching up,) this message won't
+	// be executed right away, so image payloads can be decompressed in the background.
+	if(!m_msgqueue.isEmpty())
+		prefetchPayload(*msg);
+
 	m_msgqueue.append(msg);
 
 	if(!m_isQueued) {
@@ -240,17 +456,40 @@ void StateTracker::processQueuedCommands()
 {
 	QElapsedTimer elapsed;
 	elapsed.start();
+	const qint64 startCost = m_totalCost;
+
+	if(m_catchingUp) {
+		// In catch-up mode, messages are applied as fast as possible.
+		// The whole batch is one write sequence, so observers are notified
+		// of the changes (and the view refreshed) only at each checkpoint.
+		auto batch = m_layerstack->editor(0);
+		while(!m_msgqueue.isEmpty() && m_catchingUp && elapsed.elapsed() < CATCHUP_CHECKPOINT_INTERVAL) {
+			receiveCommand(m_msgqueue.takeFirst());
+		}
 
-	while(!m_msgqueue.isEmpty() && elapsed.elapsed() < 100) {
-		receiveCommand(m_msgqueue.takeFirst());
+	} else {
+		while(!m_msgqueue.isEmpty() && elapsed.elapsed() < 100) {
+			receiveCommand(m_msgqueue.takeFirst());
+		}
 	}
 
+	updateReplayRate(m_totalCost - startCost, elapsed.nsecsElapsed());
+
 	if(!m_msgqueue.isEmpty()) {
-		qDebug("Taking a breather. Still %d messages in the queue.", m_msgqueue.size());
 		m_isQueued = true;
-		m_queuetimer->start(20);
+		if(m_catchingUp) {
+			// Just let the event loop run once to present the canvas and handle input
+			m_queuetimer->start(0);
+		} else {
+			qDebug("Taking a breather. Still %d messages in the queue. (Replay rate %.0f px/ms)", m_msgqueue.size(), replayRate());
+			m_queuetimer->start(20);
+		}
 	} else {
 		m_isQueued = false;
+
+		// Only queued messages are prefetched, so anything still pending
+		// now belongs to a message that never used it.
+		m_payloadCache.clearPrefetches();
 	}
 }
 
@@ -261,6 +500,7 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 		const auto &ci = msg.cast<protocol::ClientInternal>();
 		switch(ci.internalType()) {
 		case protocol::ClientInternal::Type::Catchup:
+			m_catchingUp = ci.value() < 100;
 			emit catchupProgress(ci.value());
 			break;
 		case protocol::ClientInternal::Type::SequencePoint:
@@ -279,6 +519,9 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 	// Add command to history and execute it
 	m_history.append(msg);
 
+	// Keep a reference to the local fork's content, since it may be discarded on conflict
+	const protocol::MessageList forked = m_localfork.messages();
+
 	LocalFork::MessageAction lfa = m_localfork.handleReceivedMessage(msg, affectedArea(msg));
 
 	// Undo messages are not handled locally (at the moment)
@@ -301,7 +544,7 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 			qWarning("No savepoint for rolling back local fork at %d!", m_localfork.offset());
 
 		} else {
-			const StateSavepoint &sp = m_savepoints.at(savepoint);
+			const StateSavepoint sp = m_savepoints.at(savepoint);
 			qDebug("inconsistency at %d (local fork at %d). Rolling back to %d", m_history.end(), m_localfork.offset(), sp->streampointer);
 
 			// Avoid rollback churn by clearing the local fork, but not if
@@ -310,18 +553,100 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 			if(!m_localPenDown)
 				m_localfork.clear();
 
-			revertSavepointAndReplay(sp);
+			// Only the area touched by the local fork and the conflicting
+			// message needs to be restored and replayed.
+			protocol::MessageList changed = forked;
+			changed << msg;
+
+			const qint64 now = QDateTime::currentMSecsSinceEpoch();
+			while(!m_rollbackTimes.isEmpty() && m_rollbackTimes.first() < now - 60 * 1000)
+				m_rollbackTimes.removeFirst();
+			m_rollbackTimes << now;
+			++m_rollbackCount;
+
+			const qint64 replayedBefore = m_replayedMessages;
+			const bool selective = m_selectiveReplay && revertAreaAndReplay(sp, changed);
+			if(selective)
+				++m_fastRollbackCount;
+			else
+				revertSavepointAndReplay(sp);
+
+			qDebug("Rollback #%d (%s) replayed %lld commands. %d of %d rollbacks were selective, %d in the last minute. Replay rate %.0f px/ms, %d ms to replay since the last savepoint.",
+				m_rollbackCount,
+				selective ? "selective" : "full",
+				m_replayedMessages - replayedBefore,
+				m_fastRollbackCount,
+				m_rollbackCount,
+				rollbacksPerMinute(),
+				replayRate(),
+				replayTimeEstimate()
+				);
 		}
 
 	} else if(lfa==LocalFork::CONCURRENT) {
 		// Concurrent operation: safe to execute
 		int pos = m_history.end() - 1;
 		handleCommand(msg, false, pos);
-	} // else ALREADYDONE
+
+	} else {
+		// ALREADYDONE: the local fork already executed this, so
+		// a prefetched payload will not be needed
+		releasePayload(*msg);
+	}
+}
+
+void StateTracker::prefetchPayload(const protocol::Message &msg)
+{
+	switch(msg.type()) {
+	case protocol::MSG_PUTIMAGE: {
+		const auto &cmd = static_cast<const protocol::PutImage&>(msg);
+		const qint64 len = qint64(cmd.width()) * cmd.height() * 4;
+		if(len < PAYLOAD_CACHE_SIZE)
+			m_payloadCache.prefetch(cmd.image(), int(len));
+		break;
+	}
+	case protocol::MSG_PUTTILE: {
+		const auto &cmd = static_cast<const protocol::PutTile&>(msg);
+		if(!cmd.isSolidColor())
+			m_payloadCache.prefetch(cmd.image(), paintcore::Tile::BYTES);
+		break;
+	}
+	case protocol::MSG_CANVAS_BACKGROUND: {
+		const auto &cmd = static_cast<const protocol::CanvasBackground&>(msg);
+		if(!cmd.isSolidColor())
+			m_payloadCache.prefetch(cmd.image(), paintcore::Tile::BYTES);
+		break;
+	}
+	default: break;
+	}
+}
+
+void StateTracker::releasePayload(const protocol::Message &msg)
+{
+	switch(msg.type()) {
+	case protocol::MSG_PUTIMAGE:
+		m_payloadCache.release(static_cast<const protocol::PutImage&>(msg).image());
+		break;
+	case protocol::MSG_PUTTILE:
+		m_payloadCache.release(static_cast<const protocol::PutTile&>(msg).image());
+		break;
+	case protocol::MSG_CANVAS_BACKGROUND:
+		m_payloadCache.release(static_cast<const protocol::CanvasBackground&>(msg).image());
+		break;
+	default: break;
+	}
 }
 
 void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 {
+	if(replay)
+		++m_replayedMessages;
+
+	const qint64 cost = estimateCost(*msg);
+	m_replayCost += cost;
+	m_streamCost += cost;
+	m_totalCost += cost;
+
 	switch(msg->type()) {
 		using namespace protocol;
 		case MSG_CANVAS_RESIZE:
@@ -360,7 +685,7 @@ void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 			handleUndoPoint(msg.cast<UndoPoint>(), replay, pos);
 			break;
 		case MSG_UNDO:
-			handleUndo(msg.cast<Undo>());
+			handleUndo(msg.cast<Undo>(), pos);
 			break;
 		case MSG_ANNOTATION_CREATE:
 			handleAnnotationCreate(msg.cast<AnnotationCreate>());
@@ -442,7 +767,7 @@ void StateTracker::handleCanvasBackground(const protocol::CanvasBackground &cmd)
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()));
 
 	} else {
-		QByteArray data = qUncompress(cmd.image());
+		QByteArray data = m_payloadCache.decompress(cmd.image());
 		if(data.length() != paintcore::Tile::BYTES) {
 			qWarning() << "Invalid canvas background: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
 			return;
@@ -627,11 +952,12 @@ void StateTracker::handlePutImage(const protocol::PutImage &cmd)
 	auto layer = layers.getEditableLayer(cmd.layer());
 	if(layer.isNull()) {
 		qWarning("PutImage on non-existent layer #%d", cmd.layer());
+		releasePayload(cmd);
 		return;
 	}
 
 	const int expectedLen = cmd.width() * cmd.height() * 4;
-	QByteArray data = qUncompress(cmd.image());
+	QByteArray data = m_payloadCache.decompress(cmd.image());
 	if(data.length() != expectedLen) {
 		qWarning() << "Invalid putImage: Expected" << expectedLen << "bytes, but got" << data.length();
 		return;
@@ -649,6 +975,7 @@ void StateTracker::handlePutTile(const protocol::PutTile &cmd)
 	auto layer = layers.getEditableLayer(cmd.layer());
 	if(layer.isNull()) {
 		qWarning("PutTile on non-existent layer #%d", cmd.layer());
+		releasePayload(cmd);
 		return;
 	}
 
@@ -657,7 +984,7 @@ void StateTracker::handlePutTile(const protocol::PutTile &cmd)
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()), cmd.contextId());
 
 	} else {
-		QByteArray data = qUncompress(cmd.image());
+		QByteArray data = m_payloadCache.decompress(cmd.image());
 		if(data.length() != paintcore::Tile::BYTES) {
 			qWarning() << "Invalid putTile: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
 			return;
@@ -779,34 +1106,23 @@ void StateTracker::handleUndoPoint(const protocol::UndoPoint &cmd, bool replay,
 	// commands in a linear sequence, this branching is represented by marking
 	// the unreachable commands as GONE.
 	if(!replay) {
-		int i = pos - 1; // skip the one just added
-		int upCount = 1;
+		// The oldest reachable undo point (counting the one just added)
+		const int oldest = m_history.findUndoPoint(pos, protocol::UNDO_DEPTH_LIMIT);
 
 		// Mark undone actions as GONE
-		while(m_history.isValidIndex(i) && upCount < protocol::UNDO_DEPTH_LIMIT) {
-			protocol::MessagePtr msg = m_history.at(i);
-			if(msg->type() == protocol::MSG_UNDOPOINT)
-				++upCount;
-			if(msg->contextId() == cmd.contextId()) {
-				// optimization: we can stop searching after finding the first GONE command
-				if(msg->type() != protocol::MSG_UNDO && msg->undoState() == protocol::GONE)
-					break;
-				else if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::GONE);
-			}
-			--i;
-		}
-
-		// Keep rewinding until the oldest reachable undo point is found
-		while(m_history.isValidIndex(i) && upCount < protocol::UNDO_DEPTH_LIMIT) {
-			if(m_history.at(i)->type() == protocol::MSG_UNDOPOINT) {
-				++upCount;
-			}
-			--i;
+		const History::Positions mine = m_history.messagesBy(cmd.contextId(), qMax(oldest, m_history.offset()), pos);
+		for(const int *it=mine.end();it!=mine.begin();) {
+			const int i = *(--it);
+			// optimization: we can stop searching after finding the first GONE command
+			if(m_history.type(i) != protocol::MSG_UNDO && m_history.undoState(i) == protocol::GONE)
+				break;
+			else if(m_history.undoState(i) == protocol::UNDONE)
+				m_history.setUndoState(i, protocol::GONE);
 		}
 
 		// Release all state savepoints older then the oldest UndoPoint
-		if(upCount>=protocol::UNDO_DEPTH_LIMIT) {
+		if(oldest >= 0) {
+			int i = oldest - 1;
 			if(!m_localfork.isEmpty())
 				i = qMin(i, m_localfork.offset() - 1);
 
@@ -843,31 +1159,33 @@ void StateTracker::handleUndoPoint(const protocol::UndoPoint &cmd, bool replay,
 		m_hasParticipated = true;
 }
 
-void StateTracker::handleUndo(protocol::Undo &cmd)
+void StateTracker::handleUndo(protocol::Undo &cmd, int cmdpos)
 {
 	// Undo/redo commands are never replayed, so start
 	// by marking it as unavailable.
 	cmd.setUndoState(protocol::GONE);
+	if(m_history.isValidIndex(cmdpos))
+		m_history.setUndoState(cmdpos, protocol::GONE);
 
 	const uint8_t ctxid = cmd.overrideId() ? cmd.overrideId() : cmd.contextId();
 
 	// Step 1. Find undo or redo point
-	int pos = m_history.end();
-	int upCount = 0;
+	// Only undo points within the undo depth limit (counting everyone's) are reachable
+	const int reachable = m_history.findUndoPoint(m_history.end()-1, protocol::UNDO_DEPTH_LIMIT + 1);
+	const History::Positions undoPoints = m_history.undoPointsBy(ctxid, reachable, m_history.end());
+	int pos = m_history.offset() - 1;
+	int upCount = qMin(m_history.undoPoints(m_history.offset(), m_history.end()).size(), protocol::UNDO_DEPTH_LIMIT + 1);
 
 	if(cmd.isRedo()) {
 		// Find the oldest undone UndoPoint
-		int redostart = pos;
-		while(m_history.isValidIndex(--pos) && upCount <= protocol::UNDO_DEPTH_LIMIT) {
-			const protocol::MessagePtr msg = m_history.at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT) {
-				++upCount;
-				if(msg->contextId() == ctxid) {
-					if(msg->undoState() != protocol::DONE)
-						redostart = pos;
-					else
-						break;
-				}
+		int redostart = m_history.end();
+		for(const int *it=undoPoints.end();it!=undoPoints.begin();) {
+			const int up = *(--it);
+			if(m_history.undoState(up) != protocol::DONE) {
+				redostart = up;
+			} else {
+				upCount = m_history.undoPoints(up, m_history.end()).size();
+				break;
 			}
 		}
 
@@ -879,12 +1197,12 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 
 	} else {
 		// Find the newest UndoPoint not marked as undone.
-		while(m_history.isValidIndex(--pos) && upCount <= protocol::UNDO_DEPTH_LIMIT) {
-			const protocol::MessagePtr msg = m_history.at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT) {
-				++upCount;
-				if(msg->contextId() == ctxid && msg->undoState() == protocol::DONE)
-					break;
+		for(const int *it=undoPoints.end();it!=undoPoints.begin();) {
+			const int up = *(--it);
+			if(m_history.undoState(up) == protocol::DONE) {
+				pos = up;
+				upCount = m_history.undoPoints(up, m_history.end()).size();
+				break;
 			}
 		}
 	}
@@ -915,35 +1233,34 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 	}
 
 	// Step 3. (Un)mark all actions by the user as undone
+	protocol::MessageList changed;
 	if(cmd.isRedo()) {
-		int i=pos;
 		int sequence=2;
 		// Un-undo messages until the start of the next undone sequence
-		while(i<m_history.end()) {
-			protocol::MessagePtr msg = m_history.at(i);
-			if(msg->contextId() == ctxid) {
-				if(msg->type() == protocol::MSG_UNDOPOINT && msg->undoState() != protocol::GONE)
-					if(--sequence==0)
-						break;
+		for(const int i : m_history.messagesBy(ctxid, pos, m_history.end())) {
+			if(m_history.type(i) == protocol::MSG_UNDOPOINT && m_history.undoState(i) != protocol::GONE)
+				if(--sequence==0)
+					break;
 
-				// GONE messages cannot be redone
-				if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::DONE);
+			// GONE messages cannot be redone
+			if(m_history.undoState(i) == protocol::UNDONE) {
+				m_history.setUndoState(i, protocol::DONE);
+				changed << m_history.at(i);
 			}
-			++i;
 		}
 
 	} else {
 		// Mark all messages from undo point to the end as undone.
-		for(int i=pos;i<m_history.end();++i) {
-			protocol::MessagePtr msg = m_history.at(i);
-			if(msg->contextId() == ctxid)
-				msg->setUndoState(protocol::MessageUndoState(protocol::UNDONE | msg->undoState()));
+		for(const int i : m_history.messagesBy(ctxid, pos, m_history.end())) {
+			if(m_history.undoState(i) == protocol::DONE)
+				changed << m_history.at(i);
+			m_history.setUndoState(i, protocol::MessageUndoState(protocol::UNDONE | m_history.undoState(i)));
 		}
 	}
 
 	// Step 4. Revert to the savepoint and replay with undone commands removed (or added back)
-	revertSavepointAndReplay(savepoint);
+	if(!m_selectiveReplay || !revertAreaAndReplay(savepoint, changed))
+		revertSavepointAndReplay(savepoint);
 }
 
 StateSavepoint StateTracker::createSavepoint(int pos)
@@ -951,6 +1268,7 @@ StateSavepoint StateTracker::createSavepoint(int pos)
 	auto *data = new StateSavepoint::Data;
 	data->timestamp = QDateTime::currentMSecsSinceEpoch();
 	data->streampointer = pos;
+	data->streamCost = m_streamCost;
 	data->canvas = m_layerstack->makeSavepoint();
 	data->layermodel = m_layerlist->getLayers();
 
@@ -965,26 +1283,125 @@ void StateTracker::makeSavepoint(int pos)
 	if(!m_localfork.isEmpty())
 		return;
 
-	// Check if sufficient time and actions has elapsed from previous savepoint
-	if(!m_savepoints.isEmpty()) {
-		static const qint64 MIN_INTERVAL_MS = 1000;
-		static const int MIN_INTERVAL_MSGS = 100;
-
-		const StateSavepoint sp = m_savepoints.last();
-		const auto now = QDateTime::currentMSecsSinceEpoch();
-		if(now - sp->timestamp < MIN_INTERVAL_MS && m_history.end() - sp->streampointer < MIN_INTERVAL_MSGS)
-			return;
-	}
+	// Check if replaying the history since the previous savepoint
+	// would take long enough to warrant a new one
+	if(!m_savepoints.isEmpty() && replayTimeEstimate() < m_savepointBudget)
+		return;
 
 	// Looks like a good spot for a savepoint
 	const auto sp = createSavepoint(pos);
 	m_savepoints << sp;
+	m_replayCost = 0;
 
 	if(m_resetpoints.isEmpty() || (sp.timestamp() - m_resetpoints.last().timestamp()) > (10*1000)) {
 		while(m_resetpoints.size() >= 6)
 			m_resetpoints.removeFirst();
 		m_resetpoints << sp;
 	}
+
+	thinSavepoints();
+}
+
+int StateTracker::rollbacksPerMinute() const
+{
+	const qint64 since = QDateTime::currentMSecsSinceEpoch() - 60 * 1000;
+	int count = 0;
+	for(const qint64 t : m_rollbackTimes) {
+		if(t >= since)
+			++count;
+	}
+	return count;
+}
+
+QVector<int> StateTracker::savepointPositions() const
+{
+	QVector<int> positions;
+	positions.reserve(m_savepoints.size());
+	for(const StateSavepoint &sp : m_savepoints)
+		positions << sp->streampointer;
+	return positions;
+}
+
+qint64 StateTracker::savepointMemoryEstimate() const
+{
+	const QVector<quintptr> none;
+	qint64 tiles = 0;
+	for(int i=0;i<m_savepoints.size();++i) {
+		tiles += countUniqueTiles(
+			savepointTiles(m_savepoints.at(i)),
+			i>0 ? savepointTiles(m_savepoints.at(i-1)) : none,
+			none
+		);
+	}
+	return tiles * paintcore::Tile::BYTES;
+}
+
+void StateTracker::thinSavepoints()
+{
+	// The newest savepoints are always kept to keep recent undos fast
+	static const int KEEP_NEWEST = 4;
+
+	if(m_savepoints.size() <= KEEP_NEWEST + 1)
+		return;
+
+	const QVector<quintptr> none;
+	qint64 memory = savepointMemoryEstimate();
+
+	while(m_savepoints.size() > KEEP_NEWEST + 1 && memory > m_savepointMemoryBudget) {
+		// Find the savepoint that is the least valuable to keep.
+		// Removing a savepoint merges the gaps on either side of it. The value
+		// of a savepoint is the size of that merged gap relative to the savepoint's
+		// distance from the tip of the history, divided by the memory it takes
+		// (tiles not shared with its neighbours.) Keeping the gap-to-distance
+		// ratio even spaces the savepoints geometrically: each gap is a constant
+		// fraction of the distance, so they get exponentially sparser towards
+		// the undo depth limit.
+		// The oldest savepoint is always kept, since it is needed
+		// to be able to undo all the way to the oldest undo point.
+		const qint64 tipCost = m_savepoints.last()->streamCost;
+		int leastValuable = -1;
+		qreal leastValue = 0;
+
+		for(int i=1;i<m_savepoints.size()-KEEP_NEWEST;++i) {
+			const int unique = countUniqueTiles(
+				savepointTiles(m_savepoints.at(i)),
+				savepointTiles(m_savepoints.at(i-1)),
+				savepointTiles(m_savepoints.at(i+1))
+			);
+			const qint64 mergedGap = m_savepoints.at(i+1)->streamCost - m_savepoints.at(i-1)->streamCost;
+			const qint64 distance = tipCost - m_savepoints.at(i)->streamCost;
+
+			const qreal value = mergedGap / (qreal(distance + 1) * (unique + 1));
+			if(leastValuable < 0 || value < leastValue) {
+				leastValuable = i;
+				leastValue = value;
+			}
+		}
+
+		// Update the memory estimate: the removed savepoint's tiles not in its
+		// predecessor no longer count, and the next savepoint is now compared
+		// against the predecessor instead.
+		const QVector<quintptr> &prev = savepointTiles(m_savepoints.at(leastValuable-1));
+		const QVector<quintptr> &removed = savepointTiles(m_savepoints.at(leastValuable));
+		const QVector<quintptr> &next = savepointTiles(m_savepoints.at(leastValuable+1));
+		memory -= qint64(
+			countUniqueTiles(removed, prev, none)
+			+ countUniqueTiles(next, removed, none)
+			- countUniqueTiles(next, prev, none)
+		) * paintcore::Tile::BYTES;
+
+		m_savepoints.removeAt(leastValuable);
+	}
+}
+
+void StateTracker::updateReplayRate(qint64 cost, qint64 nsecs)
+{
+	if(cost < MIN_RATE_SAMPLE_COST || nsecs <= 0)
+		return;
+
+	// Exponential moving average, so a single hiccup doesn't throw off the estimate
+	const qreal rate = cost / (nsecs / 1000000.0);
+	m_replayRate = m_replayRate * 0.8 + rate * 0.2;
 }
 
 
@@ -1003,6 +1420,8 @@ void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 	m_layerlist->setLayers(savepoint->layermodel);
 
 	m_savepoints.append(savepoint);
+	m_replayCost = 0;
+	m_streamCost = savepoint->streamCost;
 }
 
 void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
@@ -1018,17 +1437,23 @@ void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
 		return;
 	}
 
+	QElapsedTimer elapsed;
+	elapsed.start();
+	const qint64 startCost = m_totalCost;
+
 	m_layerstack->editor(0).restoreSavepoint(savepoint->canvas);
 	m_layerlist->setLayers(savepoint->layermodel);
 
 	// Reverting a savepoint destroys all newer savepoints
 	while(m_savepoints.last() != savepoint)
 		m_savepoints.removeLast();
+	m_replayCost = 0;
+	m_streamCost = savepoint->streamCost;
 
 	// Replay all not-undo actions (and local fork)
 	int pos = savepoint->streampointer + 1;
 	while(pos < m_history.end()) {
-		if(m_history.at(pos)->undoState() == protocol::DONE) {
+		if(m_history.undoState(pos) == protocol::DONE) {
 			handleCommand(m_history.at(pos), true, pos);
 		}
 		++pos;
@@ -1044,23 +1469,337 @@ void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
 				handleCommand(msg, true, pos);
 		}
 	}
+
+	updateReplayRate(m_totalCost - startCost, elapsed.nsecsElapsed());
 }
 
-void StateTracker::handleTruncateHistory()
+/**
+ * @brief Selectively revert to a savepoint and replay
+ *
+ * Only the tiles affected by the changed commands are restored from the
+ * savepoint, and only the commands that touch those tiles are replayed.
+ * The affected area is expanded until no replayed command reaches outside it,
+ * so the result is the same as with a full replay.
+ *
+ * Indirect strokes are treated as a unit: either all the dabs of a stroke
+ * (and its PenUp) are replayed, or none are.
+ *
+ * Savepoints newer than the one reverted to are kept, with their copy of
+ * the affected area updated as the replay passes them.
+ *
+ * Selective replay is not possible if the layer stack's structure has changed
+ * since the savepoint, or if the savepoint has indirect strokes in progress.
+ * In that case, nothing is done and false is returned.
+ *
+ * @param savepoint the savepoint to revert to
+ * @param changed the commands whose effect on the canvas has changed (e.g. undone or rolled back)
+ * @return false if selective replay could not be done
+ */
+bool StateTracker::revertAreaAndReplay(const StateSavepoint &savepoint, const protocol::MessageList &changed)
 {
-	int pos = m_history.end()-1;
-	int upCount = 0;
+	using protocol::MessagePtr;
 
-	qWarning("Truncating undo history at %d", pos);
-	while(m_history.isValidIndex(pos) && upCount <= protocol::UNDO_DEPTH_LIMIT) {
-		protocol::MessagePtr msg = m_history.at(pos);
+	if(!savepoint || !m_savepoints.contains(savepoint))
+		return false;
+
+	const QRect canvas(QPoint(), m_layerstack->size());
+	const int xtiles = paintcore::Tile::roundTiles(canvas.width());
+	const int ytiles = paintcore::Tile::roundTiles(canvas.height());
+
+	if(savepoint->canvas.size != canvas.size())
+		return false;
+
+	for(const paintcore::Layer *l : savepoint->canvas.layers) {
+		for(const paintcore::Layer *sl : l->sublayers()) {
+			if(!sl->isHidden())
+				return false;
+		}
+	}
 
-		if(msg->type() == protocol::MSG_UNDOPOINT) {
-			++upCount;
-			msg->setUndoState(protocol::GONE);
+	// The area to restore is tracked with a bitmap of tiles per layer
+	QHash<int, QBitArray> area;
+	const auto markArea = [&area, xtiles, ytiles](int layer, const QRect &bounds) {
+		QBitArray &tiles = area[layer];
+		if(tiles.isEmpty())
+			tiles.resize(xtiles * ytiles);
+		for(int ty=bounds.top()/paintcore::Tile::SIZE;ty<=bounds.bottom()/paintcore::Tile::SIZE;++ty)
+			for(int tx=bounds.left()/paintcore::Tile::SIZE;tx<=bounds.right()/paintcore::Tile::SIZE;++tx)
+				tiles.setBit(ty*xtiles+tx);
+	};
+	const auto inArea = [&area, xtiles](int layer, const QRect &bounds) {
+		const auto tiles = area.constFind(layer);
+		if(tiles == area.constEnd())
+			return false;
+		for(int ty=bounds.top()/paintcore::Tile::SIZE;ty<=bounds.bottom()/paintcore::Tile::SIZE;++ty)
+			for(int tx=bounds.left()/paintcore::Tile::SIZE;tx<=bounds.right()/paintcore::Tile::SIZE;++tx)
+				if(tiles->testBit(ty*xtiles+tx))
+					return true;
+		return false;
+	};
+
+	// Step 1. The initial area is whatever the changed commands touched
+	for(const MessagePtr &msg : changed) {
+		int layer;
+		QRect bounds;
+		switch(replayDomain(*msg, canvas, layer, bounds)) {
+		case ReplayDomain::Unsupported: return false;
+		case ReplayDomain::Nothing:
+			if(msg->type() != protocol::MSG_UNDOPOINT && msg->type() != protocol::MSG_PEN_UP)
+				return false;
+			break;
+		case ReplayDomain::Pixels:
+			markArea(layer, bounds);
+			break;
 		}
+	}
 
-		--pos;
+	// Nothing to restore: not worth optimizing
+	if(area.isEmpty())
+		return false;
+
+	// Step 2. Group the commands to be replayed into units
+	struct Unit {
+		int layer;
+		QRect bounds;
+		bool replay;
+		bool indirect;
+		bool ended; // indirect stroke has been merged
+		int first; // position of the unit's first command
+		int last; // position of the unit's last command
+	};
+	QVector<Unit> units;
+	QHash<int, int> strokes; // context ID -> unit of the indirect stroke in progress
+
+	struct Command {
+		MessagePtr msg;
+		int pos;
+		int unit;
+	};
+	QVector<Command> commands; // all commands in effect; unit is -1 if not part of any
+
+	// Position of the newest command that changed the state outside the area
+	// and is not replayed. Savepoints can be made after this point.
+	int dirtyAfter = savepoint->streampointer;
+
+	const auto addCommand = [&](const MessagePtr &msg, int pos) {
+		int layer;
+		QRect bounds;
+		int unit = -1;
+
+		switch(replayDomain(*msg, canvas, layer, bounds)) {
+		case ReplayDomain::Unsupported: return false;
+		case ReplayDomain::Nothing:
+			// PenUp ends (and merges) an indirect stroke
+			if(msg->type() == protocol::MSG_PEN_UP && strokes.contains(msg->contextId())) {
+				unit = strokes.take(msg->contextId());
+				units[unit].ended = true;
+				units[unit].last = pos;
+			} else if(msg->type() != protocol::MSG_UNDOPOINT && msg->type() != protocol::MSG_PEN_UP) {
+				dirtyAfter = pos;
+			}
+			break;
+		case ReplayDomain::Pixels: {
+			bool indirect = false;
+			if(msg->type() == protocol::MSG_DRAWDABS_CLASSIC || msg->type() == protocol::MSG_DRAWDABS_PIXEL || msg->type() == protocol::MSG_DRAWDABS_PIXEL_SQUARE) {
+				indirect = msg.cast<protocol::DrawDabs>().isIndirect();
+				if(indirect) {
+					if(strokes.contains(msg->contextId())) {
+						unit = strokes.value(msg->contextId());
+						if(units.at(unit).layer != layer)
+							return false;
+						units[unit].bounds |= bounds;
+						units[unit].last = pos;
+						break;
+					}
+					strokes[msg->contextId()] = units.size();
+				}
+			}
+			unit = units.size();
+			units << Unit { layer, bounds, false, indirect, false, pos, pos };
+			break;
+			}
+		}
+
+		commands << Command { msg, pos, unit };
+		return true;
+	};
+
+	for(int pos=savepoint->streampointer+1;pos<m_history.end();++pos) {
+		if(m_history.undoState(pos) == protocol::DONE && !addCommand(m_history.at(pos), pos))
+			return false;
+	}
+
+	// The local fork is replayed on top of the mainline history
+	const protocol::MessageList local = m_localfork.messages();
+	for(const MessagePtr &msg : local) {
+		if(msg->type() != protocol::MSG_UNDO && msg->type() != protocol::MSG_UNDOPOINT && !addCommand(msg, m_history.end()))
+			return false;
+	}
+
+	// Step 3. Expand the area until no replayable unit reaches outside it
+	bool expanded = true;
+	while(expanded) {
+		expanded = false;
+		for(Unit &u : units) {
+			if(!u.replay && inArea(u.layer, u.bounds)) {
+				u.replay = true;
+				markArea(u.layer, u.bounds);
+				expanded = true;
+			}
+		}
+	}
+
+	for(const Unit &u : units) {
+		if(!u.replay)
+			dirtyAfter = qMax(dirtyAfter, u.last);
+	}
+
+	// Step 4. Restore the area from the savepoint
+	{
+		auto layers = m_layerstack->editor(0);
+
+		QVector<QPair<paintcore::EditableLayer, const paintcore::Layer*>> restore;
+		for(auto i=area.constBegin();i!=area.constEnd();++i) {
+			const paintcore::Layer *saved = nullptr;
+			for(const paintcore::Layer *l : savepoint->canvas.layers) {
+				if(l->id() == i.key()) {
+					saved = l;
+					break;
+				}
+			}
+			paintcore::EditableLayer layer = layers.getEditableLayer(i.key());
+			if(!saved || layer.isNull())
+				return false;
+			restore << qMakePair(layer, saved);
+		}
+
+		for(auto &r : restore) {
+			const QBitArray &tiles = area[r.second->id()];
+			for(int i=0;i<tiles.size();++i) {
+				if(!tiles.testBit(i))
+					continue;
+				const int tx = i % xtiles;
+				const int ty = i / xtiles;
+				r.first.putTile(tx, ty, 0, r.second->tile(tx, ty));
+
+				// Strokes in progress will be replayed too
+				for(const paintcore::Layer *sl : r.first->sublayers()) {
+					if(!sl->isHidden())
+						r.first.putTile(tx, ty, 0, paintcore::Tile(), sl->id());
+				}
+			}
+		}
+	}
+
+	// Step 5. Replay the commands inside the area.
+	// Unlike with a full replay, the newer savepoints are still valid outside the area,
+	// so they are kept and their area is updated as the replay passes them.
+	// New savepoints are made at the undo points a full replay would make them at,
+	// if nothing outside the area has changed since.
+	QList<StateSavepoint> newer;
+	while(m_savepoints.last() != savepoint)
+		newer.prepend(m_savepoints.takeLast());
+
+	const auto strokeOpenAt = [&units](int pos) {
+		for(const Unit &u : units) {
+			if(u.replay && u.indirect && u.first <= pos && (!u.ended || u.last > pos))
+				return true;
+		}
+		return false;
+	};
+
+	const auto keepSavepoints = [&](int pos) {
+		while(!newer.isEmpty() && newer.first()->streampointer <= pos) {
+			const StateSavepoint sp = newer.takeFirst();
+
+			// A full replay would not have kept these either
+			if(m_history.undoState(sp->streampointer) != protocol::DONE || strokeOpenAt(sp->streampointer))
+				continue;
+
+			auto *data = new StateSavepoint::Data;
+			data->timestamp = sp->timestamp;
+			data->streampointer = sp->streampointer;
+			data->streamCost = m_streamCost;
+			data->canvas = sp->canvas;
+			data->layermodel = sp->layermodel;
+
+			bool ok = true;
+			for(auto i=area.constBegin();ok && i!=area.constEnd();++i) {
+				paintcore::Layer *saved = nullptr;
+				for(paintcore::Layer *l : data->canvas.layers) {
+					if(l->id() == i.key()) {
+						saved = l;
+						break;
+					}
+				}
+				const paintcore::Layer *current = m_layerstack->getLayer(i.key());
+				if(!saved || !current) {
+					ok = false;
+					break;
+				}
+
+				paintcore::EditableLayer layer(saved, nullptr, 0);
+				for(int t=0;t<i->size();++t) {
+					if(!i->testBit(t))
+						continue;
+					layer.rtile(t) = current->tile(t);
+					for(paintcore::Layer *sl : saved->sublayers())
+						paintcore::EditableLayer(sl, nullptr, 0).rtile(t) = paintcore::Tile();
+				}
+			}
+
+			if(ok) {
+				m_savepoints << StateSavepoint(data);
+				m_replayCost = 0;
+			} else {
+				delete data;
+			}
+		}
+	};
+
+	QElapsedTimer elapsed;
+	elapsed.start();
+	const qint64 startCost = m_totalCost;
+
+	m_streamCost = savepoint->streamCost;
+	m_replayCost = 0;
+
+	for(const Command &c : commands) {
+		keepSavepoints(c.pos - 1);
+
+		if(c.unit >= 0 && units.at(c.unit).replay) {
+			handleCommand(c.msg, true, c.pos);
+		} else {
+			const qint64 cost = estimateCost(*c.msg);
+			m_replayCost += cost;
+			m_streamCost += cost;
+		}
+
+		keepSavepoints(c.pos);
+
+		if(c.msg->type() == protocol::MSG_UNDOPOINT && c.pos >= dirtyAfter && m_savepoints.last()->streampointer != c.pos)
+			makeSavepoint(c.pos);
+	}
+	keepSavepoints(m_history.end());
+
+	if(!m_localfork.isEmpty())
+		m_localfork.setOffset(m_history.end()-1);
+
+	updateReplayRate(m_totalCost - startCost, elapsed.nsecsElapsed());
+
+	return true;
+}
+
+void StateTracker::handleTruncateHistory()
+{
+	const int pos = m_history.end()-1;
+	int upCount = 0;
+
+	qWarning("Truncating undo history at %d", pos);
+	const History::Positions undoPoints = m_history.undoPoints(m_history.offset(), m_history.end());
+	for(const int *it=undoPoints.end();it!=undoPoints.begin() && upCount <= protocol::UNDO_DEPTH_LIMIT;) {
+		m_history.setUndoState(*(--it), protocol::GONE);
+		++upCount;
 	}
 	qWarning("Marked %d UPs", upCount);
 }
@@ -21,6 +21,7 @@
 
 #include "retcon.h"
 #include "history.h"
+#include "payloadcache.h"
 #include "../core/point.h"
 
 #include <QObject>
@@ -207,6 +208,86 @@ public:
 	//! Get all existing reset points (savepoints set aside for session resetting use)
 	QList<StateSavepoint> getResetPoints() const { return m_resetpoints; }
 
+	/**
+	 * @brief Set the savepoint budget
+	 *
+	 * A new savepoint is made (at the next undo point) once the estimated
+	 * time to replay the history since the previous savepoint exceeds
+	 * this budget. This puts an upper bound on how long an undo of a recent
+	 * action takes. With a budget of zero, a savepoint is made at every undo point.
+	 *
+	 * @param ms time budget in milliseconds
+	 */
+	void setSavepointBudget(int ms) { m_savepointBudget = qMax(0, ms); }
+	int savepointBudget() const { return m_savepointBudget; }
+
+	//! Get the number of savepoints currently kept
+	int savepointCount() const { return m_savepoints.size(); }
+
+	//! Get the history positions of the savepoints currently kept (oldest first)
+	QVector<int> savepointPositions() const;
+
+	/**
+	 * @brief Get the estimated cost of replaying the history since the last savepoint
+	 *
+	 * The cost is (roughly) the number of pixels that must be composited.
+	 */
+	qint64 replayCostEstimate() const { return m_replayCost; }
+
+	//! Get the measured replay rate in estimated cost units (pixels) per millisecond
+	qreal replayRate() const { return m_replayRate; }
+
+	//! Get the estimated time in milliseconds it would take to replay the history since the last savepoint
+	int replayTimeEstimate() const { return int(m_replayCost / m_replayRate); }
+
+	/**
+	 * @brief Set the savepoint memory budget
+	 *
+	 * When the savepoints take up more memory than this, they are thinned out.
+	 * The newest savepoints are always kept, so undoing recent actions stays fast.
+	 *
+	 * @param bytes budget in bytes
+	 */
+	void setSavepointMemoryBudget(qint64 bytes) { m_savepointMemoryBudget = bytes; }
+	qint64 savepointMemoryBudget() const { return m_savepointMemoryBudget; }
+
+	/**
+	 * @brief Estimate the amount of memory taken by the savepoints
+	 *
+	 * Only tile content is counted. Tiles shared between
+	 * adjacent savepoints are counted only once.
+	 */
+	qint64 savepointMemoryEstimate() const;
+
+	/**
+	 * @brief Enable selective undo replay
+	 *
+	 * In selective mode, an undo restores only the tiles affected by
+	 * the undone actions and replays only the actions that touch them.
+	 * If this cannot be done (e.g. layers were added since the savepoint,)
+	 * the full history since the savepoint is replayed as usual.
+	 */
+	void setSelectiveReplay(bool selective) { m_selectiveReplay = selective; }
+	bool isSelectiveReplay() const { return m_selectiveReplay; }
+
+	//! Are there local commands the server hasn't echoed back yet?
+	bool hasLocalFork() const { return !m_localfork.isEmpty(); }
+
+	//! Is a session catch-up still in progress?
+	bool isCatchingUp() const { return m_catchingUp; }
+
+	//! Get the number of local fork rollbacks done
+	int rollbackCount() const { return m_rollbackCount; }
+
+	//! Get the number of rollbacks that were done with selective replay
+	int fastRollbackCount() const { return m_fastRollbackCount; }
+
+	//! Get the number of rollbacks done during the last minute
+	int rollbacksPerMinute() const;
+
+	//! Get the total number of commands replayed (due to undos and rollbacks)
+	qint64 replayedMessageCount() const { return m_replayedMessages; }
+
 signals:
 	void myAnnotationCreated(int id);
 	void layerAutoselectRequest(int);
@@ -239,6 +320,8 @@ private slots:
 
 private:
 	void handleCommand(protocol::MessagePtr msg, bool replay, int pos);
+	void prefetchPayload(const protocol::Message &msg);
+	void releasePayload(const protocol::Message &msg);
 
 	AffectedArea affectedArea(const protocol::MessagePtr msg) const;
 
@@ -263,9 +346,12 @@ private:
 
 	// Undo/redo
 	void handleUndoPoint(const protocol::UndoPoint &cmd, bool replay, int pos);
-	void handleUndo(protocol::Undo &cmd);
+	void handleUndo(protocol::Undo &cmd, int pos);
 	void makeSavepoint(int pos);
+	void updateReplayRate(qint64 cost, qint64 nsecs);
+	void thinSavepoints();
 	void revertSavepointAndReplay(const StateSavepoint savepoint);
+	bool revertAreaAndReplay(const StateSavepoint &savepoint, const protocol::MessageList &changed);
 	void handleTruncateHistory();
 
 	// Annotation related commands
@@ -286,14 +372,29 @@ private:
 	QList<StateSavepoint> m_resetpoints;
 
 	LocalFork m_localfork;
+	PayloadCache m_payloadCache;
 
 	bool _showallmarkers;
 	bool m_hasParticipated;
 	bool m_localPenDown;
+	bool m_selectiveReplay;
+
+	int m_savepointBudget;
+	qint64 m_savepointMemoryBudget;
+	qint64 m_replayCost;
+	qint64 m_streamCost;
+	qint64 m_totalCost;
+	qreal m_replayRate;
+
+	int m_rollbackCount;
+	int m_fastRollbackCount;
+	qint64 m_replayedMessages;
+	QList<qint64> m_rollbackTimes;
 
 	protocol::MessageList m_msgqueue;
 	QTimer *m_queuetimer;
 	bool m_isQueued;
+	bool m_catchingUp;
 };
 
 }
@@ -27,17 +27,21 @@ template<typename T> static T square(T x) { return x*x; }
 
 static const int LUT_RADIUS = 128;
 
+// Generate a lookup table for a Gimp style exponential brush shape
+static QVector<uchar> makeColorSamplingLUT()
+{
+	const qreal hardness = 0.5;
+	const qreal exponent = 0.4 / (1.0 - hardness);
+	QVector<uchar> lut(square(LUT_RADIUS));
+	for(int i=0;i<lut.size();++i)
+		lut[i] = 255 * (1-pow(pow(sqrt(i)/LUT_RADIUS, exponent), 2));
+	return lut;
+}
+
 static BrushMask makeColorSamplingStamp(int radius)
 {
-	static QVector<uchar> lut;
-	if(lut.isEmpty()) {
-		// Generate a lookup table for a Gimp style exponential brush shape
-		const qreal hardness = 0.5;
-		const qreal exponent = 0.4 / (1.0 - hardness);
-		lut.resize(square(LUT_RADIUS));
-		for(int i=0;i<lut.size();++i)
-			lut[i] = 255 * (1-pow(pow(sqrt(i)/LUT_RADIUS, exponent), 2));
-	}
+	// (initialization of a local static is thread safe)
+	static const QVector<uchar> lut = makeColorSamplingLUT();
 
 	const int diameter = radius*2;
 	const float lut_scale = square((LUT_RADIUS-1) / double(radius));
@@ -756,41 +756,42 @@ void EditableLayer::fillRect(const QRect &rectangle, const QColor &color, BlendM
 
 void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, BlendMode::Mode blendmode)
 {
-	Q_ASSERT(d);
-	const int top=bs.top, left=bs.left;
 	const int dia = bs.mask.diameter();
-	const int bottom = qMin(top + dia, d->m_height);
-	const int right = qMin(left + dia, d->m_width);
+	putMask(bs.left, bs.top, dia, dia, bs.mask.data(), color, blendmode);
+}
 
-	if(left+dia<=0 || top+dia<=0 || left>=d->m_width || top>=d->m_height)
-		return;
+void EditableLayer::putMask(int left, int top, int width, int height, const uchar *values, const QColor &color, BlendMode::Mode blendmode)
+{
+	Q_ASSERT(d);
+	const int bottom = qMin(top + height, d->m_height);
+	const int right = qMin(left + width, d->m_width);
 
-	// Composite the brush mask onto the layer
-	const uchar *values = bs.mask.data();
+	if(left+width<=0 || top+height<=0 || left>=d->m_width || top>=d->m_height)
+		return;
 
 	// A single dab can (and often does) span multiple tiles.
 	int y = top<0?0:top;
-	int yb = top<0?-top:0; // y in relation to brush origin
+	int yb = top<0?-top:0; // y in relation to mask origin
 	const int x0 = left<0?0:left;
 	const int xb0 = left<0?-left:0;
 	while(y<bottom) {
 		const int yindex = y / Tile::SIZE;
 		const int yt = y - yindex * Tile::SIZE;
-		const int hb = yt+dia-yb < Tile::SIZE ? dia-yb : Tile::SIZE-yt;
+		const int hb = yt+height-yb < Tile::SIZE ? height-yb : Tile::SIZE-yt;
 		int x = x0;
-		int xb = xb0; // x in relation to brush origin
+		int xb = xb0; // x in relation to mask origin
 		while(x<right) {
 			const int xindex = x / Tile::SIZE;
 			const int xt = x - xindex * Tile::SIZE;
-			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
+			const int wb = xt+width-xb < Tile::SIZE ? width-xb : Tile::SIZE-xt;
 			const int i = d->m_xtiles * yindex + xindex;
 			d->m_tiles[i].composite(
 					blendmode,
-					values + yb * dia + xb,
+					values + yb * width + xb,
 					color,
 					xt, yt,
 					wb, hb,
-					dia-wb
+					width-wb
 					);
 			d->m_tiles[i].setLastEditedBy(contextId);
 
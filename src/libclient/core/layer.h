@@ -290,6 +290,9 @@ public:
 	//! Dab a brush
 	void putBrushStamp(const BrushStamp &bs, const QColor &color, BlendMode::Mode blendmode);
 
+	//! Composite a rectangular alpha mask (of size width*height) onto the layer
+	void putMask(int left, int top, int width, int height, const uchar *mask, const QColor &color, BlendMode::Mode blendmode);
+
 	//! Fill a rectangle
 	void fillRect(const QRect &rect, const QColor &color, BlendMode::Mode blendmode);
 
@@ -119,6 +119,7 @@ void Document::initCanvas()
 	connect(qApp, SIGNAL(settingsChanged()), m_canvas, SLOT(updateLayerViewOptions()));
 
 	connect(m_canvas->stateTracker(), &canvas::StateTracker::catchupProgress, this, &Document::catchupProgress);
+	connect(m_canvas->stateTracker(), &canvas::StateTracker::softResetPoint, this, &Document::catchupSnapshotNeeded);
 
 	emit canvasChanged(m_canvas);
 
@@ -753,6 +754,37 @@ void Document::snapshotNeeded()
 	}
 }
 
+void Document::catchupSnapshotNeeded()
+{
+	// The server placed a soft reset point in the history and wants
+	// a snapshot of the canvas at that point for new users to start from.
+	// (The builtin server handles soft resets by itself.)
+	if(!m_canvas || !m_client->sessionSupportsCatchupSnapshots())
+		return;
+
+	// The canvas must not contain anything that isn't in the server's
+	// history before the reset point. Old reset points seen while still
+	// catching up are ignored too.
+	if(m_canvas->stateTracker()->isCatchingUp() || m_canvas->stateTracker()->hasLocalFork()) {
+		qInfo("Not generating catch-up snapshot: canvas is not in sync with the session history");
+		return;
+	}
+
+	if(m_canvas->layerStack()->size().isEmpty())
+		return;
+
+	auto loader = canvas::SnapshotLoader(
+		m_client->myId(),
+		m_canvas->layerStack(),
+		m_canvas->aclFilter());
+	loader.setDefaultLayer(m_canvas->layerlist()->defaultLayer());
+	loader.setPinnedMessage(m_canvas->pinnedMessage());
+
+	m_client->sendMessage(net::command::serverCommand("catchup-snapshot-begin"));
+	m_client->sendResetMessages(loader.loadInitCommands());
+	m_client->sendMessage(net::command::serverCommand("catchup-snapshot-end"));
+}
+
 void Document::undo()
 {
 	if(!m_canvas)
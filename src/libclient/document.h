@@ -231,6 +231,7 @@ private slots:
 	void onAutoresetRequested(int maxSize, bool query);
 
 	void snapshotNeeded();
+	void catchupSnapshotNeeded();
 	void markDirty();
 	void unmarkDirty();
 
@@ -137,6 +137,11 @@ public:
 
 	bool sessionSupportsAutoReset() const { return m_supportsAutoReset; }
 
+	/**
+	 * @brief Does the session want catch-up snapshots from us?
+	 */
+	bool sessionSupportsCatchupSnapshots() const { return m_server->supportsCatchupSnapshots(); }
+
 	/**
 	 * @brief Get the number of bytes waiting to be sent
 	 * @return upload queue length
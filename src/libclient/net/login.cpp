@@ -25,6 +25,7 @@
 
 #include "../libshared/net/protover.h"
 #include "../libshared/net/control.h"
+#include "../libshared/net/messagequeue.h"
 #include "../libshared/util/networkaccess.h"
 #include "../libshared/util/paths.h"
 
@@ -67,6 +68,7 @@ LoginHandler::LoginHandler(Mode mode, const QUrl &url, QObject *parent)
 	  m_multisession(false),
 	  m_canPersist(false),
 	  m_canReport(false),
+	  m_canCompress(false),
 	  m_needUserPassword(false),
 	  m_supportsCustomAvatars(false),
 	  m_supportsExtAuthAvatars(false),
@@ -174,6 +176,7 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 	m_needUserPassword = false;
 	m_canPersist = false;
 	m_canReport = false;
+	m_canCompress = false;
 
 	bool startTls = false;
 
@@ -192,6 +195,8 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 			m_canReport = true;
 		} else if(flag == "AVATAR") {
 			m_supportsCustomAvatars = true;
+		} else if(flag == "COMPRESS") {
+			m_canCompress = protocol::MessageQueue::isCompressionSupported();
 		} else {
 			qWarning() << "Unknown server capability:" << flag;
 		}
@@ -292,8 +297,16 @@ void LoginHandler::sendIdentity()
 		m_avatar = QByteArray();
 	}
 
+	if(m_canCompress)
+		cmd.kwargs["compress"] = true;
+
 	m_state = EXPECT_IDENTIFIED;
 	send(cmd);
+
+	// The server compresses everything it sends after the ident message.
+	// We can start compressing too, since the server told us it supports it.
+	if(m_canCompress)
+		m_server->m_msgqueue->setCompressOutgoing(true);
 }
 
 void LoginHandler::requestExtAuth(const QString &username, const QString &password)
@@ -439,6 +452,7 @@ void LoginHandler::sendHostCommand()
 
 	cmd.kwargs["protocol"] = protocol::ProtocolVersion::current().asString();
 	cmd.kwargs["user_id"] = m_userid;
+	cmd.kwargs["snapshots"] = true;
 	if(!m_sessionPassword.isEmpty())
 		cmd.kwargs["password"] = m_sessionPassword;
 
@@ -611,6 +625,7 @@ void LoginHandler::sendJoinCommand()
 	protocol::ServerCommand cmd;
 	cmd.cmd = "join";
 	cmd.args.append(m_selectedId);
+	cmd.kwargs["snapshots"] = true;
 
 	if(!m_joinPassword.isEmpty()) {
 		cmd.kwargs["password"] = m_joinPassword;
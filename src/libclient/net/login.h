@@ -404,6 +404,7 @@ private:
 	bool m_multisession;
 	bool m_canPersist;
 	bool m_canReport;
+	bool m_canCompress;
 	bool m_mustAuth;
 	bool m_needUserPassword;
 	bool m_supportsCustomAvatars;
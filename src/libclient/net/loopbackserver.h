@@ -44,6 +44,7 @@ public:
 	QSslCertificate hostCertificate() const override { return QSslCertificate(); }
 	bool supportsPersistence() const override { return false; }
 	bool supportsAbuseReports() const override { return false; }
+	bool supportsCatchupSnapshots() const override { return false; }
 
 };
 
@@ -85,6 +85,11 @@ public:
 	virtual bool supportsPersistence() const = 0;
 	virtual bool supportsAbuseReports() const = 0;
 
+	/**
+	 * @brief Does the session accept catch-up snapshots?
+	 */
+	virtual bool supportsCatchupSnapshots() const = 0;
+
 signals:
 	void messageReceived(protocol::MessagePtr message);
 
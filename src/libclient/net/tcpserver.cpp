@@ -33,7 +33,7 @@ namespace net {
 
 TcpServer::TcpServer(QObject *parent) :
 	Server(false, parent), m_loginstate(nullptr), m_securityLevel(NO_SECURITY),
-	m_localDisconnect(false), m_supportsPersistence(false)
+	m_localDisconnect(false), m_supportsPersistence(false), m_supportsCatchupSnapshots(false)
 {
 	m_socket = new QSslSocket(this);
 
@@ -164,6 +164,7 @@ void TcpServer::loginSuccess()
 
 	m_supportsPersistence = m_loginstate->supportsPersistence();
 	m_supportsAbuseReports = m_loginstate->supportsAbuseReports();
+	m_supportsCatchupSnapshots = m_loginstate->sessionFlags().contains("SNAPSHOTS");
 
 	emit loggedIn(
 		m_loginstate->url(),
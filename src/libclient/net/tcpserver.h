@@ -57,6 +57,7 @@ public:
 
 	bool supportsPersistence() const override { return m_supportsPersistence; }
 	bool supportsAbuseReports() const override { return m_supportsAbuseReports; }
+	bool supportsCatchupSnapshots() const override { return m_supportsCatchupSnapshots; }
 
 signals:
 	void loggedIn(const QUrl &url, uint8_t userid, bool join, bool auth, bool moderator, bool hasAutoreset);
@@ -87,6 +88,7 @@ private:
 	bool m_localDisconnect;
 	bool m_supportsPersistence;
 	bool m_supportsAbuseReports;
+	bool m_supportsCatchupSnapshots;
 };
 
 }
@@ -0,0 +1,183 @@
+#include "../brushes/classicbrushstate.h"
+#include "../brushes/brushpainter.h"
+#include "../core/layer.h"
+
+#include <QtTest/QtTest>
+
+using namespace brushes;
+
+namespace {
+
+static const QSize LAYER_SIZE(256, 256);
+
+struct Stroke {
+	QImage image;
+	int dabCount;
+};
+
+Stroke drawStroke(const ClassicBrush &brush, bool adaptive, const QPointF &from, const QPointF &to)
+{
+	ClassicBrushState state;
+	state.setContextId(1);
+	state.setLayer(1);
+	state.setBrush(brush);
+	state.setAdaptiveSpacing(adaptive);
+
+	// Input points arrive a few pixels apart, like they would from a tablet
+	const int steps = int(QLineF(from, to).length() / 3);
+	for(int i=0;i<=steps;++i)
+		state.strokeTo(paintcore::Point(from + (to - from) * (i / qreal(steps)), 1.0), nullptr);
+	state.endStroke();
+
+	paintcore::Layer layer(1, QString(), Qt::transparent, LAYER_SIZE);
+	paintcore::EditableLayer editable(&layer, nullptr, 1);
+
+	Stroke stroke { QImage(), 0 };
+	for(const protocol::MessagePtr &msg : state.takeDabs()) {
+		stroke.dabCount += static_cast<const protocol::DrawDabsClassic&>(*msg).dabs().size();
+		drawBrushDabsDirect(*msg, editable);
+	}
+	editable.mergeSublayer(1);
+
+	stroke.image = layer.toImage();
+	return stroke;
+}
+
+ClassicBrush hardBrush(int size)
+{
+	ClassicBrush brush;
+	brush.setShape(ClassicBrush::ROUND_SOFT);
+	brush.setColor(Qt::black);
+	brush.setIncremental(false);
+	brush.setSize(size);
+	brush.setHardness(1.0);
+	brush.setOpacity(1.0);
+	brush.setSpacing(0.05);
+	return brush;
+}
+
+inline int alphaAt(const QImage &img, int x, int y)
+{
+	return qAlpha(reinterpret_cast<const QRgb*>(img.constScanLine(y))[x]);
+}
+
+// Is the pixel near the outline of the stroke? (i.e. there are both fully
+// opaque and not fully opaque pixels within the antialiasing margin)
+bool isOnOutline(const QImage &img, int x, int y)
+{
+	static const int MARGIN = 2;
+	bool inside = false, outside = false;
+	for(int yy=qMax(0, y-MARGIN);yy<=qMin(img.height()-1, y+MARGIN);++yy) {
+		for(int xx=qMax(0, x-MARGIN);xx<=qMin(img.width()-1, x+MARGIN);++xx) {
+			if(alphaAt(img, xx, yy) == 255)
+				inside = true;
+			else
+				outside = true;
+		}
+	}
+	return inside && outside;
+}
+
+}
+
+class TestClassicBrushState : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testAdaptiveSpacing_data()
+	{
+		QTest::addColumn<int>("size");
+		QTest::addColumn<QPointF>("from");
+		QTest::addColumn<QPointF>("to");
+
+		QTest::newRow("large horizontal") << 64 << QPointF(40, 128) << QPointF(216, 128);
+		QTest::newRow("large diagonal") << 64 << QPointF(40, 40) << QPointF(200, 170);
+		QTest::newRow("medium diagonal") << 20 << QPointF(30, 200) << QPointF(220, 50.5);
+		QTest::newRow("small") << 6 << QPointF(20, 20.3) << QPointF(230, 60);
+	}
+
+	void testAdaptiveSpacing()
+	{
+		QFETCH(int, size);
+		QFETCH(QPointF, from);
+		QFETCH(QPointF, to);
+
+		const ClassicBrush brush = hardBrush(size);
+		const Stroke fixed = drawStroke(brush, false, from, to);
+		const Stroke adaptive = drawStroke(brush, true, from, to);
+
+		QVERIFY(adaptive.dabCount < fixed.dabCount);
+
+		// The stroke outline may dip by up to a quarter pixel between the
+		// wider spaced dabs. Overlapping antialiased edges of the densely
+		// spaced dabs also build up a little more opacity. Together these must
+		// stay within half a pixel on each side of the stroke, and nothing
+		// away from the outline may change.
+		// With adaptive spacing, the stroke ends with a dab at the last point.
+		// The fixed spacing stroke can end up to one (narrow) spacing short
+		// of it, so only the thin crescent between the two end caps is skipped.
+		const qreal radius = size / 2.0;
+		const qreal fixedSpacing = qMax(1.0, brush.spacingDist(1.0));
+		const QLineF direction = QLineF(from, to).unitVector();
+		const QPointF dir = direction.p2() - direction.p1();
+
+		qint64 difference = 0;
+		for(int y=0;y<LAYER_SIZE.height();++y) {
+			for(int x=0;x<LAYER_SIZE.width();++x) {
+				const QPointF v = QPointF(x, y) - to;
+				const qreal dist = QLineF(QPointF(x, y), to).length();
+				if(dist >= radius - fixedSpacing - 2 && dist <= radius + 2 && QPointF::dotProduct(v, dir) >= -fixedSpacing - 2)
+					continue;
+
+				const int d = qAbs(alphaAt(fixed.image, x, y) - alphaAt(adaptive.image, x, y));
+				if(d > 0) {
+					if(!isOnOutline(fixed.image, x, y))
+						QFAIL(QString("Pixel %1,%2 away from the outline differs by %3").arg(x).arg(y).arg(d).toUtf8().constData());
+					difference += d;
+				}
+			}
+		}
+
+		const qreal length = QLineF(from, to).length();
+		QVERIFY2(difference / 255.0 <= 2 * length * 0.5, QByteArray::number(difference / 255.0 / length).constData());
+	}
+
+	// Brushes that are not fully hard or opaque must not be affected
+	void testNotAdapted_data()
+	{
+		QTest::addColumn<qreal>("hardness");
+		QTest::addColumn<bool>("hardnessPressure");
+		QTest::addColumn<bool>("opacityPressure");
+		QTest::addColumn<bool>("incremental");
+
+		QTest::newRow("99% hardness") << 0.99 << false << false << false;
+		QTest::newRow("hardness pressure") << 1.0 << true << false << false;
+		QTest::newRow("opacity pressure") << 1.0 << false << true << false;
+		QTest::newRow("incremental") << 1.0 << false << false << true;
+	}
+
+	void testNotAdapted()
+	{
+		QFETCH(qreal, hardness);
+		QFETCH(bool, hardnessPressure);
+		QFETCH(bool, opacityPressure);
+		QFETCH(bool, incremental);
+
+		ClassicBrush brush = hardBrush(64);
+		brush.setHardness(hardness);
+		brush.setHardness2(0.5);
+		brush.setHardnessPressure(hardnessPressure);
+		brush.setOpacityPressure(opacityPressure);
+		brush.setIncremental(incremental);
+
+		const Stroke fixed = drawStroke(brush, false, QPointF(40, 128), QPointF(216, 128));
+		const Stroke adaptive = drawStroke(brush, true, QPointF(40, 128), QPointF(216, 128));
+
+		QCOMPARE(adaptive.dabCount, fixed.dabCount);
+		QCOMPARE(adaptive.image, fixed.image);
+	}
+};
+
+
+QTEST_MAIN(TestClassicBrushState)
+#include "classicbrushstate.moc"
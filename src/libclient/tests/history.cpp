@@ -0,0 +1,126 @@
+#include "../canvas/history.h"
+#include "../../libshared/net/undo.h"
+#include "../../libshared/net/image.h"
+#include "../../libshared/net/meta.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+using namespace canvas;
+
+class TestHistory : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testStoreAndDecode()
+	{
+		History h;
+		MessageList msgs;
+
+		// Big messages so the history has to span multiple chunks
+		for(int i=0;i<100;++i) {
+			if(i % 10 == 0)
+				msgs << MessagePtr(new UndoPoint(i % 7 + 1));
+			else
+				msgs << MessagePtr(new PutImage(i % 7 + 1, 0x0101, 1, i, i*2, 64, 64, QByteArray(50000, char(i))));
+		}
+		msgs << MessagePtr(new UserLeave(3));
+
+		uint bytes = 0;
+		for(const MessagePtr &m : msgs) {
+			h.append(m);
+			bytes += m->length();
+		}
+
+		QCOMPARE(h.offset(), 0);
+		QCOMPARE(h.end(), msgs.size());
+		QCOMPARE(h.lengthInBytes(), bytes);
+
+		for(int i=0;i<msgs.size();++i) {
+			QCOMPARE(h.type(i), msgs.at(i)->type());
+			QCOMPARE(h.contextId(i), msgs.at(i)->contextId());
+			QCOMPARE(h.undoState(i), DONE);
+			QVERIFY(h.at(i).equals(msgs.at(i)));
+		}
+
+		// Undo state is kept in the index
+		h.setUndoState(5, UNDONE);
+		QCOMPARE(h.undoState(5), UNDONE);
+		QCOMPARE(h.at(5)->undoState(), UNDONE);
+
+		// Meta messages are not undoable
+		h.setUndoState(100, GONE);
+		QCOMPARE(h.undoState(100), DONE);
+
+		// Old messages can be discarded without changing the indices
+		const qint64 mem = h.memoryUsage();
+		h.cleanup(60);
+		QCOMPARE(h.offset(), 60);
+		QCOMPARE(h.end(), msgs.size());
+		QVERIFY(!h.isValidIndex(59));
+		QVERIFY(h.memoryUsage() < mem);
+
+		for(int i=60;i<msgs.size();++i)
+			QVERIFY(h.at(i).equals(msgs.at(i)));
+
+		// More messages can still be added after cleanup
+		h.append(msgs.at(1));
+		QVERIFY(h.at(msgs.size()).equals(msgs.at(1)));
+
+		h.cleanup(h.end());
+		QCOMPARE(h.lengthInBytes(), 0u);
+
+		h.resetTo(1000);
+		QCOMPARE(h.offset(), 1000);
+		QCOMPARE(h.end(), 1000);
+		h.append(msgs.at(0));
+		QVERIFY(h.at(1000).equals(msgs.at(0)));
+		QCOMPARE(h.toList().size(), 1);
+	}
+
+	void testContextIndex()
+	{
+		History h;
+
+		// Users 1 and 2 take turns: UP 1, UP 2, msg 1, msg 2, UP 1, ...
+		for(int i=0;i<10;++i) {
+			h.append(MessagePtr(new UndoPoint(1)));
+			h.append(MessagePtr(new UndoPoint(2)));
+			h.append(MessagePtr(new PutImage(1, 0x0101, 1, 0, 0, 1, 1, QByteArray(10, 0))));
+			h.append(MessagePtr(new PutImage(2, 0x0101, 1, 0, 0, 1, 1, QByteArray(10, 0))));
+		}
+
+		QCOMPARE(h.messagesBy(1, 0, h.end()).size(), 20);
+		QCOMPARE(h.undoPointsBy(2, 0, h.end()).size(), 10);
+		QCOMPARE(h.undoPoints(0, h.end()).size(), 20);
+		QCOMPARE(h.messagesBy(3, 0, h.end()).size(), 0);
+
+		for(const int pos : h.messagesBy(2, 0, h.end()))
+			QCOMPARE(h.contextId(pos), uint8_t(2));
+
+		const History::Positions range = h.undoPointsBy(1, 4, 12);
+		QCOMPARE(range.size(), 2);
+		QCOMPARE(*range.begin(), 4);
+		QCOMPARE(*(range.begin()+1), 8);
+
+		QCOMPARE(h.findUndoPoint(h.end()-1, 1), 37);
+		QCOMPARE(h.findUndoPoint(h.end()-1, 2), 36);
+		QCOMPARE(h.findUndoPoint(36, 1), 36);
+		QCOMPARE(h.findUndoPoint(h.end()-1, 20), 0);
+		QCOMPARE(h.findUndoPoint(h.end()-1, 21), -1);
+
+		// Discarded messages disappear from the index
+		h.cleanup(10);
+		QCOMPARE(h.messagesBy(1, 0, h.end()).size(), 15);
+		QCOMPARE(*h.messagesBy(1, 0, h.end()).begin(), 10);
+		QCOMPARE(h.findUndoPoint(h.end()-1, 14), 12);
+		QCOMPARE(h.findUndoPoint(h.end()-1, 15), -1);
+
+		h.resetTo(h.end());
+		QVERIFY(h.undoPoints(0, h.end()).isEmpty());
+	}
+};
+
+
+QTEST_MAIN(TestHistory)
+#include "history.moc"
@@ -0,0 +1,117 @@
+#include "../canvas/payloadcache.h"
+
+#include <QtTest/QtTest>
+
+using namespace canvas;
+
+class TestPayloadCache : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testDecompress()
+	{
+		PayloadCache cache(1024 * 1024);
+
+		const QByteArray original(10000, 'x');
+		const QByteArray compressed = qCompress(original);
+
+		QCOMPARE(cache.decompress(compressed), original);
+		QCOMPARE(cache.hits(), 0);
+
+		// Same payload in a different buffer is still found
+		const QByteArray copy(compressed.constData(), compressed.length());
+		QCOMPARE(cache.decompress(copy), original);
+		QCOMPARE(cache.hits(), 1);
+
+		// Invalid data is not cached
+		const QByteArray garbage("\x00\x00\x10\x00garbage", 11);
+		QVERIFY(cache.decompress(garbage).isEmpty());
+		QVERIFY(cache.decompress(garbage).isEmpty());
+		QCOMPARE(cache.hits(), 1);
+	}
+
+	void testPrefetch()
+	{
+		PayloadCache cache(1024 * 1024);
+
+		QList<QByteArray> originals, compressed;
+		for(int i=0;i<20;++i) {
+			originals << QByteArray(4000 + i, char(i));
+			compressed << qCompress(originals.last());
+			cache.prefetch(compressed.last(), originals.last().length());
+		}
+
+		QCOMPARE(cache.pendingCount(), 20);
+
+		for(int i=0;i<20;++i)
+			QCOMPARE(cache.decompress(compressed.at(i)), originals.at(i));
+
+		QCOMPARE(cache.pendingCount(), 0);
+
+		// Already cached payloads are not prefetched again
+		cache.prefetch(compressed.first(), originals.first().length());
+		QCOMPARE(cache.pendingCount(), 0);
+	}
+
+	void testBudget()
+	{
+		PayloadCache cache(10000);
+
+		const QByteArray big(6000, 'b');
+		const QByteArray bigCompressed = qCompress(big);
+		const QByteArray big2(6000, 'c');
+		const QByteArray big2Compressed = qCompress(big2);
+
+		// Only one fits in the prefetch budget
+		cache.prefetch(bigCompressed, big.length());
+		cache.prefetch(big2Compressed, big2.length());
+		QCOMPARE(cache.pendingCount(), 1);
+
+		QCOMPARE(cache.decompress(bigCompressed), big);
+		QCOMPARE(cache.decompress(big2Compressed), big2);
+
+		// The cache is full, so the older entry must have been evicted
+		QCOMPARE(cache.decompress(bigCompressed), big);
+		QCOMPARE(cache.hits(), 0);
+
+		// Cleared prefetches are simply decompressed again
+		cache.clear();
+		cache.prefetch(bigCompressed, big.length());
+		cache.clearPrefetches();
+		QCOMPARE(cache.pendingCount(), 0);
+		QCOMPARE(cache.decompress(bigCompressed), big);
+	}
+
+	void testRelease()
+	{
+		PayloadCache cache(10000);
+
+		const QByteArray big(6000, 'b');
+		const QByteArray bigCompressed = qCompress(big);
+		const QByteArray big2(6000, 'c');
+		const QByteArray big2Compressed = qCompress(big2);
+
+		cache.prefetch(bigCompressed, big.length());
+		QCOMPARE(cache.pendingBytes(), big.length());
+
+		// A released prefetch gives its budget back
+		cache.release(bigCompressed);
+		QCOMPARE(cache.pendingCount(), 0);
+		QCOMPARE(cache.pendingBytes(), 0);
+
+		cache.prefetch(big2Compressed, big2.length());
+		QCOMPARE(cache.pendingCount(), 1);
+
+		// Releasing something that isn't pending does nothing
+		cache.release(bigCompressed);
+		QCOMPARE(cache.pendingBytes(), big2.length());
+
+		QCOMPARE(cache.decompress(big2Compressed), big2);
+		QCOMPARE(cache.pendingBytes(), 0);
+		QCOMPARE(cache.decompress(bigCompressed), big);
+	}
+};
+
+
+QTEST_MAIN(TestPayloadCache)
+#include "payloadcache.moc"
@@ -0,0 +1,142 @@
+#include "../brushes/pixelbrushpainter.h"
+#include "../core/layer.h"
+#include "../core/brushmask.h"
+#include "../core/blendmodes.h"
+#include "../../libshared/net/brushes.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+typedef paintcore::BlendMode::Mode Mode;
+
+Q_DECLARE_METATYPE(paintcore::BlendMode::Mode)
+Q_DECLARE_METATYPE(protocol::PixelBrushDabVector)
+
+namespace {
+
+static const QSize LAYER_SIZE(150, 130); // not a multiple of the tile size
+
+// A straight line of dabs, optionally with one softer dab in the middle to break up the run
+PixelBrushDabVector makeDabs(int count, int dx, int dy, int size, int softIndex)
+{
+	PixelBrushDabVector dabs;
+	for(int i=0;i<count;++i) {
+		dabs << PixelBrushDab {
+			int8_t(i>0 ? dx : 0),
+			int8_t(i>0 ? dy : 0),
+			uint8_t(size),
+			uint8_t(i == softIndex ? 128 : 255)
+		};
+	}
+	return dabs;
+}
+
+// Draw each dab separately, the way the pixel brush painter did before dab runs were merged
+void drawDabsOneByOne(const DrawDabsPixel &dabs, paintcore::EditableLayer layer)
+{
+	Mode mode = Mode(dabs.mode());
+	const QColor color = QColor::fromRgba(dabs.color());
+
+	if(color.alpha() > 0) {
+		layer = layer.getEditableSubLayer(dabs.contextId(), mode, color.alpha());
+		mode = paintcore::BlendMode::MODE_NORMAL;
+	}
+
+	int x = dabs.originX();
+	int y = dabs.originY();
+	for(const PixelBrushDab &d : dabs.dabs()) {
+		x += d.x;
+		y += d.y;
+		const paintcore::BrushMask mask = dabs.isSquare()
+			? brushes::makeSquarePixelBrushMask(d.size, d.opacity)
+			: brushes::makeRoundPixelBrushMask(d.size, d.opacity);
+		layer.putBrushStamp(paintcore::BrushStamp { x - d.size/2, y - d.size/2, mask }, color, mode);
+	}
+}
+
+void addPathRows(const char *name, Mode mode, uint32_t color)
+{
+	const struct {
+		const char *name;
+		int x, y, dx, dy, size, count, softIndex;
+	} paths[] = {
+		{"inside", 40, 40, 2, 1, 9, 12, -1},
+		{"tile boundary", 58, 60, 1, 1, 7, 10, -1},
+		{"left edge", 3, 40, -1, 2, 10, 8, -1},
+		{"top edge", 40, 2, 1, -1, 10, 8, -1},
+		{"right and bottom edge", 145, 126, 1, 1, 11, 8, -1},
+		{"large steps", 20, 90, 9, 0, 8, 12, -1},
+		{"soft dab", 80, 30, 1, 2, 6, 12, 5},
+		{"single pixel", 100, 100, 1, 0, 1, 20, -1},
+	};
+
+	for(const bool square : { false, true }) {
+		for(const auto &p : paths) {
+			QTest::newRow(QString("%1 %2 %3").arg(name, square ? "square" : "round", p.name).toUtf8().constData())
+				<< square << mode << color
+				<< p.x << p.y << makeDabs(p.count, p.dx, p.dy, p.size, p.softIndex);
+		}
+	}
+}
+
+}
+
+class TestPixelBrush : public QObject
+{
+	Q_OBJECT
+private slots:
+	// Merged dab runs must give exactly the same result as drawing the dabs one by one
+	void testDabRun_data()
+	{
+		QTest::addColumn<bool>("square");
+		QTest::addColumn<Mode>("mode");
+		QTest::addColumn<uint32_t>("color");
+		QTest::addColumn<int>("x");
+		QTest::addColumn<int>("y");
+		QTest::addColumn<PixelBrushDabVector>("dabs");
+
+		// Direct mode (color alpha is zero): dabs are composited straight onto the layer
+		addPathRows("normal", paintcore::BlendMode::MODE_NORMAL, 0x00ff8040);
+		addPathRows("erase", paintcore::BlendMode::MODE_ERASE, 0x00ff8040);
+		addPathRows("behind", paintcore::BlendMode::MODE_BEHIND, 0x00ff8040);
+		addPathRows("replace", paintcore::BlendMode::MODE_REPLACE, 0x00ff8040);
+
+		// Not merged, since compositing the same pixel twice changes the result
+		addPathRows("multiply", paintcore::BlendMode::MODE_MULTIPLY, 0x00ff8040);
+
+		// Indirect mode: dabs are drawn on a sublayer that is merged later
+		addPathRows("indirect", paintcore::BlendMode::MODE_NORMAL, 0x80ff8040);
+		addPathRows("indirect erase", paintcore::BlendMode::MODE_ERASE, 0x80ff8040);
+	}
+
+	void testDabRun()
+	{
+		QFETCH(bool, square);
+		QFETCH(Mode, mode);
+		QFETCH(uint32_t, color);
+		QFETCH(int, x);
+		QFETCH(int, y);
+		QFETCH(PixelBrushDabVector, dabs);
+
+		const DrawDabsPixel msg(square ? DabShape::Square : DabShape::Round, 1, 1, x, y, color, mode, dabs);
+
+		// Start from a half transparent layer, so erase and behind modes have something to do
+		paintcore::Layer expected(1, QString(), QColor(0, 0, 255, 128), LAYER_SIZE);
+		paintcore::Layer actual(1, QString(), QColor(0, 0, 255, 128), LAYER_SIZE);
+
+		paintcore::EditableLayer expectedEdit(&expected, nullptr, 1);
+		paintcore::EditableLayer actualEdit(&actual, nullptr, 1);
+
+		drawDabsOneByOne(msg, expectedEdit);
+		brushes::drawPixelBrushDabs(msg, actualEdit);
+
+		expectedEdit.mergeSublayer(1);
+		actualEdit.mergeSublayer(1);
+
+		QCOMPARE(actual.toImage(), expected.toImage());
+	}
+};
+
+
+QTEST_MAIN(TestPixelBrush)
+#include "pixelbrush.moc"
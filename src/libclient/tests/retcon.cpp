@@ -1,6 +1,7 @@
 #include "../canvas/retcon.h"
 #include "../../libshared/net/textmode.h"
 #include "../../libshared/net/brushes.h"
+#include "../../libshared/net/undo.h"
 
 #include <QtTest/QtTest>
 
@@ -255,6 +256,74 @@ private slots:
 		);
 	}
 
+	void testIndexedConflicts()
+	{
+		// Check the local fork's area index against a brute force comparison
+		LocalFork lf;
+		QList<AffectedArea> local;
+
+		quint32 seed = 1;
+		auto rand = [&seed](int max) {
+			seed = seed * 1103515245 + 12345;
+			return int((seed >> 16) % max);
+		};
+		auto randomArea = [&rand]() {
+			const int r = rand(20);
+			if(r == 0)
+				return AffectedArea(AffectedArea::LAYERATTRS, rand(4));
+			else if(r == 1)
+				return AffectedArea(AffectedArea::ANNOTATION, rand(4));
+			else if(r == 2)
+				return AffectedArea(AffectedArea::USERATTRS, 0);
+			else if(r == 3) // large rectangle (not in the bucket index)
+				return AffectedArea(AffectedArea::PIXELS, rand(4), QRect(rand(8000)-4000, rand(8000)-4000, 3000, 3000));
+			else
+				return AffectedArea(AffectedArea::PIXELS, rand(4), QRect(rand(8000)-4000, rand(8000)-4000, 1+rand(300), 1+rand(300)));
+		};
+
+		const MessagePtr localMsg(new UndoPoint(1));
+		const MessagePtr remoteMsg(new UndoPoint(2));
+
+		for(int i=0;i<200;++i) {
+			const AffectedArea a = randomArea();
+			lf.addLocalMessage(localMsg, a);
+			local << a;
+		}
+
+		for(int round=0;round<100;++round) {
+			for(int i=0;i<50;++i) {
+				const AffectedArea a = randomArea();
+				bool concurrent = true;
+				for(const AffectedArea &l : local)
+					concurrent &= a.isConcurrentWith(l);
+
+				QCOMPARE(
+					lf.handleReceivedMessage(remoteMsg, a),
+					concurrent ? LocalFork::CONCURRENT : LocalFork::ROLLBACK
+				);
+			}
+
+			// Our own messages return from the server
+			for(int i=0;i<2;++i) {
+				QCOMPARE(lf.handleReceivedMessage(localMsg, local.first()), LocalFork::ALREADYDONE);
+				local.removeFirst();
+			}
+		}
+
+		QVERIFY(lf.isEmpty());
+
+		// An EVERYTHING area conflicts with everything else
+		lf.addLocalMessage(localMsg, AffectedArea(AffectedArea::EVERYTHING, 0));
+		QCOMPARE(lf.handleReceivedMessage(remoteMsg, AffectedArea(AffectedArea::ANNOTATION, 1)), LocalFork::ROLLBACK);
+		QCOMPARE(lf.handleReceivedMessage(localMsg, AffectedArea(AffectedArea::EVERYTHING, 0)), LocalFork::ALREADYDONE);
+
+		// ...but once it's gone, the index should be clean again
+		lf.addLocalMessage(localMsg, AffectedArea(AffectedArea::PIXELS, 1, QRect(-10, -10, 5, 5)));
+		QCOMPARE(lf.handleReceivedMessage(remoteMsg, AffectedArea(AffectedArea::ANNOTATION, 1)), LocalFork::CONCURRENT);
+		QCOMPARE(lf.handleReceivedMessage(remoteMsg, AffectedArea(AffectedArea::PIXELS, 1, QRect(-6, -6, 1, 1))), LocalFork::ROLLBACK);
+		QCOMPARE(lf.handleReceivedMessage(remoteMsg, AffectedArea(AffectedArea::PIXELS, 1, QRect(0, 0, 1, 1))), LocalFork::CONCURRENT);
+	}
+
 private:
 	MessagePtr msg(const QString &line)
 	{
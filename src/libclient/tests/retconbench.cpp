@@ -0,0 +1,65 @@
+#include "../canvas/retcon.h"
+#include "../../libshared/net/undo.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+using namespace canvas;
+
+/**
+ * Benchmark for checking received messages against the local fork.
+ *
+ * Run with e.g. "test_client_retconbench -tickcounter" to get more
+ * stable numbers than the default walltime measurement.
+ */
+class BenchRetcon : public QObject
+{
+	Q_OBJECT
+private slots:
+	void benchConcurrent_data()
+	{
+		QTest::addColumn<int>("forkSize");
+
+		QTest::newRow("10") << 10;
+		QTest::newRow("100") << 100;
+		QTest::newRow("1000") << 1000;
+		QTest::newRow("10000") << 10000;
+	}
+
+	void benchConcurrent()
+	{
+		QFETCH(int, forkSize);
+
+		// Local user is drawing short strokes on the left side of the canvas...
+		LocalFork lf;
+		const MessagePtr localMsg(new UndoPoint(1));
+		for(int i=0;i<forkSize;++i) {
+			lf.addLocalMessage(localMsg, AffectedArea(
+				AffectedArea::PIXELS,
+				1,
+				QRect((i * 7) % 1000, (i * 13) % 2000, 32, 32)
+			));
+		}
+
+		// ...while the remote user is drawing on the right side of the same layer
+		const MessagePtr remoteMsg(new UndoPoint(2));
+		QVector<AffectedArea> remote;
+		for(int i=0;i<100;++i) {
+			remote << AffectedArea(
+				AffectedArea::PIXELS,
+				1,
+				QRect(1100 + (i * 11) % 1000, (i * 17) % 2000, 32, 32)
+			);
+		}
+
+		QBENCHMARK {
+			for(const AffectedArea &a : remote) {
+				if(lf.handleReceivedMessage(remoteMsg, a) != LocalFork::CONCURRENT)
+					QFAIL("unexpected conflict");
+			}
+		}
+	}
+};
+
+QTEST_MAIN(BenchRetcon)
+#include "retconbench.moc"
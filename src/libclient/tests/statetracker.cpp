@@ -0,0 +1,257 @@
+#include "../canvas/statetracker.h"
+#include "../canvas/layerlist.h"
+#include "../core/layerstack.h"
+#include "../core/blendmodes.h"
+#include "../../libshared/net/undo.h"
+#include "../../libshared/net/image.h"
+#include "../../libshared/net/layer.h"
+#include "../../libshared/net/brushes.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+using namespace canvas;
+
+namespace {
+
+struct Canvas {
+	paintcore::LayerStack image;
+	LayerListModel layers;
+	StateTracker state;
+
+	explicit Canvas(bool selective)
+		: state(&image, &layers, 1)
+	{
+		state.setSelectiveReplay(selective);
+		state.setSavepointBudget(0);
+		state.setSavepointMemoryBudget(qint64(1) << 40);
+	}
+
+	void receive(Message *msg) { state.receiveCommand(MessagePtr(msg)); }
+};
+
+MessageList makeHistory()
+{
+	MessageList msgs;
+	msgs << MessagePtr(new CanvasResize(1, 0, 256, 256, 0));
+	msgs << MessagePtr(new LayerCreate(1, 0x0101, 0, 0xffffffff, 0, "Layer 1"));
+
+	for(int i=0;i<8;++i) {
+		const uint8_t ctx = 1 + i % 2;
+		msgs << MessagePtr(new UndoPoint(ctx));
+
+		// Some of these overlap, so selective replay must expand the area
+		msgs << MessagePtr(new FillRect(ctx, 0x0101, paintcore::BlendMode::MODE_NORMAL, (i * 40) % 200, (i * 24) % 180, 48, 40, 0xff000000 | (0x203040 * i)));
+
+		ClassicBrushDabVector dabs;
+		for(int d=0;d<6;++d)
+			dabs << ClassicBrushDab { 8, 2, 10 * 256, 200, 128 };
+		msgs << MessagePtr(new DrawDabsClassic(ctx, 0x0101, i * 30, 200 - i * 20, 0x00ff0000 | i, paintcore::BlendMode::MODE_NORMAL, dabs));
+		msgs << MessagePtr(new PenUp(ctx));
+	}
+	return msgs;
+}
+
+}
+
+class TestStateTracker : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testSelectiveUndo()
+	{
+		Canvas full(false);
+		Canvas selective(true);
+
+		for(const MessagePtr &msg : makeHistory()) {
+			full.state.receiveCommand(msg);
+			selective.state.receiveCommand(msg);
+		}
+
+		QCOMPARE(selective.state.savepointCount(), full.state.savepointCount());
+
+		// (context, redo)
+		const QVector<QPair<uint8_t, bool>> undos {
+			{1, false}, {1, false}, {2, false}, {1, true}, {2, false},
+			{1, true}, {2, true}, {2, true}, {1, false}, {2, true}
+		};
+
+		for(const auto &u : undos) {
+			full.receive(new Undo(u.first, 0, u.second));
+			selective.receive(new Undo(u.first, 0, u.second));
+
+			QCOMPARE(selective.image.toFlatImage(false, true), full.image.toFlatImage(false, true));
+			QCOMPARE(selective.state.savepointCount(), full.state.savepointCount());
+		}
+	}
+
+	void testSelectiveRollback()
+	{
+		Canvas full(false);
+		Canvas selective(true);
+
+		for(const MessagePtr &msg : makeHistory()) {
+			full.state.receiveCommand(msg);
+			selective.state.receiveCommand(msg);
+		}
+
+		// The local user (1) draws something...
+		const MessageList local {
+			MessagePtr(new UndoPoint(1)),
+			MessagePtr(new FillRect(1, 0x0101, paintcore::BlendMode::MODE_NORMAL, 100, 100, 40, 40, 0xff00ff00))
+		};
+		for(const MessagePtr &msg : local) {
+			full.state.localCommand(msg);
+			selective.state.localCommand(msg);
+		}
+
+		// ...but another user's command touching the same area arrives first
+		const MessageList remote {
+			MessagePtr(new UndoPoint(2)),
+			MessagePtr(new FillRect(2, 0x0101, paintcore::BlendMode::MODE_MULTIPLY, 120, 90, 60, 30, 0xff808080))
+		};
+		for(const MessagePtr &msg : remote) {
+			full.state.receiveCommand(msg);
+			selective.state.receiveCommand(msg);
+		}
+
+		QCOMPARE(full.state.rollbackCount(), 1);
+		QCOMPARE(full.state.fastRollbackCount(), 0);
+		QCOMPARE(selective.state.rollbackCount(), 1);
+		QCOMPARE(selective.state.fastRollbackCount(), 1);
+		QVERIFY(selective.state.replayedMessageCount() < full.state.replayedMessageCount());
+		QCOMPARE(selective.image.toFlatImage(false, true), full.image.toFlatImage(false, true));
+
+		// The local user's commands come back from the server
+		for(const MessagePtr &msg : local) {
+			full.state.receiveCommand(msg);
+			selective.state.receiveCommand(msg);
+		}
+		QCOMPARE(selective.image.toFlatImage(false, true), full.image.toFlatImage(false, true));
+	}
+
+	void testEstimateCost()
+	{
+		Canvas c(false);
+		c.state.setSavepointBudget(1 << 30);
+		c.receive(new CanvasResize(1, 0, 256, 256, 0));
+		c.receive(new LayerCreate(1, 0x0101, 0, 0xffffffff, 0, "Layer 1"));
+
+		// The cost of a command is (roughly) the number of pixels it composites,
+		// plus a constant per-message overhead that cancels out here.
+		const auto cost = [&c](Message *msg) {
+			const qint64 before = c.state.replayCostEstimate();
+			c.receive(msg);
+			return c.state.replayCostEstimate() - before;
+		};
+
+		const qint64 smallRect = cost(new FillRect(1, 0x0101, paintcore::BlendMode::MODE_NORMAL, 0, 0, 1, 1, 0xff000000));
+		QCOMPARE(cost(new FillRect(1, 0x0101, paintcore::BlendMode::MODE_NORMAL, 0, 0, 100, 50, 0xff000000)) - smallRect, qint64(4999));
+
+		const qint64 smallImage = cost(new PutImage(1, 0x0101, paintcore::BlendMode::MODE_NORMAL, 0, 0, 1, 1, qCompress(QByteArray(4, '\xff'))));
+		QCOMPARE(cost(new PutImage(1, 0x0101, paintcore::BlendMode::MODE_NORMAL, 0, 0, 20, 10, qCompress(QByteArray(20*10*4, '\xff')))) - smallImage, qint64(199));
+
+		// Classic dab sizes are in 1/256th pixels
+		const ClassicBrushDab classic { 0, 0, 10 * 256, 255, 255 };
+		const qint64 oneClassic = cost(new DrawDabsClassic(1, 0x0101, 0, 0, 0xff000000, paintcore::BlendMode::MODE_NORMAL, ClassicBrushDabVector { classic }));
+		QCOMPARE(cost(new DrawDabsClassic(1, 0x0101, 0, 0, 0xff000000, paintcore::BlendMode::MODE_NORMAL, ClassicBrushDabVector(6, classic))) - oneClassic, qint64(5 * 100));
+		c.receive(new PenUp(1));
+
+		const PixelBrushDab pixel { 0, 0, 8, 255 };
+		for(const DabShape shape : { DabShape::Round, DabShape::Square }) {
+			const qint64 onePixel = cost(new DrawDabsPixel(shape, 1, 0x0101, 0, 0, 0xff000000, paintcore::BlendMode::MODE_NORMAL, PixelBrushDabVector { pixel }));
+			QCOMPARE(cost(new DrawDabsPixel(shape, 1, 0x0101, 0, 0, 0xff000000, paintcore::BlendMode::MODE_NORMAL, PixelBrushDabVector(4, pixel))) - onePixel, qint64(3 * 64));
+		}
+
+		// Commands that don't touch pixels cost only the overhead
+		QCOMPARE(cost(new UndoPoint(1)), cost(new LayerRetitle(1, 0x0101, QStringLiteral("Renamed"))));
+		QVERIFY(cost(new UndoPoint(1)) < smallRect);
+	}
+
+	void testSavepointBudget()
+	{
+		static const int BUDGET = 5;
+
+		Canvas c(false);
+		c.state.setSavepointBudget(BUDGET);
+		c.receive(new CanvasResize(1, 0, 256, 256, 0));
+		c.receive(new LayerCreate(1, 0x0101, 0, 0xffffffff, 0, "Layer 1"));
+
+		QVERIFY(c.state.replayRate() > 0);
+
+		int undoPoints = 0;
+		int created = 0;
+		for(int i=0;i<40;++i) {
+			c.receive(new FillRect(1, 0x0101, paintcore::BlendMode::MODE_NORMAL, 0, 0, 200, 100, 0xff000000 | (i * 0x050505)));
+			QCOMPARE(c.state.replayTimeEstimate(), int(c.state.replayCostEstimate() / c.state.replayRate()));
+
+			const int savepointsBefore = c.state.savepointCount();
+			const int timeBefore = c.state.replayTimeEstimate();
+			c.receive(new UndoPoint(1));
+			++undoPoints;
+
+			if(c.state.savepointCount() > savepointsBefore) {
+				// A savepoint is made once the replay time has used up the budget...
+				++created;
+				QVERIFY(timeBefore >= BUDGET - 1);
+				QCOMPARE(c.state.replayCostEstimate(), qint64(0));
+			} else {
+				// ...and not before that
+				QVERIFY(c.state.replayTimeEstimate() < BUDGET);
+			}
+		}
+
+		QVERIFY(created > 1);
+		QVERIFY(created < undoPoints);
+	}
+
+	void testSavepointThinning()
+	{
+		Canvas unlimited(false);
+		for(const MessagePtr &msg : makeHistory())
+			unlimited.state.receiveCommand(msg);
+
+		// Allow only half of the memory all the savepoints would take
+		Canvas limited(false);
+		Canvas none(false);
+		limited.state.setSavepointMemoryBudget(unlimited.state.savepointMemoryEstimate() / 2);
+		none.state.setSavepointMemoryBudget(0);
+
+		for(const MessagePtr &msg : makeHistory()) {
+			limited.state.receiveCommand(msg);
+			none.state.receiveCommand(msg);
+
+			// Above the minimum number of savepoints, thinning keeps the memory use within the budget
+			if(limited.state.savepointCount() > 5)
+				QVERIFY(limited.state.savepointMemoryEstimate() <= limited.state.savepointMemoryBudget());
+		}
+
+		const QVector<int> all = unlimited.state.savepointPositions();
+		QVERIFY(all.size() > 5);
+
+		// With no memory budget, only the oldest and the four newest are kept
+		const QVector<int> kept = none.state.savepointPositions();
+		QCOMPARE(kept.size(), 5);
+		QCOMPARE(kept.first(), all.first());
+		QCOMPARE(kept.mid(1), all.mid(all.size() - 4));
+
+		// These are always kept, whatever the budget
+		const QVector<int> thinned = limited.state.savepointPositions();
+		QVERIFY(thinned.size() < all.size());
+		QCOMPARE(thinned.first(), all.first());
+		QCOMPARE(thinned.mid(thinned.size() - 4), all.mid(all.size() - 4));
+
+		// Undoing works the same no matter which savepoints are left
+		for(int i=0;i<3;++i) {
+			unlimited.receive(new Undo(1, 0, false));
+			limited.receive(new Undo(1, 0, false));
+			none.receive(new Undo(1, 0, false));
+			QCOMPARE(limited.image.toFlatImage(false, true), unlimited.image.toFlatImage(false, true));
+			QCOMPARE(none.image.toFlatImage(false, true), unlimited.image.toFlatImage(false, true));
+		}
+	}
+};
+
+
+QTEST_MAIN(TestStateTracker)
+#include "statetracker.moc"
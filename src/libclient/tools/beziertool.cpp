@@ -119,6 +119,7 @@ void BezierTool::finishMultipart()
 
 		brushes::BrushEngine brushengine;
 		brushengine.setBrush(owner.client()->myId(), owner.activeLayer(), owner.activeBrush());
+		brushengine.setAdaptiveSpacing(owner.isAdaptiveSpacing());
 
 		const auto pv = calculateBezierCurve();
 		for(const Point &p : pv)
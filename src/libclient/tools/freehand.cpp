@@ -42,6 +42,7 @@ void Freehand::begin(const paintcore::Point& point, bool right, float zoom)
 	m_drawing = true;
 	m_firstPoint = true;
 	m_brushengine.setBrush(owner.client()->myId(), owner.activeLayer(), owner.activeBrush());
+	m_brushengine.setAdaptiveSpacing(owner.isAdaptiveSpacing());
 
 	// The pressure value of the first point is unreliable
 	// because it is (or was?) possible to get a synthetic MousePress event
@@ -98,6 +98,7 @@ void ShapeTool::end()
 
 	brushes::BrushEngine brushengine;
 	brushengine.setBrush(owner.client()->myId(), owner.activeLayer(), owner.activeBrush());
+	brushengine.setAdaptiveSpacing(owner.isAdaptiveSpacing());
 
 	const auto pv = pointVector();
 	for(int i=0;i<pv.size();++i)
@@ -49,6 +49,7 @@ ToolController::ToolController(net::Client *client, QObject *parent)
 	m_activeTool(nullptr),
 	m_prevShift(false), m_prevAlt(false),
 	m_smoothing(0),
+	m_adaptiveSpacing(false),
 	m_handicapBrushSizeJitter(0),
 	m_handicapBrushSizeOffset(0),
 	m_handicapBrushSizeOffsetTarget(0)
@@ -73,6 +73,10 @@ public:
 	void setSmoothing(int smoothing);
 	int smoothing() const { return m_smoothing; }
 
+	//! Use adaptive dab spacing to reduce the number of dabs sent (see ClassicBrushState)
+	void setAdaptiveSpacing(bool adaptive) { m_adaptiveSpacing = adaptive; }
+	bool isAdaptiveSpacing() const { return m_adaptiveSpacing; }
+
 	// TODO this is used just for sending the commands. Replace with a signal?
 	inline net::Client *client() const { return m_client; }
 
@@ -156,6 +160,8 @@ private:
 	int m_smoothing;
 	StrokeSmoother m_smoother;
 
+	bool m_adaptiveSpacing;
+
 	QTimer *m_handicapBrushSizeJitterTimer;
 	float m_handicapBrushSizeJitter;
 	float m_handicapBrushSizeOffset;
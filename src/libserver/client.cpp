@@ -58,6 +58,7 @@ struct Client::Private {
 	bool isMuted = false;
 	bool isHoldLocked = false;
 	bool isAwaitingReset = false;
+	bool supportsCatchupSnapshots = false;
 
 	Private(QTcpSocket *socket, ServerLog *logger)
 		: socket(socket), logger(logger)
@@ -71,6 +72,10 @@ Client::Client(QTcpSocket *socket, ServerLog *logger, QObject *parent)
 	: QObject(parent), d(new Private(socket, logger))
 {
 	d->msgqueue = new protocol::MessageQueue(socket, this);
+
+	// The server only stores and forwards opaque messages, so they
+	// can stay in the buffer they were received in.
+	d->msgqueue->setSharedReceiveBuffers(true);
 	d->socket->setParent(this);
 
 	connect(d->socket, &QAbstractSocket::disconnected, this, &Client::socketDisconnect);
@@ -99,6 +104,20 @@ protocol::MessagePtr Client::joinMessage() const
 	));
 }
 
+static QJsonObject queueDescription(const protocol::QueueStats &stats)
+{
+	QJsonObject o;
+	o["bytes"] = stats.queuedBytes;
+	o["messages"] = stats.queuedMessages;
+	o["maxBytes"] = stats.maxQueuedBytes;
+	o["maxMessages"] = stats.maxQueuedMessages;
+	o["sent"] = double(stats.sentMessages);
+	o["dropped"] = double(stats.droppedMessages);
+	o["avgMsecs"] = stats.sentMessages > 0 ? double(stats.totalQueueTime) / double(stats.sentMessages) : 0.0;
+	o["maxMsecs"] = double(stats.maxQueueTime);
+	return o;
+}
+
 QJsonObject Client::description(bool includeSession) const
 {
 	QJsonObject u;
@@ -111,11 +130,33 @@ QJsonObject Client::description(bool includeSession) const
 	u["muted"] = isMuted();
 	u["mod"] = isModerator();
 	u["tls"] = isSecure();
+	u["queue"] = queueDescription(d->msgqueue->queueStats());
+	u["compress"] = d->msgqueue->isCompressingOutgoing();
+	if(d->msgqueue->isCompressingOutgoing())
+		u["compression"] = compressionDescription(sentCompressionStats(), receivedCompressionStats());
 	if(includeSession && d->session)
 		u["session"] = d->session->id();
 	return u;
 }
 
+static QJsonObject compressionDirection(const protocol::CompressionStats &stats)
+{
+	QJsonObject o;
+	o["raw"] = double(stats.rawBytes);
+	o["compressed"] = double(stats.compressedBytes);
+	o["ratio"] = stats.rawBytes > 0 ? double(stats.compressedBytes) / double(stats.rawBytes) : 1.0;
+	o["cpuMsecs"] = double(stats.nsecs) / 1000000.0;
+	return o;
+}
+
+QJsonObject Client::compressionDescription(const protocol::CompressionStats &sent, const protocol::CompressionStats &received)
+{
+	QJsonObject o;
+	o["sent"] = compressionDirection(sent);
+	o["received"] = compressionDirection(received);
+	return o;
+}
+
 JsonApiResult Client::callJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request)
 {
 	if(!path.isEmpty())
@@ -405,6 +446,31 @@ bool Client::isAwaitingReset() const
 	return d->isAwaitingReset;
 }
 
+void Client::setSupportsCatchupSnapshots(bool supports)
+{
+	d->supportsCatchupSnapshots = supports;
+}
+
+bool Client::supportsCatchupSnapshots() const
+{
+	return d->supportsCatchupSnapshots;
+}
+
+bool Client::startCompression()
+{
+	return d->msgqueue->setCompressOutgoing(true);
+}
+
+const protocol::CompressionStats &Client::sentCompressionStats() const
+{
+	return d->msgqueue->sentCompressionStats();
+}
+
+const protocol::CompressionStats &Client::receivedCompressionStats() const
+{
+	return d->msgqueue->receivedCompressionStats();
+}
+
 bool Client::hasSslSupport() const
 {
 	return d->socket->inherits("QSslSocket");
@@ -29,6 +29,7 @@ class QHostAddress;
 
 namespace protocol {
 	class MessageQueue;
+	struct CompressionStats;
 }
 
 namespace server {
@@ -231,6 +232,13 @@ public:
 	 */
 	QJsonObject description(bool includeSession=true) const;
 
+	/**
+	 * @brief Get a JSON object describing message stream compression statistics
+	 *
+	 * This is used by the admin API
+	 */
+	static QJsonObject compressionDescription(const protocol::CompressionStats &sent, const protocol::CompressionStats &received);
+
 	/**
 	 * @brief Call the client's JSON administration API
 	 *
@@ -263,6 +271,28 @@ public:
 	void setAwaitingReset(bool awaiting);
 	bool isAwaitingReset() const;
 
+	/**
+	 * @brief Can this client upload a catch-up snapshot when asked?
+	 *
+	 * Clients announce this capability in their host or join command.
+	 */
+	void setSupportsCatchupSnapshots(bool supports);
+	bool supportsCatchupSnapshots() const;
+
+	/**
+	 * @brief Compress all messages sent to this client from now on
+	 *
+	 * Clients request this in their ident command.
+	 * @return false if compression is not supported by this server
+	 */
+	bool startCompression();
+
+	//! Get statistics on the compressed messages sent to this client
+	const protocol::CompressionStats &sentCompressionStats() const;
+
+	//! Get statistics on the compressed messages received from this client
+	const protocol::CompressionStats &receivedCompressionStats() const;
+
 	/**
 	 * @brief Write a log entry
 	 *
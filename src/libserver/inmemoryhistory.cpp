@@ -19,6 +19,7 @@
 
 #include "inmemoryhistory.h"
 #include "../libshared/util/passwordhash.h"
+#include "../libshared/net/opaque.h"
 
 namespace server {
 
@@ -29,6 +30,7 @@ InMemoryHistory::InMemoryHistory(const QString &id, const QString &alias, const
 	  m_version(version),
 	  m_maxUsers(254),
 	  m_autoReset(0),
+	  m_storageBytes(0),
 	  m_flags(0)
 {
 }
@@ -47,11 +49,53 @@ std::tuple<protocol::MessageList, int> InMemoryHistory::getBatch(int after) cons
 void InMemoryHistory::historyAdd(const protocol::MessagePtr &msg)
 {
 	m_history << msg;
+	addStorage(msg);
+
+	// A small message can keep a whole receive buffer alive. If the buffers
+	// take a lot more memory than the history itself, copy the messages out
+	// of the mostly unused ones, so the size limit also bounds the memory used.
+	if(m_storageBytes > 2 * qint64(sizeInBytes()) + STORAGE_SLACK)
+		compactStorage();
 }
 
 void InMemoryHistory::historyReset(const protocol::MessageList &newHistory)
 {
 	m_history = newHistory;
+	m_sharedBufferUse.clear();
+	m_storageBytes = 0;
+	for(const protocol::MessagePtr &msg : m_history)
+		addStorage(msg);
+
+	if(m_storageBytes > 2 * qint64(sizeInBytes()) + STORAGE_SLACK)
+		compactStorage();
+}
+
+void InMemoryHistory::addStorage(const protocol::MessagePtr &msg)
+{
+	const protocol::MessageBuffer *buffer = msg->sharedBuffer();
+	if(!buffer) {
+		m_storageBytes += msg->length();
+		return;
+	}
+
+	int &use = m_sharedBufferUse[buffer];
+	if(use == 0)
+		m_storageBytes += buffer->size();
+	use += msg->length();
+}
+
+void InMemoryHistory::compactStorage()
+{
+	for(protocol::MessagePtr &msg : m_history) {
+		const protocol::MessageBuffer *buffer = msg->sharedBuffer();
+		if(buffer && m_sharedBufferUse.value(buffer) < buffer->size() / 2)
+			msg = protocol::MessagePtr(msg->unsharedCopy());
+	}
+
+	m_sharedBufferUse.clear();
+	m_storageBytes = 0;
+	for(const protocol::MessagePtr &msg : m_history)
+		addStorage(msg);
 }
 
 }
@@ -23,6 +23,7 @@
 #include "../libshared/net/protover.h"
 
 #include <QSet>
+#include <QHash>
 
 namespace server {
 
@@ -78,6 +79,14 @@ public:
 	bool isTrusted(const QString &authId) const override { return m_trusted.contains(authId); }
 	bool isAuthenticatedOperators() const override { return !m_ops.isEmpty(); }
 
+	/**
+	 * @brief Get the amount of memory used by the stored messages
+	 *
+	 * Unlike sizeInBytes(), this counts the whole receive buffers
+	 * the messages share with other messages.
+	 */
+	qint64 storageBytes() const { return m_storageBytes; }
+
 protected:
 	void historyAdd(const protocol::MessagePtr &msg) override;
 	void historyReset(const protocol::MessageList &newHistory) override;
@@ -85,7 +94,15 @@ protected:
 	void historyRemoveBan(int) override { /* not persistent */ }
 
 private:
+	// How much more memory than the history size the shared buffers may take before compaction
+	static const qint64 STORAGE_SLACK = 4 * 1024 * 1024;
+
+	void addStorage(const protocol::MessagePtr &msg);
+	void compactStorage();
+
 	protocol::MessageList m_history;
+	QHash<const protocol::MessageBuffer*, int> m_sharedBufferUse; // bytes of stored messages in each shared buffer
+	qint64 m_storageBytes;
 	QSet<QString> m_ops;
 	QSet<QString> m_trusted;
 	QSet<QString> m_announcements;
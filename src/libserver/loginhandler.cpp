@@ -25,6 +25,7 @@
 #include "serverlog.h"
 
 #include "../libshared/net/control.h"
+#include "../libshared/net/messagequeue.h"
 #include "../libshared/util/authtoken.h"
 #include "../libshared/util/networkaccess.h"
 #include "../libshared/util/validators.h"
@@ -77,6 +78,8 @@ void LoginHandler::startLoginProcess()
 		flags << "REPORT";
 	if(m_config->getConfigBool(config::AllowCustomAvatars))
 		flags << "AVATAR";
+	if(protocol::MessageQueue::isCompressionSupported())
+		flags << "COMPRESS";
 
 	greeting.reply["flags"] = flags;
 
@@ -228,6 +231,11 @@ void LoginHandler::handleIdentMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
+	if(cmd.kwargs["compress"].toBool()) {
+		// Client can decompress messages: compress everything from here on
+		m_client->startCompression();
+	}
+
 	if(cmd.kwargs.contains("avatar") && m_config->getConfigBool(config::AllowCustomAvatars)) {
 		// TODO validate
 		m_client->setAvatar(QByteArray::fromBase64(cmd.kwargs["avatar"].toString().toUtf8()));
@@ -498,6 +506,8 @@ static QJsonArray sessionFlags(const Session *session)
 	// Note: this is "NOAUTORESET" for backward compatibility. In 3.0, we should change it to "AUTORESET"
 	if(!session->supportsAutoReset())
 		flags << "NOAUTORESET";
+	if(session->supportsCatchupSnapshots())
+		flags << "SNAPSHOTS";
 	// TODO for version 3.0: PERSIST should be a session specific flag
 
 	return flags;
@@ -528,6 +538,7 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 	}
 
 	m_client->setId(userId);
+	m_client->setSupportsCatchupSnapshots(cmd.kwargs.value("snapshots").toBool());
 
 	QString sessionAlias = cmd.kwargs.value("alias").toString();
 	if(!sessionAlias.isEmpty()) {
@@ -635,6 +646,7 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 
 	// Ok, join the session
 	session->assignId(m_client);
+	m_client->setSupportsCatchupSnapshots(cmd.kwargs.value("snapshots").toBool());
 
 	protocol::ServerReply reply;
 	reply.type = protocol::ServerReply::RESULT;
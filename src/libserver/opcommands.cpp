@@ -106,6 +106,20 @@ void initCancel(Client *client, const QJsonArray &args, const QJsonObject &kwarg
 	client->session()->handleInitCancel(client->id());
 }
 
+void catchupSnapshotBegin(Client *client, const QJsonArray &args, const QJsonObject &kwargs)
+{
+	Q_UNUSED(args);
+	Q_UNUSED(kwargs);
+	client->session()->handleCatchupSnapshotBegin(client->id());
+}
+
+void catchupSnapshotEnd(Client *client, const QJsonArray &args, const QJsonObject &kwargs)
+{
+	Q_UNUSED(args);
+	Q_UNUSED(kwargs);
+	client->session()->handleCatchupSnapshotEnd(client->id());
+}
+
 void sessionConf(Client *client, const QJsonArray &args, const QJsonObject &kwargs)
 {
 	Q_UNUSED(args);
@@ -280,6 +294,8 @@ SrvCommandSet::SrvCommandSet()
 		<< SrvCommand("init-begin", initBegin)
 		<< SrvCommand("init-complete", initComplete)
 		<< SrvCommand("init-cancel", initCancel)
+		<< SrvCommand("catchup-snapshot-begin", catchupSnapshotBegin, SrvCommand::NONOP)
+		<< SrvCommand("catchup-snapshot-end", catchupSnapshotEnd, SrvCommand::NONOP)
 		<< SrvCommand("sessionconf", sessionConf)
 		<< SrvCommand("kick-user", kickUser, SrvCommand::DEPUTY)
 		<< SrvCommand("gain-op", opWord, SrvCommand::NONOP)
@@ -120,6 +120,14 @@ public:
 	 */
 	virtual bool supportsAutoReset() const = 0;
 
+	/**
+	 * Can clients upload catch-up snapshots to this session?
+	 *
+	 * A catch-up snapshot lets newly joining users start from a recent
+	 * canvas state instead of replaying the whole session history.
+	 */
+	virtual bool supportsCatchupSnapshots() const = 0;
+
 	//! Set session attributes
 	void setSessionConfig(const QJsonObject &conf, Client *changedBy);
 
@@ -269,6 +277,10 @@ public:
 	void handleInitComplete(int ctxId);
 	void handleInitCancel(int ctxId);
 
+	// Catch-up snapshot uploading, called via opcommands
+	virtual void handleCatchupSnapshotBegin(int ctxId) = 0;
+	virtual void handleCatchupSnapshotEnd(int ctxId) = 0;
+
 	/**
 	 * @brief Grant or revoke OP status of a user
 	 * @param id user ID
@@ -28,8 +28,11 @@
 #include "templateloader.h"
 #include "announcements.h"
 
+#include "../libshared/net/messagequeue.h"
+
 #include <QTimer>
 #include <QJsonArray>
+#include <QJsonObject>
 #include <QJsonDocument>
 
 namespace server {
@@ -106,6 +109,23 @@ QJsonArray SessionServer::sessionDescriptions() const
 	return descs;
 }
 
+QJsonObject SessionServer::compressionStats() const
+{
+	protocol::CompressionStats sent, received;
+	int compressing = 0;
+
+	for(const ThinServerClient *c : m_clients) {
+		if(c->sentCompressionStats().compressedBytes > 0)
+			++compressing;
+		sent += c->sentCompressionStats();
+		received += c->receivedCompressionStats();
+	}
+
+	QJsonObject o = Client::compressionDescription(sent, received);
+	o["users"] = compressing;
+	return o;
+}
+
 SessionHistory *SessionServer::initHistory(const QString &id, const QString alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder)
 {
 	if(m_useFiledSessions) {
@@ -125,6 +125,11 @@ public:
 	 */
 	int sessionCount() const { return m_sessions.size(); }
 
+	/**
+	 * @brief Get total message compression statistics of the connected users
+	 */
+	QJsonObject compressionStats() const;
+
 	/**
 	 * @brief Stop all running sessions
 	 */
@@ -0,0 +1,72 @@
+#include "../inmemoryhistory.h"
+#include "../../libshared/net/opaque.h"
+
+#include <QtTest/QtTest>
+#include <QtEndian>
+
+using namespace server;
+using protocol::MessagePtr;
+using protocol::MessageBuffer;
+using protocol::MessageBufferPtr;
+
+// Write an opaque message with the given payload length into the buffer
+static MessagePtr putMessage(const MessageBufferPtr &buffer, int offset, int payloadLen, uchar fill)
+{
+	uchar *data = buffer->data() + offset;
+	qToBigEndian(quint16(payloadLen), data);
+	data[2] = protocol::MSG_FILLRECT;
+	data[3] = 1;
+	memset(data + protocol::Message::HEADER_LEN, fill, payloadLen);
+	return MessagePtr(new protocol::OpaqueMessage(buffer, offset));
+}
+
+class TestInMemoryHistory: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testSharedBufferRetention()
+	{
+		InMemoryHistory history("test", QString(), protocol::ProtocolVersion::current(), "test");
+
+		// Each small message is the only one left of a big receive buffer
+		const int chunkSize = 512 * 1024;
+		const int chunkCount = 64;
+		for(int i=0;i<chunkCount;++i) {
+			MessageBufferPtr chunk(new MessageBuffer(chunkSize));
+			QVERIFY(history.addMessage(putMessage(chunk, 0, 10, uchar(i))));
+		}
+
+		QVERIFY(history.storageBytes() <= 2 * qint64(history.sizeInBytes()) + 4 * 1024 * 1024 + chunkSize);
+
+		// The copies are identical to the originals
+		const protocol::MessageList msgs = std::get<0>(history.getBatch(-1));
+		QCOMPARE(msgs.size(), chunkCount);
+		for(int i=0;i<chunkCount;++i) {
+			MessageBufferPtr chunk(new MessageBuffer(chunkSize));
+			QVERIFY(msgs.at(i).equals(putMessage(chunk, 0, 10, uchar(i))));
+		}
+	}
+
+	void testFullBufferStaysShared()
+	{
+		InMemoryHistory history("test", QString(), protocol::ProtocolVersion::current(), "test");
+
+		// A buffer used entirely by messages in the history is not copied
+		const int msgLen = 1004;
+		const int chunkSize = 512 * msgLen;
+		const int chunkCount = 32;
+		for(int i=0;i<chunkCount;++i) {
+			MessageBufferPtr chunk(new MessageBuffer(chunkSize));
+			for(int j=0;j<chunkSize/msgLen;++j)
+				QVERIFY(history.addMessage(putMessage(chunk, j * msgLen, msgLen - protocol::Message::HEADER_LEN, uchar(j))));
+		}
+
+		QCOMPARE(history.storageBytes(), qint64(chunkSize) * chunkCount);
+		for(const MessagePtr &msg : std::get<0>(history.getBatch(-1)))
+			QVERIFY(msg->sharedBuffer() != nullptr);
+	}
+};
+
+
+QTEST_MAIN(TestInMemoryHistory)
+#include "inmemoryhistory.moc"
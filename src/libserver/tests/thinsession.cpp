@@ -0,0 +1,241 @@
+#include "../thinsession.h"
+#include "../thinserverclient.h"
+#include "../inmemoryhistory.h"
+#include "../inmemoryconfig.h"
+#include "../announcements.h"
+#include "../../libshared/net/image.h"
+#include "../../libshared/net/meta.h"
+#include "../../libshared/net/meta2.h"
+
+#include <QtTest/QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <memory>
+
+using namespace server;
+using protocol::MessagePtr;
+using protocol::MessageList;
+
+// A running thin session with a host who can upload catch-up snapshots
+class SessionFixture
+{
+public:
+	SessionFixture(QTcpServer &server, int snapshotInterval)
+		: announcements(&config), m_server(server)
+	{
+		config.setConfigInt(config::CatchupSnapshotInterval, snapshotInterval);
+		session = new ThinSession(
+			new InMemoryHistory("test", QString(), protocol::ProtocolVersion::current(), "host"),
+			&config,
+			&announcements
+		);
+
+		host = join(1, true, true);
+		session->handleInitComplete(1);
+	}
+
+	~SessionFixture() { delete session; }
+
+	ThinServerClient *join(int id, bool op, bool host=false)
+	{
+		// The remote end of the connection is not used
+		auto *remote = new QTcpSocket(session);
+		remote->connectToHost(QHostAddress::LocalHost, m_server.serverPort());
+		if(!remote->waitForConnected(5000) || !m_server.waitForNewConnection(5000))
+			return nullptr;
+
+		auto *client = new ThinServerClient(m_server.nextPendingConnection(), config.logger(), session);
+		client->setId(id);
+		client->setUsername(QString("user %1").arg(id));
+		client->setOperator(op);
+		client->setSupportsCatchupSnapshots(op);
+		session->joinUser(client, host);
+		return client;
+	}
+
+	// Send about the given number of bytes of drawing commands
+	void draw(Client *client, int bytes)
+	{
+		for(int i=0;i<bytes;i+=1000)
+			session->handleClientMessage(*client, MessagePtr(new protocol::PutImage(client->id(), 1, 0, 0, 0, 10, 10, QByteArray(1000, char(i)))));
+	}
+
+	// Upload some catch-up snapshot content
+	void upload(Client *client, int tiles)
+	{
+		for(int i=0;i<tiles;++i)
+			session->handleClientMessage(*client, MessagePtr(new protocol::PutTile(client->id(), 1, 0, i, 0, 0, QByteArray(1000, char(i)))));
+	}
+
+	// Index of the latest SoftResetPoint in the history, or -1
+	int softResetIndex() const
+	{
+		const MessageList msgs = std::get<0>(session->history()->getBatch(session->history()->firstIndex() - 1));
+		for(int i=msgs.size()-1;i>=0;--i) {
+			if(msgs.at(i)->type() == protocol::MSG_SOFTRESET)
+				return session->history()->firstIndex() + i;
+		}
+		return -1;
+	}
+
+	InMemoryConfig config;
+	sessionlisting::Announcements announcements;
+	ThinSession *session;
+	ThinServerClient *host;
+
+private:
+	QTcpServer &m_server;
+};
+
+class TestThinSession : public QObject
+{
+	Q_OBJECT
+private slots:
+	void initTestCase()
+	{
+		QVERIFY(m_server.listen(QHostAddress::LocalHost));
+	}
+
+	void testNoRequestByDefault()
+	{
+		SessionFixture f(m_server, 0);
+		QVERIFY(f.host);
+		QVERIFY(!f.session->supportsCatchupSnapshots());
+
+		f.draw(f.host, 100000);
+		QCOMPARE(f.softResetIndex(), -1);
+	}
+
+	void testRequest()
+	{
+		SessionFixture f(m_server, 10000);
+		QVERIFY(f.host);
+		QVERIFY(f.session->supportsCatchupSnapshots());
+
+		// Nothing is requested before the history has grown by the interval
+		ThinServerClient *user = f.join(2, false);
+		QVERIFY(user);
+		f.draw(user, 5000);
+		QCOMPARE(f.softResetIndex(), -1);
+
+		f.draw(user, 10000);
+		const int marker = f.softResetIndex();
+		QVERIFY(marker >= 0);
+		QCOMPARE(std::get<0>(f.session->history()->getBatch(marker-1)).first()->contextId(), uint8_t(f.host->id()));
+	}
+
+	void testUploadAndJoin()
+	{
+		SessionFixture f(m_server, 10000);
+		QVERIFY(f.host);
+
+		f.draw(f.host, 15000);
+		const int marker = f.softResetIndex();
+		QVERIFY(marker >= 0);
+
+		// This user's join message is in the history after the snapshot point
+		ThinServerClient *lateUser = f.join(2, false);
+		QVERIFY(lateUser);
+
+		// The snapshot upload is not part of the history
+		const int historyEnd = f.session->history()->lastIndex();
+		f.session->handleCatchupSnapshotBegin(f.host->id());
+		f.upload(f.host, 3);
+		f.session->handleCatchupSnapshotEnd(f.host->id());
+		QCOMPARE(f.session->history()->lastIndex(), historyEnd);
+
+		QCOMPARE(f.session->catchupSnapshotIndex(), marker);
+		const MessageList snapshot = f.session->catchupSnapshotMessages();
+		int joins = 0, tiles = 0;
+		for(const MessagePtr &msg : snapshot) {
+			if(msg->type() == protocol::MSG_USER_JOIN) {
+				QCOMPARE(msg->contextId(), uint8_t(f.host->id()));
+				++joins;
+			} else if(msg->type() == protocol::MSG_PUTTILE) {
+				++tiles;
+			}
+		}
+		QCOMPARE(joins, 1);
+		QCOMPARE(tiles, 3);
+
+		// New users start from the snapshot
+		ThinServerClient *newUser = f.join(3, false);
+		QVERIFY(newUser);
+		QVERIFY(newUser->historyPosition() >= marker);
+	}
+
+	void testUploaderLeaves()
+	{
+		SessionFixture f(m_server, 10000);
+		QVERIFY(f.host);
+		ThinServerClient *user = f.join(2, false);
+		QVERIFY(user);
+
+		f.draw(user, 15000);
+		QVERIFY(f.softResetIndex() >= 0);
+
+		f.session->handleCatchupSnapshotBegin(f.host->id());
+		f.upload(f.host, 3);
+		f.host->disconnectClient(Client::DisconnectionReason::Shutdown, QString());
+
+		// A late end message from a reused ID must not complete the snapshot
+		f.session->handleCatchupSnapshotEnd(f.host->id());
+		QCOMPARE(f.session->catchupSnapshotIndex(), -1);
+		QVERIFY(f.session->catchupSnapshotMessages().isEmpty());
+	}
+
+	void testMessagesDuringUpload()
+	{
+		SessionFixture f(m_server, 10000);
+		QVERIFY(f.host);
+
+		f.draw(f.host, 15000);
+		QVERIFY(f.softResetIndex() >= 0);
+
+		f.session->handleCatchupSnapshotBegin(f.host->id());
+		f.upload(f.host, 2);
+
+		// Chat and pointer moves can overtake the snapshot upload.
+		// They (and anything else that isn't canvas state) go to the history.
+		const int historyEnd = f.session->history()->lastIndex();
+		f.session->handleClientMessage(*f.host, MessagePtr(new protocol::Chat(f.host->id(), 0, 0, QByteArray("Hello"))));
+		f.session->handleClientMessage(*f.host, MessagePtr(new protocol::MovePointer(f.host->id(), 10, 10)));
+		f.draw(f.host, 1000);
+		QCOMPARE(f.session->history()->lastIndex(), historyEnd + 3);
+
+		f.upload(f.host, 1);
+		f.session->handleCatchupSnapshotEnd(f.host->id());
+
+		int tiles = 0;
+		for(const MessagePtr &msg : f.session->catchupSnapshotMessages()) {
+			QVERIFY(msg->type() != protocol::MSG_CHAT);
+			QVERIFY(msg->type() != protocol::MSG_MOVEPOINTER);
+			QVERIFY(msg->type() != protocol::MSG_PUTIMAGE);
+			if(msg->type() == protocol::MSG_PUTTILE)
+				++tiles;
+		}
+		QCOMPARE(tiles, 3);
+	}
+
+	void testUnrequestedUpload()
+	{
+		SessionFixture f(m_server, 10000);
+		QVERIFY(f.host);
+
+		// Without a request, the upload is treated as ordinary messages
+		f.session->handleCatchupSnapshotBegin(f.host->id());
+		const int historyEnd = f.session->history()->lastIndex();
+		f.draw(f.host, 1000);
+		f.session->handleCatchupSnapshotEnd(f.host->id());
+
+		QCOMPARE(f.session->history()->lastIndex(), historyEnd + 1);
+		QCOMPARE(f.session->catchupSnapshotIndex(), -1);
+	}
+
+private:
+	QTcpServer m_server;
+};
+
+
+QTEST_MAIN(TestThinSession)
+#include "thinsession.moc"
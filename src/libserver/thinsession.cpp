@@ -23,14 +23,52 @@
 #include "serverconfig.h"
 
 #include "../libshared/net/control.h"
+#include "../libshared/net/meta.h"
 
 namespace server {
 
+// Give up on a catch-up snapshot request if the upload hasn't started in this time
+static const qint64 CATCHUP_SNAPSHOT_TIMEOUT = 60 * 1000;
+
+// Give up on a catch-up snapshot upload if it hasn't finished in this time
+static const qint64 CATCHUP_SNAPSHOT_UPLOAD_TIMEOUT = 5 * 60 * 1000;
+
+/**
+ * Can this message be a part of a catch-up snapshot?
+ *
+ * These are the canvas state messages generated by SnapshotLoader::loadInitCommands.
+ * Other messages the uploader sends during the upload (chat and pointer moves
+ * travel in lanes that can overtake the snapshot) belong in the session history.
+ */
+static bool isSnapshotMessage(const protocol::Message &msg)
+{
+	switch(msg.type()) {
+	case protocol::MSG_CANVAS_RESIZE:
+	case protocol::MSG_CANVAS_BACKGROUND:
+	case protocol::MSG_LAYER_DEFAULT:
+	case protocol::MSG_LAYER_CREATE:
+	case protocol::MSG_LAYER_ATTR:
+	case protocol::MSG_PUTTILE:
+	case protocol::MSG_LAYER_ACL:
+	case protocol::MSG_ANNOTATION_CREATE:
+	case protocol::MSG_ANNOTATION_EDIT:
+	case protocol::MSG_FEATURE_LEVELS:
+	case protocol::MSG_USER_ACL:
+		return true;
+	case protocol::MSG_CHAT:
+		// The pinned message
+		return static_cast<const protocol::Chat&>(msg).isPin();
+	default:
+		return false;
+	}
+}
+
 ThinSession::ThinSession(SessionHistory *history, ServerConfig *config, sessionlisting::Announcements *announcements, QObject *parent)
 	: Session(history, config, announcements, parent)
 {
 	history->setSizeLimit(config->getConfigSize(config::SessionSizeLimit));
 	history->setAutoResetThreshold(config->getConfigSize(config::AutoresetThreshold));
+	m_snapshotInterval = config->getConfigSize(config::CatchupSnapshotInterval);
 	m_lastStatusUpdate.start();
 }
 
@@ -39,6 +77,30 @@ void ThinSession::addToHistory(protocol::MessagePtr msg)
 	if(state() == State::Shutdown)
 		return;
 
+	// An upload that never finishes would keep diverting the uploader's messages
+	if(m_snapshotState == CatchupSnapshotState::Uploading && m_snapshotRequestTime.elapsed() > CATCHUP_SNAPSHOT_UPLOAD_TIMEOUT)
+		abortCatchupSnapshot(QString("User %1 did not finish catch-up snapshot upload in time").arg(m_snapshotUser));
+
+	if(m_snapshotState != CatchupSnapshotState::None && msg->contextId() == m_snapshotUser) {
+		if(msg->type() == protocol::MSG_USER_LEAVE) {
+			// The user we asked for a snapshot left. If their ID gets reused,
+			// we don't want the new user's reply to be mistaken for theirs.
+			abortCatchupSnapshot(QString("User %1 left before catch-up snapshot was finished").arg(m_snapshotUser));
+
+		} else if(m_snapshotState == CatchupSnapshotState::Uploading && isSnapshotMessage(*msg)) {
+			// The catch-up snapshot being uploaded is not
+			// part of the session history.
+			m_snapshotUploadSize += msg->length();
+
+			// Keep counting, but don't keep oversized snapshots in memory
+			if(history()->sizeLimit() > 0 && m_snapshotUploadSize > history()->sizeLimit())
+				m_snapshotUpload = protocol::MessageList();
+			else
+				m_snapshotUpload << msg;
+			return;
+		}
+	}
+
 	// Add message to history (if there is space)
 	if(!history()->addMessage(msg)) {
 		messageAll("History size limit reached! Session must be reset to continue.", false);
@@ -93,6 +155,15 @@ void ThinSession::addToHistory(protocol::MessagePtr msg)
 		m_autoResetRequestStatus = AutoResetState::Queried;
 	}
 
+	// The user we asked for a snapshot may never answer (e.g. if they weren't in sync)
+	if(m_snapshotState == CatchupSnapshotState::Requested && m_snapshotRequestTime.elapsed() > CATCHUP_SNAPSHOT_TIMEOUT)
+		abortCatchupSnapshot(QString("User %1 did not start catch-up snapshot upload in time").arg(m_snapshotUser));
+
+	// Periodically ask a user to upload a snapshot that new users can catch up from.
+	// This is off by default, since each request truncates everyone's undo history.
+	if(m_snapshotInterval > 0 && state() == State::Running && m_snapshotState != CatchupSnapshotState::Uploading && history()->sizeInBytes() > m_snapshotRequestSize + m_snapshotInterval)
+		requestCatchupSnapshot();
+
 	// Regular history size status updates
 	if(m_lastStatusUpdate.elapsed() > 10 * 1000) {
 		protocol::ServerReply status;
@@ -145,6 +216,120 @@ void ThinSession::readyToAutoReset(int ctxId)
 	m_autoResetRequestStatus = AutoResetState::Requested;
 }
 
+void ThinSession::requestCatchupSnapshot()
+{
+	m_snapshotRequestSize = history()->sizeInBytes();
+
+	// Pick the operator who is furthest along in the history.
+	// (Only operators are trusted with uploading snapshots, just like with resets.)
+	ThinServerClient *uploader = nullptr;
+	for(Client *c : clients()) {
+		if(!c->isOperator() || !c->supportsCatchupSnapshots())
+			continue;
+
+		auto *tc = static_cast<ThinServerClient*>(c);
+		if(!uploader || tc->historyPosition() > uploader->historyPosition())
+			uploader = tc;
+	}
+
+	if(!uploader)
+		return;
+
+	// The soft reset point marks the place in the history the snapshot
+	// should be made at. Clients also truncate their undo history here, so
+	// nothing after the snapshot point can be undone past it.
+	protocol::MessagePtr marker { new protocol::SoftResetPoint(uploader->id()) };
+	if(!history()->addMessage(marker))
+		return;
+
+	m_snapshotState = CatchupSnapshotState::Requested;
+	m_snapshotUser = uploader->id();
+	m_snapshotRequestIndex = history()->lastIndex();
+	m_snapshotRequestTime.start();
+
+	// Users who join after this point have their join messages in the history
+	// after the snapshot, so the state must be the one at the time of the request.
+	m_snapshotRequestState = serverSideStateMessages();
+
+	log(Log().about(Log::Level::Debug, Log::Topic::Status).message(QString("Requested catch-up snapshot from user %1").arg(m_snapshotUser)));
+
+	addedToHistory(marker);
+}
+
+void ThinSession::handleCatchupSnapshotBegin(int ctxId)
+{
+	if(m_snapshotState != CatchupSnapshotState::Requested || ctxId != m_snapshotUser) {
+		// May happen if the request was superseded by a newer one
+		log(Log().about(Log::Level::Debug, Log::Topic::Status).message(QString("User %1 sent an unrequested catch-up snapshot").arg(ctxId)));
+		return;
+	}
+
+	m_snapshotState = CatchupSnapshotState::Uploading;
+	m_snapshotRequestTime.start(); // upload deadline starts now
+	m_snapshotUpload = protocol::MessageList();
+	m_snapshotUploadSize = 0;
+}
+
+void ThinSession::handleCatchupSnapshotEnd(int ctxId)
+{
+	if(m_snapshotState != CatchupSnapshotState::Uploading || ctxId != m_snapshotUser) {
+		log(Log().about(Log::Level::Debug, Log::Topic::Status).message(QString("User %1 sent catchup-snapshot-end, but no upload was in progress").arg(ctxId)));
+		return;
+	}
+
+	m_snapshotState = CatchupSnapshotState::None;
+
+	if(history()->sizeLimit() > 0 && m_snapshotUploadSize > history()->sizeLimit()) {
+		log(Log().about(Log::Level::Warn, Log::Topic::Status).message(QString("Catch-up snapshot (%1 bytes) exceeds history size limit").arg(m_snapshotUploadSize)));
+
+	} else if(m_snapshotRequestIndex >= history()->firstIndex()) {
+		m_catchupSnapshotState = m_snapshotRequestState;
+		m_catchupSnapshot = m_snapshotUpload;
+		m_catchupSnapshotIndex = m_snapshotRequestIndex;
+
+		log(Log().about(Log::Level::Info, Log::Topic::Status).message(QString("Received a %1 MB catch-up snapshot from user %2")
+			.arg(m_snapshotUploadSize / (1024.0*1024.0), 0, 'f', 2)
+			.arg(ctxId)));
+	}
+
+	m_snapshotUpload = protocol::MessageList();
+	m_snapshotUploadSize = 0;
+	m_snapshotRequestState = protocol::MessageList();
+}
+
+void ThinSession::abortCatchupSnapshot(const QString &reason)
+{
+	log(Log().about(Log::Level::Info, Log::Topic::Status).message(reason));
+
+	m_snapshotState = CatchupSnapshotState::None;
+	m_snapshotUpload = protocol::MessageList();
+	m_snapshotUploadSize = 0;
+	m_snapshotRequestState = protocol::MessageList();
+}
+
+void ThinSession::clearCatchupSnapshot()
+{
+	m_snapshotState = CatchupSnapshotState::None;
+	m_snapshotUpload = protocol::MessageList();
+	m_snapshotUploadSize = 0;
+	m_snapshotRequestSize = history()->sizeInBytes();
+	m_snapshotRequestState = protocol::MessageList();
+
+	m_catchupSnapshotState = protocol::MessageList();
+	m_catchupSnapshot = protocol::MessageList();
+	m_catchupSnapshotIndex = -1;
+}
+
+protocol::MessageList ThinSession::catchupSnapshotMessages() const
+{
+	if(state() != State::Running
+		|| m_catchupSnapshotIndex < history()->firstIndex()
+		|| m_catchupSnapshotIndex > history()->lastIndex())
+		return protocol::MessageList();
+
+	return m_catchupSnapshotState + m_catchupSnapshot;
+}
+
 void ThinSession::onSessionReset()
 {
 	protocol::ServerReply catchup;
@@ -153,6 +338,9 @@ void ThinSession::onSessionReset()
 	directToAll(protocol::MessagePtr(new protocol::Command(0, catchup)));
 
 	m_autoResetRequestStatus = AutoResetState::NotSent;
+
+	// The old snapshot refers to history that no longer exists
+	clearCatchupSnapshot();
 }
 
 void ThinSession::onClientJoin(Client *client, bool host)
@@ -161,12 +349,25 @@ void ThinSession::onClientJoin(Client *client, bool host)
 		static_cast<ThinServerClient*>(client), &ThinServerClient::sendNextHistoryBatch);
 
 	if(!host) {
+		// If we have a recent catch-up snapshot, the client can start from it
+		// and skip replaying all the history that came before it.
+		const protocol::MessageList snapshot = catchupSnapshotMessages();
+		const bool useSnapshot = !snapshot.isEmpty();
+
 		// Notify the client how many messages to expect (at least)
 		// The client can use this information to display a progress bar during the login phase
 		protocol::ServerReply catchup;
 		catchup.type = protocol::ServerReply::CATCHUP;
-		catchup.reply["count"] = history()->lastIndex() - history()->firstIndex();
+		if(useSnapshot)
+			catchup.reply["count"] = snapshot.size() + history()->lastIndex() - m_catchupSnapshotIndex;
+		else
+			catchup.reply["count"] = history()->lastIndex() - history()->firstIndex();
 		client->sendDirectMessage(protocol::MessagePtr(new protocol::Command(0, catchup)));
+
+		if(useSnapshot) {
+			client->sendDirectMessage(snapshot);
+			static_cast<ThinServerClient*>(client)->setHistoryPosition(m_catchupSnapshotIndex);
+		}
 	}
 }
 
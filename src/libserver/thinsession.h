@@ -37,6 +37,20 @@ public:
 	void cleanupHistoryCache();
 
 	bool supportsAutoReset() const override { return true; }
+	bool supportsCatchupSnapshots() const override { return m_snapshotInterval > 0; }
+
+	void handleCatchupSnapshotBegin(int ctxId) override;
+	void handleCatchupSnapshotEnd(int ctxId) override;
+
+	/**
+	 * @brief Get the messages a joining user is sent in place of the history before the catch-up snapshot
+	 *
+	 * @return the server side state and snapshot, or an empty list if there is no usable snapshot
+	 */
+	protocol::MessageList catchupSnapshotMessages() const;
+
+	//! Get the history index the catch-up snapshot was made at
+	int catchupSnapshotIndex() const { return m_catchupSnapshotIndex; }
 
 protected:
 	void addToHistory(protocol::MessagePtr msg) override;
@@ -45,10 +59,31 @@ protected:
 
 private:
 	enum class AutoResetState { NotSent, Queried, Requested};
+	enum class CatchupSnapshotState { None, Requested, Uploading };
+
+	void requestCatchupSnapshot();
+	void abortCatchupSnapshot(const QString &reason);
+	void clearCatchupSnapshot();
 
 	QElapsedTimer m_lastStatusUpdate;
 
 	AutoResetState m_autoResetRequestStatus = AutoResetState::NotSent;
+
+	// Catch-up snapshot request and upload state
+	uint m_snapshotInterval = 0; // request a snapshot every time the history grows this much
+	CatchupSnapshotState m_snapshotState = CatchupSnapshotState::None;
+	int m_snapshotUser = 0;
+	int m_snapshotRequestIndex = -1;
+	uint m_snapshotRequestSize = 0;
+	QElapsedTimer m_snapshotRequestTime; // restarted when the upload begins
+	protocol::MessageList m_snapshotRequestState; // server side state as of the request
+	protocol::MessageList m_snapshotUpload;
+	uint m_snapshotUploadSize = 0;
+
+	// The latest complete catch-up snapshot and the history index it corresponds to
+	protocol::MessageList m_catchupSnapshotState;
+	protocol::MessageList m_catchupSnapshot;
+	int m_catchupSnapshotIndex = -1;
 };
 
 }
@@ -25,6 +25,89 @@
 
 namespace protocol {
 
+namespace {
+
+// Maximum number of recycled dab vectors kept per thread
+const int DAB_POOL_MAX = 1024;
+
+// Larger vectors are released rather than recycled
+const int DAB_POOL_MAX_CAPACITY = 256;
+
+/**
+ * Recycled dab vectors
+ *
+ * Each decoded dab message would otherwise need a fresh allocation for
+ * its dab array. The storage of destroyed messages' vectors is kept here
+ * and reused by the next deserialized message.
+ */
+template<typename Dab> class DabVectorPool {
+public:
+	static QVector<Dab> take(int capacity)
+	{
+		QVector<Dab> v;
+		if(s_free && !s_free->isEmpty())
+			v = s_free->takeLast();
+		v.reserve(capacity);
+		return v;
+	}
+
+	static void recycle(QVector<Dab> &v)
+	{
+		if(!Message::isPoolingEnabled() || s_closed || !v.isDetached() || v.capacity() > DAB_POOL_MAX_CAPACITY)
+			return;
+
+		if(!s_free) {
+			// Make sure the cleanup handler is registered for this thread
+			(void)&s_cleanup;
+			s_free = new QVector<QVector<Dab>>;
+			s_free->reserve(DAB_POOL_MAX);
+		}
+
+		if(s_free->size() < DAB_POOL_MAX) {
+			v.resize(0);
+			s_free->append(std::move(v));
+		}
+	}
+
+private:
+	struct Cleanup {
+		~Cleanup() {
+			s_closed = true;
+			delete s_free;
+			s_free = nullptr;
+		}
+	};
+
+	static thread_local QVector<QVector<Dab>> *s_free;
+	static thread_local bool s_closed;
+	static thread_local Cleanup s_cleanup;
+};
+
+template<typename Dab> thread_local QVector<QVector<Dab>> *DabVectorPool<Dab>::s_free = nullptr;
+template<typename Dab> thread_local bool DabVectorPool<Dab>::s_closed = false;
+template<typename Dab> thread_local typename DabVectorPool<Dab>::Cleanup DabVectorPool<Dab>::s_cleanup;
+
+// Text form of a classic dab coordinate (in quarter pixels.)
+// There are only 256 of them, so they are formatted just once.
+const QByteArray &quarterString(int8_t value)
+{
+	static const struct Table {
+		QByteArray s[256];
+		Table() {
+			for(int i=0;i<256;++i)
+				s[i] = QByteArray::number(int8_t(i) / 4.0, 'f', 1);
+		}
+	} table;
+	return table.s[uint8_t(value)];
+}
+
+}
+
+DrawDabsClassic::~DrawDabsClassic()
+{
+	DabVectorPool<ClassicBrushDab>::recycle(m_dabs);
+}
+
 DrawDabsClassic *DrawDabsClassic::deserialize(uint8_t ctx, const uchar *data, uint len)
 {
 	if(len < 15)
@@ -42,7 +125,7 @@ DrawDabsClassic *DrawDabsClassic::deserialize(uint8_t ctx, const uchar *data, ui
 		qFromBigEndian<quint32>(data+10),
 		*(data+14)
 	);
-	d->m_dabs.reserve(dabCount);
+	d->m_dabs = DabVectorPool<ClassicBrushDab>::take(dabCount);
 
 	data += 15;
 
@@ -111,52 +194,58 @@ bool DrawDabsClassic::payloadEquals(const Message &m) const
 
 QString ClassicBrushDab::toString() const
 {
-	return QStringLiteral("%1 %2 %3 %4 %5")
-		.arg(x / 4.0, 0, 'f', 1)
-		.arg(y / 4.0, 0, 'f', 1)
-		.arg(size)
-		.arg(int(hardness))
-		.arg(int(opacity))
-		;
+	QByteArray buffer;
+	toText(buffer);
+	return QString::fromUtf8(buffer);
+}
+
+void ClassicBrushDab::toText(QByteArray &buffer) const
+{
+	buffer += quarterString(x);
+	buffer += ' ';
+	buffer += quarterString(y);
+	buffer += ' ';
+	text::appendNumber(buffer, size);
+	buffer += ' ';
+	text::appendNumber(buffer, hardness);
+	buffer += ' ';
+	text::appendNumber(buffer, opacity);
 }
 
 QString DrawDabsClassic::toString() const
 {
-	QString s = QStringLiteral("%1 %2 layer=%3 x=%4 y=%5 color=%6 mode=%7 {\n\t")
-		.arg(contextId())
-		.arg(messageName())
-		.arg(text::idString(m_layer))
-		.arg(m_x / 4.0, 0, 'f', 1)
-		.arg(m_y / 4.0, 0, 'f', 1)
-		.arg(text::argbString(m_color))
-		.arg(int(m_mode))
-		;
+	QByteArray buffer;
+	toText(buffer);
+	return QString::fromUtf8(buffer);
+}
+
+void DrawDabsClassic::toText(QByteArray &buffer) const
+{
+	text::appendNumber(buffer, contextId());
+	buffer += " classicdabs layer=";
+	text::appendIdString(buffer, m_layer);
+	buffer += " x=";
+	buffer += QByteArray::number(m_x / 4.0, 'f', 1);
+	buffer += " y=";
+	buffer += QByteArray::number(m_y / 4.0, 'f', 1);
+	buffer += " color=";
+	text::appendArgbString(buffer, m_color);
+	buffer += " mode=";
+	text::appendNumber(buffer, m_mode);
+	buffer += " {\n\t";
 
 	for(const ClassicBrushDab &p : m_dabs) {
-		s += p.toString();
-		s += "\n\t";
+		p.toText(buffer);
+		buffer += "\n\t";
 	}
-	s += "}";
-	return s;
+	buffer += '}';
 }
 
-DrawDabsClassic *DrawDabsClassic::fromText(uint8_t ctx, const Kwargs &kwargs, const QStringList &dabs)
+DrawDabsClassic *DrawDabsClassic::fromText(uint8_t ctx, const Kwargs &kwargs, const ClassicBrushDabVector &dabs)
 {
-	if(dabs.size() % 5 != 0)
+	if(dabs.size() > MAX_DABS)
 		return nullptr;
 
-	ClassicBrushDabVector dabvector;
-	dabvector.reserve(dabs.size() / 5);
-	for(int i=0;i<dabs.size();i+=5) {
-		dabvector << ClassicBrushDab {
-			int8_t(dabs.at(i+0).toFloat() * 4),
-			int8_t(dabs.at(i+1).toFloat() * 4),
-			uint16_t(dabs.at(i+2).toInt()),
-			uint8_t(dabs.at(i+3).toInt()),
-			uint8_t(dabs.at(i+4).toInt())
-		};
-	}
-
 	return new DrawDabsClassic(
 		ctx,
 		text::parseIdString16(kwargs["layer"]),
@@ -164,7 +253,7 @@ DrawDabsClassic *DrawDabsClassic::fromText(uint8_t ctx, const Kwargs &kwargs, co
 		kwargs.value("y").toFloat() * 4,
 		text::parseColor(kwargs["color"]),
 		kwargs.value("mode", "1").toInt(),
-		dabvector
+		dabs
 	);
 }
 
@@ -240,6 +329,11 @@ bool DrawDabsClassic::extend(const DrawDabs &dabs)
 	return true;
 }
 
+DrawDabsPixel::~DrawDabsPixel()
+{
+	DabVectorPool<PixelBrushDab>::recycle(m_dabs);
+}
+
 DrawDabsPixel *DrawDabsPixel::deserialize(DabShape shape, uint8_t ctx, const uchar *data, uint len)
 {
 	if(len < 15)
@@ -258,7 +352,7 @@ DrawDabsPixel *DrawDabsPixel::deserialize(DabShape shape, uint8_t ctx, const uch
 		qFromBigEndian<quint32>(data+10),
 		*(data+14)
 	);
-	d->m_dabs.reserve(dabCount);
+	d->m_dabs = DabVectorPool<PixelBrushDab>::take(dabCount);
 
 	data += 15;
 
@@ -324,50 +418,56 @@ bool DrawDabsPixel::payloadEquals(const Message &m) const
 
 QString PixelBrushDab::toString() const
 {
-	return QStringLiteral("%1 %2 %3 %4")
-		.arg(int(x))
-		.arg(int(y))
-		.arg(int(size))
-		.arg(int(opacity))
-		;
+	QByteArray buffer;
+	toText(buffer);
+	return QString::fromUtf8(buffer);
+}
+
+void PixelBrushDab::toText(QByteArray &buffer) const
+{
+	text::appendNumber(buffer, x);
+	buffer += ' ';
+	text::appendNumber(buffer, y);
+	buffer += ' ';
+	text::appendNumber(buffer, size);
+	buffer += ' ';
+	text::appendNumber(buffer, opacity);
 }
 
 QString DrawDabsPixel::toString() const
 {
-	QString s = QStringLiteral("%1 %2 layer=%3 x=%4 y=%5 color=%6 mode=%7 {\n\t")
-		.arg(contextId())
-		.arg(messageName())
-		.arg(text::idString(m_layer))
-		.arg(m_x)
-		.arg(m_y)
-		.arg(text::argbString(m_color))
-		.arg(int(m_mode))
-		;
+	QByteArray buffer;
+	toText(buffer);
+	return QString::fromUtf8(buffer);
+}
+
+void DrawDabsPixel::toText(QByteArray &buffer) const
+{
+	text::appendNumber(buffer, contextId());
+	buffer += isSquare() ? " squarepixeldabs layer=" : " pixeldabs layer=";
+	text::appendIdString(buffer, m_layer);
+	buffer += " x=";
+	text::appendNumber(buffer, m_x);
+	buffer += " y=";
+	text::appendNumber(buffer, m_y);
+	buffer += " color=";
+	text::appendArgbString(buffer, m_color);
+	buffer += " mode=";
+	text::appendNumber(buffer, m_mode);
+	buffer += " {\n\t";
 
 	for(const PixelBrushDab &p : m_dabs) {
-		s += p.toString();
-		s += "\n\t";
+		p.toText(buffer);
+		buffer += "\n\t";
 	}
-	s += "}";
-	return s;
+	buffer += '}';
 }
 
-DrawDabsPixel *DrawDabsPixel::fromText(DabShape shape, uint8_t ctx, const Kwargs &kwargs, const QStringList &dabs)
+DrawDabsPixel *DrawDabsPixel::fromText(DabShape shape, uint8_t ctx, const Kwargs &kwargs, const PixelBrushDabVector &dabs)
 {
-	if(dabs.size() % 4 != 0)
+	if(dabs.size() > MAX_DABS)
 		return nullptr;
 
-	PixelBrushDabVector dabvector;
-	dabvector.reserve(dabs.size() / 4);
-	for(int i=0;i<dabs.size();i+=4) {
-		dabvector << PixelBrushDab {
-			int8_t(dabs.at(i+0).toInt()),
-			int8_t(dabs.at(i+1).toInt()),
-			uint8_t(dabs.at(i+2).toInt()),
-			uint8_t(dabs.at(i+3).toInt())
-		};
-	}
-
 	return new DrawDabsPixel(
 		shape,
 		ctx,
@@ -376,7 +476,7 @@ DrawDabsPixel *DrawDabsPixel::fromText(DabShape shape, uint8_t ctx, const Kwargs
 		kwargs.value("y").toInt(),
 		text::parseColor(kwargs["color"]),
 		kwargs.value("mode", "1").toInt(),
-		dabvector
+		dabs
 	);
 }
 
@@ -37,6 +37,7 @@ namespace protocol {
 		static const int MAX_XY_DELTA = INT8_MAX;
 		static const int LENGTH = 6;
 		QString toString() const;
+		void toText(QByteArray &buffer) const;
 
 		bool operator!=(const ClassicBrushDab &o) const {
 			return x != o.x || y != o.y || size != o.size || hardness != o.hardness || opacity != o.opacity;
@@ -52,6 +53,7 @@ namespace protocol {
 		static const int MAX_XY_DELTA = INT8_MAX;
 		static const int LENGTH = 4;
 		QString toString() const;
+		void toText(QByteArray &buffer) const;
 
 		bool operator!=(const PixelBrushDab &o) const {
 			return x != o.x || y != o.y || size != o.size || opacity != o.opacity;
@@ -130,9 +132,10 @@ public:
 	{
 		Q_ASSERT(dabs.size() <= MAX_DABS);
 	}
+	~DrawDabsClassic() override;
 
 	static DrawDabsClassic *deserialize(uint8_t ctx, const uchar *data, uint len);
-	static DrawDabsClassic *fromText(uint8_t ctx, const Kwargs &kwargs, const QStringList &dabs);
+	static DrawDabsClassic *fromText(uint8_t ctx, const Kwargs &kwargs, const ClassicBrushDabVector &dabs);
 
 	uint16_t layer() const override { return m_layer; }
 	int32_t originX() const { return m_x; } // Classic dab coordinates have subpixel precision.
@@ -148,6 +151,7 @@ public:
 	ClassicBrushDabVector &dabs() { return m_dabs; }
 
 	QString toString() const override;
+	void toText(QByteArray &buffer) const override;
 	QString messageName() const override { return QStringLiteral("classicdabs"); }
 
 	QPoint lastPoint() const override;
@@ -195,9 +199,10 @@ public:
 	{
 		Q_ASSERT(dabs.size() <= MAX_DABS);
 	}
+	~DrawDabsPixel() override;
 
 	static DrawDabsPixel *deserialize(DabShape shape, uint8_t ctx, const uchar *data, uint len);
-	static DrawDabsPixel *fromText(DabShape shape, uint8_t ctx, const Kwargs &kwargs, const QStringList &dabs);
+	static DrawDabsPixel *fromText(DabShape shape, uint8_t ctx, const Kwargs &kwargs, const PixelBrushDabVector &dabs);
 
 	uint16_t layer() const override { return m_layer; }
 	int32_t originX() const { return m_x; }
@@ -214,6 +219,7 @@ public:
 	PixelBrushDabVector &dabs() { return m_dabs; }
 
 	QString toString() const override;
+	void toText(QByteArray &buffer) const override;
 	QString messageName() const override { return isSquare() ? QStringLiteral("squarepixeldabs") : QStringLiteral("pixeldabs"); }
 
 	QPoint lastPoint() const override;
@@ -28,6 +28,107 @@
 
 namespace protocol {
 
+namespace {
+
+// Message objects up to this size are pooled. Allocations are rounded
+// up to the size class granularity so any block in a class fits any
+// object of that class.
+const size_t POOL_MAX_OBJECT = 256;
+const size_t POOL_GRANULARITY = 16;
+const int POOL_CLASSES = POOL_MAX_OBJECT / POOL_GRANULARITY;
+
+// Maximum number of free blocks kept per size class and thread
+const int POOL_MAX_FREE = 4096;
+
+bool poolingEnabled = true;
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+// Plain old data, so it remains usable while the thread is exiting
+struct MessagePool {
+	FreeBlock *free[POOL_CLASSES];
+	int freeCount[POOL_CLASSES];
+	bool closed;
+};
+
+thread_local MessagePool messagePool;
+
+// Returns the pooled blocks to the system allocator when the thread exits.
+// Messages freed after this point bypass the pool.
+struct MessagePoolCleanup {
+	~MessagePoolCleanup() {
+		messagePool.closed = true;
+		for(int i=0;i<POOL_CLASSES;++i) {
+			while(FreeBlock *block = messagePool.free[i]) {
+				messagePool.free[i] = block->next;
+				::operator delete(block);
+			}
+			messagePool.freeCount[i] = 0;
+		}
+	}
+};
+
+thread_local MessagePoolCleanup messagePoolCleanup;
+
+inline int poolClass(size_t size)
+{
+	return int((size - 1) / POOL_GRANULARITY);
+}
+
+}
+
+void *Message::operator new(size_t size)
+{
+	if(size > POOL_MAX_OBJECT)
+		return ::operator new(size);
+
+	const int cls = poolClass(size);
+	MessagePool &pool = messagePool;
+	FreeBlock *block = pool.free[cls];
+	if(block) {
+		pool.free[cls] = block->next;
+		--pool.freeCount[cls];
+		return block;
+	}
+
+	return ::operator new((cls + 1) * POOL_GRANULARITY);
+}
+
+void Message::operator delete(void *ptr, size_t size)
+{
+	if(!ptr)
+		return;
+
+	if(size <= POOL_MAX_OBJECT && poolingEnabled) {
+		const int cls = poolClass(size);
+		MessagePool &pool = messagePool;
+		if(!pool.closed && pool.freeCount[cls] < POOL_MAX_FREE) {
+			// Make sure the cleanup handler is registered for this thread
+			(void)&messagePoolCleanup;
+
+			FreeBlock *block = static_cast<FreeBlock*>(ptr);
+			block->next = pool.free[cls];
+			pool.free[cls] = block;
+			++pool.freeCount[cls];
+			return;
+		}
+	}
+
+	::operator delete(ptr);
+}
+
+void Message::setPoolingEnabled(bool enable)
+{
+	poolingEnabled = enable;
+}
+
+bool Message::isPoolingEnabled()
+{
+	return poolingEnabled;
+}
+
 int Message::sniffLength(const char *data)
 {
 	// extract payload length
@@ -104,6 +205,9 @@ NullableMessageRef Message::deserialize(const uchar *data, int buflen, bool deco
 	case MSG_INTERNAL:
 	   qWarning("Tried to deserialize MSG_INTERVAL");
 	   return NullableMessageRef();
+	case MSG_COMPRESSED:
+	   qWarning("Tried to deserialize MSG_COMPRESSED");
+	   return NullableMessageRef();
 
 	// Transparent meta messages
 	case MSG_USER_JOIN: msg = UserJoin::deserialize(ctx, data, len); break;
@@ -169,6 +273,11 @@ QString Message::toString() const
 	return str;
 }
 
+void Message::toText(QByteArray &buffer) const
+{
+	buffer += toString().toUtf8();
+}
+
 MessagePtr Message::asFiltered() const
 {
 	Q_ASSERT(type() != MSG_FILTERED); // no nested wrappings please
@@ -23,6 +23,7 @@
 #include <QMap>
 #include <QString>
 #include <QList>
+#include <QByteArray>
 
 namespace protocol {
 
@@ -34,6 +35,7 @@ enum MessageType {
 	MSG_COMMAND=0,
 	MSG_DISCONNECT,
 	MSG_PING,
+	MSG_COMPRESSED, // a deflated batch of messages (unwrapped by MessageQueue)
 
 	// Reserved ID for internal use (not serializable)
 	MSG_INTERNAL=31,
@@ -99,6 +101,7 @@ typedef QMapIterator<QString,QString> KwargsIterator;
 
 class MessagePtr;
 class NullableMessageRef;
+class MessageBuffer;
 
 class Message {
 	friend class MessagePtr;
@@ -109,7 +112,27 @@ public:
 
 	Message(MessageType type, uint8_t ctx): m_type(type), _undone(DONE), m_refcount(0), m_contextid(ctx) {}
 	virtual ~Message() {}
-	
+
+	/**
+	 * @brief Allocate a message object
+	 *
+	 * Small message objects are recycled through per-thread free lists
+	 * rather than going through the general purpose allocator each time.
+	 * Decoding a recording or a catch-up burst creates and destroys
+	 * millions of them.
+	 */
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr, size_t size);
+
+	/**
+	 * @brief Enable or disable recycling of message objects and dab vectors
+	 *
+	 * Pooling is enabled by default. This is meant for benchmarking the
+	 * effect of the pools.
+	 */
+	static void setPoolingEnabled(bool enable);
+	static bool isPoolingEnabled();
+
 	/**
 	 * @brief Get the type of this message.
 	 * @return message type
@@ -230,6 +253,38 @@ public:
 	 */
 	int serialize(char *data) const;
 
+	/**
+	 * @brief Get the serialized form of this message, if readily available
+	 *
+	 * Messages that keep their wire format around (i.e. opaque messages)
+	 * return it here, so the same bytes can be sent to any number of clients
+	 * without serializing the message again for each one.
+	 *
+	 * Note: the returned array may refer to the message's own storage,
+	 * so it is valid only as long as the message exists.
+	 *
+	 * @return serialized message or a null array if serialize() must be used
+	 */
+	virtual QByteArray wireBytes() const { return QByteArray(); }
+
+	/**
+	 * @brief Get the buffer this message shares with other messages, if any
+	 *
+	 * Messages received in shared receive buffer mode are views into the
+	 * receive buffer. The whole buffer stays in memory as long as any of
+	 * its messages exist.
+	 *
+	 * @return shared buffer or nullptr if the message has storage of its own
+	 */
+	virtual const MessageBuffer *sharedBuffer() const { return nullptr; }
+
+	/**
+	 * @brief Make a copy of this message that has storage of its own
+	 *
+	 * @return new message or nullptr if this message does not use a shared buffer
+	 */
+	virtual Message *unsharedCopy() const { return nullptr; }
+
 	/**
 	 * @brief get the length of the message from the given data
 	 *
@@ -269,6 +324,14 @@ public:
 	 */
 	virtual QString toString() const;
 
+	/**
+	 * @brief Append the textmode serialization of this message to a buffer
+	 *
+	 * The output is the UTF-8 encoded toString() result. Message types
+	 * that make up the bulk of a recording write it directly.
+	 */
+	virtual void toText(QByteArray &buffer) const;
+
 	//! Get the name of this message
 	virtual QString messageName() const = 0;
 
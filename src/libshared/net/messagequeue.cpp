@@ -19,11 +19,19 @@
 
 #include "messagequeue.h"
 #include "control.h"
+#include "meta2.h"
 
 #include <QTcpSocket>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QTimer>
+#include <QtEndian>
 #include <cstring>
+#include <utility>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #ifndef NDEBUG
 #include <QThread>
@@ -34,13 +42,41 @@ namespace protocol {
 // Reserve enough buffer space for one complete message
 static const int MAX_BUF_LEN = 1024*64 + protocol::Message::HEADER_LEN;
 
+// Size of the reception buffer. At least one complete message
+// must always fit after the unprocessed data.
+static const int RECV_BUF_LEN = MAX_BUF_LEN * 2;
+
+// Size of the shared reception buffers. These are bigger, since the
+// unused tail of a buffer is wasted while messages still refer to it.
+static const int SHARED_RECV_BUF_LEN = MAX_BUF_LEN * 8;
+
+// Messages with a shared wire format at least this big are written
+// directly from their own buffer instead of being copied to the upload buffer
+static const int DIRECT_WRITE_THRESHOLD = 1024*8;
+
+// Maximum uncompressed size of a compressed batch. This leaves enough
+// room for the worst case deflate overhead, so the compressed batch always
+// fits in a single message.
+static const int COMPRESS_BATCH_LEN = 60000;
+
+// Batches smaller than this are not worth compressing
+static const int COMPRESS_MIN_LEN = 128;
+
+// The server compresses the same messages separately for each client,
+// so use the fastest compression level.
+#ifdef HAVE_ZLIB
+static const int COMPRESSION_LEVEL = Z_BEST_SPEED;
+#endif
+
 MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 	: QObject(parent), m_socket(socket),
 	  m_pingTimer(nullptr),
 	  m_lastRecvTime(0),
 	  m_idleTimeout(0), m_pingSent(0), m_closeWhenReady(false),
 	  m_ignoreIncoming(false),
-	  m_decodeOpaque(false)
+	  m_decodeOpaque(false),
+	  m_batchWrites(true),
+	  m_sharedRecvBuffers(false)
 {
 	connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
@@ -49,12 +85,20 @@ MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 		connect(socket, SIGNAL(encrypted()), this, SLOT(sslEncrypted()));
 	}
 
-	m_recvbuffer = new char[MAX_BUF_LEN];
+	m_recvchunk = MessageBufferPtr(new MessageBuffer(RECV_BUF_LEN));
+	m_recvbuffer = reinterpret_cast<char*>(m_recvchunk->data());
 	m_sendbuffer = new char[MAX_BUF_LEN];
+	m_compressbuffer = new char[MAX_BUF_LEN];
+	m_inflatebytes = 0;
+	m_deflate = nullptr;
+	m_inflate = nullptr;
+	m_recvstart = 0;
 	m_recvbytes = 0;
 	m_sentbytes = 0;
 	m_sendbuflen = 0;
 
+	m_queueClock.start();
+
 	m_idleTimer = new QTimer(this);
 	connect(m_idleTimer, &QTimer::timeout, this, &MessageQueue::checkIdleTimeout);
 	m_idleTimer->setInterval(1000);
@@ -102,8 +146,50 @@ void MessageQueue::setPingInterval(int msecs)
 
 MessageQueue::~MessageQueue()
 {
-	delete [] m_recvbuffer;
+	setCompressOutgoing(false);
+#ifdef HAVE_ZLIB
+	if(m_inflate) {
+		inflateEnd(m_inflate);
+		delete m_inflate;
+	}
+#endif
 	delete [] m_sendbuffer;
+	delete [] m_compressbuffer;
+}
+
+bool MessageQueue::isCompressionSupported()
+{
+#ifdef HAVE_ZLIB
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool MessageQueue::setCompressOutgoing(bool compress)
+{
+#ifdef HAVE_ZLIB
+	if(compress && !m_deflate) {
+		// Raw deflate streams are used, so a new stream can be started
+		// at any time without the receiving end noticing.
+		m_deflate = new z_stream;
+		memset(m_deflate, 0, sizeof(z_stream));
+		if(deflateInit2(m_deflate, COMPRESSION_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			qWarning("Couldn't initialize deflate stream: %s", m_deflate->msg);
+			delete m_deflate;
+			m_deflate = nullptr;
+			return false;
+		}
+
+	} else if(!compress && m_deflate) {
+		deflateEnd(m_deflate);
+		delete m_deflate;
+		m_deflate = nullptr;
+	}
+	return true;
+#else
+	return !compress;
+#endif
 }
 
 bool MessageQueue::isPending() const
@@ -116,10 +202,120 @@ MessagePtr MessageQueue::getPending()
 	return m_inbox.dequeue();
 }
 
+MessageQueue::Lane MessageQueue::laneOf(const Message &msg)
+{
+	switch(msg.type()) {
+	case MSG_PING:
+		return ControlLane;
+	case MSG_CHAT:
+	case MSG_PRIVATE_CHAT:
+		return ChatLane;
+	case MSG_MOVEPOINTER:
+		return EphemeralLane;
+	default:
+		return DrawingLane;
+	}
+}
+
+void MessageQueue::enqueue(const MessagePtr &msg, bool live)
+{
+	Lane lane = laneOf(*msg);
+
+	if(msg->type() == MSG_LASERTRAIL) {
+		// The pointer moves between the start and the end of a laser trail
+		// are the trail's points, so they must be sent in order with it.
+		if(msg.cast<LaserTrail>().persistence() > 0)
+			m_laserTrails.insert(msg->contextId());
+		else
+			m_laserTrails.remove(msg->contextId());
+		++m_queuedLaserTrails[msg->contextId()];
+
+	} else if(lane == EphemeralLane && (m_laserTrails.contains(msg->contextId()) || m_queuedLaserTrails.contains(msg->contextId()))) {
+		// (A move can't overtake a queued trail end either, or it would become a trail point)
+		lane = DrawingLane;
+
+	} else if(!live && (lane == ChatLane || lane == EphemeralLane)) {
+		// Messages sent in a list (such as a history batch) are all delivered
+		// in order: the receiver counts them against the announced catch-up
+		// total, and the users they refer to may join in the same batch.
+		lane = DrawingLane;
+	}
+
+	if(lane == EphemeralLane) {
+		// Latest value wins: replace the stale message if one is still queued.
+		// There is at most one message per user in this lane,
+		// so a linear search is fine.
+		QQueue<QueuedMessage> &q = m_outbox[EphemeralLane];
+		for(int i=0;i<q.size();++i) {
+			const MessagePtr &old = q.at(i).msg;
+			if(old->contextId() == msg->contextId()) {
+				m_queueStats.queuedBytes += msg->length() - old->length();
+				++m_queueStats.droppedMessages;
+				q[i] = QueuedMessage { msg, m_queueClock.elapsed() };
+				return;
+			}
+		}
+	}
+
+	m_outbox[lane].enqueue(QueuedMessage { msg, m_queueClock.elapsed() });
+	addQueued(msg->length());
+}
+
+void MessageQueue::addQueued(int bytes)
+{
+	m_queueStats.queuedBytes += bytes;
+	++m_queueStats.queuedMessages;
+	m_queueStats.maxQueuedBytes = qMax(m_queueStats.maxQueuedBytes, m_queueStats.queuedBytes);
+	m_queueStats.maxQueuedMessages = qMax(m_queueStats.maxQueuedMessages, m_queueStats.queuedMessages);
+}
+
+MessagePtr MessageQueue::takeQueued(QQueue<QueuedMessage> &lane)
+{
+	const QueuedMessage queued = lane.dequeue();
+	const qint64 queueTime = m_queueClock.elapsed() - queued.queuedAt;
+
+	if(queued.msg->type() == MSG_LASERTRAIL) {
+		auto count = m_queuedLaserTrails.find(queued.msg->contextId());
+		if(count != m_queuedLaserTrails.end() && --count.value() == 0)
+			m_queuedLaserTrails.erase(count);
+	}
+
+	m_queueStats.queuedBytes -= queued.msg->length();
+	--m_queueStats.queuedMessages;
+	++m_queueStats.sentMessages;
+	m_queueStats.totalQueueTime += queueTime;
+	m_queueStats.maxQueueTime = qMax(m_queueStats.maxQueueTime, queueTime);
+
+	return queued.msg;
+}
+
+void MessageQueue::clearQueue()
+{
+	for(QQueue<QueuedMessage> &lane : m_outbox)
+		lane.clear();
+	m_queuedLaserTrails.clear();
+	m_queueStats.queuedBytes = 0;
+	m_queueStats.queuedMessages = 0;
+}
+
+bool MessageQueue::hasOutgoing() const
+{
+	return m_queueStats.queuedMessages > 0;
+}
+
+QQueue<MessageQueue::QueuedMessage> *MessageQueue::nextOutgoingLane()
+{
+	for(QQueue<QueuedMessage> &lane : m_outbox) {
+		if(!lane.isEmpty())
+			return &lane;
+	}
+	return nullptr;
+}
+
 void MessageQueue::send(const MessagePtr &message)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.enqueue(message);
+		enqueue(message, true);
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -128,7 +324,8 @@ void MessageQueue::send(const MessagePtr &message)
 void MessageQueue::send(const MessageList &messages)
 {
 	if(!m_closeWhenReady) {
-		m_outbox << messages;
+		for(const MessagePtr &msg : messages)
+			enqueue(msg, false);
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -137,7 +334,8 @@ void MessageQueue::send(const MessageList &messages)
 void MessageQueue::sendNow(MessagePtr msg)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.prepend(msg);
+		m_outbox[ControlLane].prepend(QueuedMessage { msg, m_queueClock.elapsed() });
+		addQueued(msg->length());
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -147,6 +345,7 @@ void MessageQueue::sendDisconnect(int reason, const QString &message)
 {
 	send(MessagePtr(new protocol::Disconnect(0, protocol::Disconnect::Reason(reason), message)));
 	m_ignoreIncoming = true;
+	m_recvstart = 0;
 	m_recvbytes = 0;
 }
 
@@ -164,10 +363,7 @@ void MessageQueue::sendPing()
 
 int MessageQueue::uploadQueueBytes() const
 {
-	int total = m_socket->bytesToWrite() + m_sendbuflen - m_sentbytes;
-	for(const MessagePtr msg : m_outbox)
-		total += msg->length();
-	return total;
+	return m_socket->bytesToWrite() + m_sendbuflen - m_sentbytes + m_queueStats.queuedBytes;
 }
 
 bool MessageQueue::isUploading() const
@@ -180,12 +376,160 @@ qint64 MessageQueue::idleTime() const
 	return QDateTime::currentMSecsSinceEpoch() - m_lastRecvTime;
 }
 
+void MessageQueue::setSharedReceiveBuffers(bool shared)
+{
+	Q_ASSERT(m_recvbytes == 0);
+	m_sharedRecvBuffers = shared;
+	m_recvchunk = MessageBufferPtr(new MessageBuffer(shared ? SHARED_RECV_BUF_LEN : RECV_BUF_LEN));
+	m_recvbuffer = reinterpret_cast<char*>(m_recvchunk->data());
+	m_recvstart = 0;
+	m_recvbytes = 0;
+}
+
+void MessageQueue::reserveReceiveSpace()
+{
+	// Make sure there is room for at least one complete message
+	// after the unprocessed data.
+	if(m_recvchunk->size() - m_recvbytes >= MAX_BUF_LEN)
+		return;
+
+	const int pending = m_recvbytes - m_recvstart;
+
+	if(m_recvchunk->ref.load() == 1) {
+		// Nobody else is using the buffer: compact it
+		memmove(m_recvbuffer, m_recvbuffer+m_recvstart, pending);
+
+	} else {
+		// Received messages still refer to this buffer: start a new one
+		MessageBufferPtr chunk { new MessageBuffer(m_recvchunk->size()) };
+		memcpy(chunk->data(), m_recvbuffer+m_recvstart, pending);
+		m_recvchunk = chunk;
+		m_recvbuffer = reinterpret_cast<char*>(m_recvchunk->data());
+	}
+
+	m_recvstart = 0;
+	m_recvbytes = pending;
+}
+
+bool MessageQueue::receiveMessage(const MessageBufferPtr &chunk, int offset, int len)
+{
+	const uchar *msgbuf = chunk->data() + offset;
+	NullableMessageRef msg;
+	if(m_sharedRecvBuffers && !m_decodeOpaque && msgbuf[2] >= 64)
+		msg = NullableMessageRef(new OpaqueMessage(chunk, offset));
+	else
+		msg = Message::deserialize(msgbuf, len, m_decodeOpaque);
+
+	if(msg.isNull()) {
+		emit badData(len, msgbuf[2], msgbuf[3]);
+		return false;
+	}
+
+	if(msg->type() == MSG_PING) {
+		// Special handling for Ping messages
+		bool isPong = msg.cast<Ping>().isPong();
+
+		if(isPong) {
+			if(m_pingSent==0) {
+				qWarning("Received Pong, but no Ping was sent!");
+
+			} else {
+				qint64 roundtrip = QDateTime::currentMSecsSinceEpoch() - m_pingSent;
+				m_pingSent = 0;
+				emit pingPong(roundtrip);
+			}
+		} else {
+			sendNow(MessagePtr(new Ping(0, true)));
+		}
+		return false;
+	}
+
+	m_inbox.enqueue(MessagePtr::fromNullable(msg));
+	return true;
+}
+
+bool MessageQueue::receiveCompressed(const uchar *data, int len)
+{
+#ifdef HAVE_ZLIB
+	if(!m_inflate) {
+		m_inflate = new z_stream;
+		memset(m_inflate, 0, sizeof(z_stream));
+		if(inflateInit2(m_inflate, -15) != Z_OK) {
+			qWarning("Couldn't initialize inflate stream: %s", m_inflate->msg);
+			delete m_inflate;
+			m_inflate = nullptr;
+			emit badData(len + Message::HEADER_LEN, MSG_COMPRESSED, 0);
+			return false;
+		}
+	}
+
+	// Make sure a whole batch fits in the decompression buffer. Like the
+	// reception buffer, this may be shared with the received messages.
+	if(!m_inflatechunk || m_inflatechunk->size() - m_inflatebytes < MAX_BUF_LEN) {
+		if(!m_inflatechunk || m_inflatechunk->ref.load() != 1)
+			m_inflatechunk = MessageBufferPtr(new MessageBuffer(m_sharedRecvBuffers ? SHARED_RECV_BUF_LEN : MAX_BUF_LEN));
+		m_inflatebytes = 0;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	const int start = m_inflatebytes;
+	m_inflate->next_in = const_cast<uchar*>(data);
+	m_inflate->avail_in = len;
+	m_inflate->next_out = m_inflatechunk->data() + start;
+	m_inflate->avail_out = MAX_BUF_LEN;
+
+	const int ret = inflate(m_inflate, Z_SYNC_FLUSH);
+	if(ret != Z_OK || m_inflate->avail_in > 0 || m_inflate->avail_out == 0) {
+		qWarning("Couldn't decompress received batch: %s", m_inflate->msg ? m_inflate->msg : "output too long");
+		emit badData(len + Message::HEADER_LEN, MSG_COMPRESSED, 0);
+		return false;
+	}
+
+	const int end = start + MAX_BUF_LEN - m_inflate->avail_out;
+	m_inflatebytes = end;
+
+	m_inflateStats.compressedBytes += len + Message::HEADER_LEN;
+	m_inflateStats.rawBytes += end - start;
+	m_inflateStats.nsecs += timer.nsecsElapsed();
+
+	// The sender only compresses complete messages
+	bool gotmessage = false;
+	const uchar *buf = m_inflatechunk->data();
+	int offset = start;
+	while(!m_ignoreIncoming && offset < end) {
+		int msglen;
+		if(end - offset < Message::HEADER_LEN || end - offset < (msglen=Message::sniffLength(reinterpret_cast<const char*>(buf+offset)))) {
+			qWarning("Compressed batch ends in a partial message");
+			emit badData(len + Message::HEADER_LEN, MSG_COMPRESSED, 0);
+			break;
+		}
+
+		if(receiveMessage(m_inflatechunk, offset, msglen))
+			gotmessage = true;
+
+		offset += msglen;
+	}
+
+	if(m_inflatechunk->ref.load() == 1)
+		m_inflatebytes = 0;
+
+	return gotmessage;
+#else
+	qWarning("Received a compressed message, but compression is not supported!");
+	emit badData(len + Message::HEADER_LEN, MSG_COMPRESSED, 0);
+	return false;
+#endif
+}
+
 void MessageQueue::readData() {
 	bool gotmessage = false;
 	int read, totalread=0;
 	do {
 		// Read as much as fits in to the deserialization buffer
-		read = m_socket->read(m_recvbuffer+m_recvbytes, MAX_BUF_LEN-m_recvbytes);
+		reserveReceiveSpace();
+		read = m_socket->read(m_recvbuffer+m_recvbytes, m_recvchunk->size()-m_recvbytes);
 		if(read<0) {
 			emit socketError(m_socket->errorString());
 			return;
@@ -202,43 +546,33 @@ void MessageQueue::readData() {
 
 		m_recvbytes += read;
 
-		// Extract all complete messages
+		// Extract all complete messages. The messages are parsed in place
+		// and the leftover partial message is moved to the start of the
+		// buffer only when the buffer runs out of space.
 		int len;
-		while(m_recvbytes >= Message::HEADER_LEN && m_recvbytes >= (len=Message::sniffLength(m_recvbuffer))) {
+		while(!m_ignoreIncoming && m_recvbytes-m_recvstart >= Message::HEADER_LEN && m_recvbytes-m_recvstart >= (len=Message::sniffLength(m_recvbuffer+m_recvstart))) {
 			// Whole message received!
-			NullableMessageRef msg = Message::deserialize((const uchar*)m_recvbuffer, m_recvbytes, m_decodeOpaque);
-			if(msg.isNull()) {
-				emit badData(len, (unsigned char)m_recvbuffer[2], (unsigned char)m_recvbuffer[3]);
-
-			} else {
-				 if(msg->type() == MSG_PING) {
-					// Special handling for Ping messages
-					bool isPong = msg.cast<Ping>().isPong();
-
-					if(isPong) {
-						if(m_pingSent==0) {
-							qWarning("Received Pong, but no Ping was sent!");
-
-						} else {
-							qint64 roundtrip = QDateTime::currentMSecsSinceEpoch() - m_pingSent;
-							m_pingSent = 0;
-							emit pingPong(roundtrip);
-						}
-					} else {
-						sendNow(MessagePtr(new Ping(0, true)));
-					}
-
-				} else {
-					m_inbox.enqueue(MessagePtr::fromNullable(msg));
+			const uchar *msgbuf = reinterpret_cast<const uchar*>(m_recvbuffer + m_recvstart);
+			if(msgbuf[2] == MSG_COMPRESSED) {
+				if(receiveCompressed(msgbuf + Message::HEADER_LEN, len - Message::HEADER_LEN))
 					gotmessage = true;
-				}
-			}
 
-			if(len < m_recvbytes) {
-				// Buffer contains more than one message
-				memmove(m_recvbuffer, m_recvbuffer+len, m_recvbytes-len);
+			} else if(receiveMessage(m_recvchunk, m_recvstart, len)) {
+				gotmessage = true;
 			}
-			m_recvbytes -= len;
+
+			m_recvstart += len;
+		}
+
+		if(m_ignoreIncoming) {
+			// A bad message handler may have started closing the connection
+			m_recvstart = 0;
+			m_recvbytes = 0;
+
+		} else if(m_recvstart == m_recvbytes && m_recvchunk->ref.load() == 1) {
+			// Everything processed and no messages refer to the buffer
+			m_recvstart = 0;
+			m_recvbytes = 0;
 		}
 
 		// All messages extracted from buffer (if there were any):
@@ -261,33 +595,125 @@ void MessageQueue::dataWritten(qint64 bytes)
 
 	// Write more once the buffer is empty
 	if(m_socket->bytesToWrite()==0) {
-		if(m_sendbuflen==0 && m_outbox.isEmpty())
+		if(m_sendbuflen==0 && !hasOutgoing())
 			emit allSent();
 		else
 			writeData();
 	}
 }
 
+void MessageQueue::fillSendBuffer()
+{
+	Q_ASSERT(m_sendbuflen == 0);
+	Q_ASSERT(m_sentbytes == 0);
+
+	// Compressed batches must be a bit smaller to leave room for the overhead
+	const int batchLimit = m_deflate ? COMPRESS_BATCH_LEN : MAX_BUF_LEN;
+	bool compress = m_deflate != nullptr;
+
+	// Coalesce as many queued messages as fit into the upload buffer,
+	// so they can be written to the socket in one go.
+	QQueue<QueuedMessage> *lane;
+	while((lane = nextOutgoingLane())) {
+		const MessagePtr msg = lane->head().msg;
+		const int len = msg->length();
+		Q_ASSERT(len <= MAX_BUF_LEN);
+
+		if(m_sendbuflen + len > batchLimit) {
+			if(m_sendbuflen > 0)
+				break;
+
+			// A message too big to be compressed is sent on its own
+			compress = false;
+		}
+
+		// Use the message's existing wire format if available,
+		// so broadcast messages aren't serialized for each client separately.
+		const QByteArray wire = msg->wireBytes();
+		if(!wire.isNull() && len >= DIRECT_WRITE_THRESHOLD && !compress) {
+			// Big messages are written straight from the shared buffer
+			if(m_sendbuflen > 0)
+				break;
+			m_sendmsg = msg;
+			m_sendbytes = wire;
+			m_sendbuflen = len;
+
+		} else if(!wire.isNull()) {
+			memcpy(m_sendbuffer + m_sendbuflen, wire.constData(), len);
+			m_sendbuflen += len;
+
+		} else {
+			m_sendbuflen += msg->serialize(m_sendbuffer + m_sendbuflen);
+		}
+
+		takeQueued(*lane);
+
+		if(msg->type() == protocol::MSG_DISCONNECT) {
+			// Automatically disconnect after Disconnect notification is sent
+			m_closeWhenReady = true;
+			clearQueue();
+			break;
+		}
+
+		if(!m_batchWrites || !m_sendbytes.isNull())
+			break;
+	}
+
+	Q_ASSERT(m_sendbuflen>0);
+
+	if(compress && m_sendbuflen >= COMPRESS_MIN_LEN)
+		compressSendBuffer();
+}
+
+void MessageQueue::compressSendBuffer()
+{
+#ifdef HAVE_ZLIB
+	Q_ASSERT(m_deflate);
+	Q_ASSERT(m_sendbytes.isNull());
+
+	QElapsedTimer timer;
+	timer.start();
+
+	uchar *out = reinterpret_cast<uchar*>(m_compressbuffer);
+	m_deflate->next_in = reinterpret_cast<uchar*>(m_sendbuffer);
+	m_deflate->avail_in = m_sendbuflen;
+	m_deflate->next_out = out + Message::HEADER_LEN;
+	m_deflate->avail_out = 0xffff;
+
+	// The sync flush makes sure the receiver can decompress
+	// the whole batch without waiting for the next one.
+	const int ret = deflate(m_deflate, Z_SYNC_FLUSH);
+	if(ret != Z_OK || m_deflate->avail_in > 0 || m_deflate->avail_out == 0) {
+		// Shouldn't happen, since the batch size is limited. Nothing has
+		// been sent yet, so we can just send this batch uncompressed.
+		qWarning("Couldn't compress message batch: %s. Disabling compression.", m_deflate->msg ? m_deflate->msg : "output too long");
+		setCompressOutgoing(false);
+		return;
+	}
+
+	const int compressedLen = 0xffff - m_deflate->avail_out;
+	qToBigEndian(quint16(compressedLen), out);
+	out[2] = MSG_COMPRESSED;
+	out[3] = 0;
+
+	m_deflateStats.rawBytes += m_sendbuflen;
+	m_deflateStats.compressedBytes += compressedLen + Message::HEADER_LEN;
+	m_deflateStats.nsecs += timer.nsecsElapsed();
+
+	std::swap(m_sendbuffer, m_compressbuffer);
+	m_sendbuflen = compressedLen + Message::HEADER_LEN;
+#endif
+}
+
 void MessageQueue::writeData() {
 	int sentBatch = 0;
 	bool sendMore = true;
 
 	while(sendMore && sentBatch < 1024*64) {
 		sendMore = false;
-		if(m_sendbuflen==0 && !m_outbox.isEmpty()) {
+		if(m_sendbuflen==0 && hasOutgoing()) {
 			// Upload buffer is empty, but there are messages in the outbox
-			Q_ASSERT(m_sentbytes == 0);
-
-			MessagePtr msg = m_outbox.dequeue();
-			m_sendbuflen = msg->serialize(m_sendbuffer);
-			Q_ASSERT(m_sendbuflen>0);
-			Q_ASSERT(m_sendbuflen <= MAX_BUF_LEN);
-
-			if(msg->type() == protocol::MSG_DISCONNECT) {
-				// Automatically disconnect after Disconnect notification is sent
-				m_closeWhenReady = true;
-				m_outbox.clear();
-			}
+			fillSendBuffer();
 		}
 
 		if(m_sentbytes < m_sendbuflen) {
@@ -298,7 +724,8 @@ void MessageQueue::writeData() {
 			}
 #endif
 
-			const int sent = m_socket->write(m_sendbuffer+m_sentbytes, m_sendbuflen-m_sentbytes);
+			const char *sendbuffer = m_sendbytes.isNull() ? m_sendbuffer : m_sendbytes.constData();
+			const int sent = m_socket->write(sendbuffer+m_sentbytes, m_sendbuflen-m_sentbytes);
 			if(sent<0) {
 				// Error
 				emit socketError(m_socket->errorString());
@@ -309,9 +736,11 @@ void MessageQueue::writeData() {
 
 			Q_ASSERT(m_sentbytes <= m_sendbuflen);
 			if(m_sentbytes >= m_sendbuflen) {
-				// Complete message sent
+				// Complete message (or batch of messages) sent
 				m_sendbuflen=0;
 				m_sentbytes=0;
+				m_sendbytes = QByteArray();
+				m_sendmsg = NullableMessageRef();
 				if(m_closeWhenReady) {
 					m_socket->disconnectFromHost();
 
@@ -21,21 +21,77 @@
 #define DP_NET_MSGQUEUE_H
 
 #include "message.h"
+#include "opaque.h"
 
 #include <QQueue>
+#include <QSet>
+#include <QHash>
 #include <QObject>
+#include <QElapsedTimer>
 
 class QTcpSocket;
 class QTimer;
+struct z_stream_s;
 
 namespace protocol {
 
+/**
+ * @brief Message stream compression statistics
+ */
+struct CompressionStats {
+	qint64 rawBytes = 0;        // uncompressed size of the messages
+	qint64 compressedBytes = 0; // size of the MSG_COMPRESSED messages
+	qint64 nsecs = 0;           // time spent (de)compressing
+
+	CompressionStats &operator+=(const CompressionStats &s)
+	{
+		rawBytes += s.rawBytes;
+		compressedBytes += s.compressedBytes;
+		nsecs += s.nsecs;
+		return *this;
+	}
+};
+
+/**
+ * @brief Upload queue statistics
+ *
+ * The queue here means the messages waiting to be written to the socket.
+ */
+struct QueueStats {
+	int queuedBytes = 0;          // bytes currently in the queue
+	int queuedMessages = 0;       // messages currently in the queue
+	int maxQueuedBytes = 0;       // high-water mark of queuedBytes
+	int maxQueuedMessages = 0;    // high-water mark of queuedMessages
+	qint64 sentMessages = 0;      // messages taken from the queue for sending
+	qint64 droppedMessages = 0;   // stale ephemeral messages replaced by newer ones
+	qint64 totalQueueTime = 0;    // total time sent messages spent in the queue (ms)
+	qint64 maxQueueTime = 0;      // longest time a message spent in the queue (ms)
+};
+
 /**
  * A wrapper for an IO device for sending and receiving messages.
+ *
+ * Outgoing messages are sorted into priority lanes, so interactive messages
+ * don't have to wait behind a long backlog of drawing commands.
+ * Only messages whose relative order doesn't matter get a lane of their own.
+ * Commands and everything else that must stay in order with the session
+ * history use the drawing lane.
  */
 class MessageQueue : public QObject {
 Q_OBJECT
 public:
+	//! Outgoing message lanes, in priority order
+	enum Lane {
+		ControlLane,   // ping messages
+		ChatLane,      // chat messages sent one at a time
+		EphemeralLane, // pointer moves outside laser trails (only the latest is sent)
+		DrawingLane,   // everything else, in order
+		LANE_COUNT
+	};
+
+	//! Get the lane the given message is sent in
+	static Lane laneOf(const Message &msg);
+
 	/**
 	 * @brief Create a message queue that wraps a TCP socket.
 	 *
@@ -53,6 +109,20 @@ public:
 	 */
 	void setDecodeOpaque(bool d) { m_decodeOpaque = d; }
 
+	/**
+	 * @brief Make received opaque messages views into shared receive buffers?
+	 *
+	 * In this mode, the received opaque messages are not copied out of the
+	 * receive buffer. Instead, the buffer is shared by the messages and
+	 * a new one is allocated when it fills up. The buffer is freed when the
+	 * last message referencing it is deleted.
+	 *
+	 * This is meant for the server, which merely stores and forwards the
+	 * opaque messages. It has no effect when opaque messages are decoded.
+	 * This should be set before any data has been received.
+	 */
+	void setSharedReceiveBuffers(bool shared);
+
 	/**
 	 * @brief Check if there are new messages available
 	 * @return true if getPending will return a message
@@ -67,6 +137,15 @@ public:
 
 	/**
 	 * Enqueue a message for sending.
+	 *
+	 * If a pointer move from the same user is still waiting in the
+	 * ephemeral lane, it is replaced by the new one.
+	 *
+	 * Messages sent in a list (such as a history batch) are never dropped
+	 * or reordered: chat and pointer moves stay in order with the rest of
+	 * the list. Receivers count catch-up messages against the total
+	 * announced by the server, and the users the messages refer to may
+	 * join in the same batch.
 	 */
 	void send(const MessagePtr &message);
 	void send(const MessageList &messages);
@@ -85,10 +164,17 @@ public:
 
 	/**
 	 * @brief Get the number of bytes in the upload queue
-	 * @return
+	 *
+	 * This includes the data in the upload buffer and the socket's own
+	 * buffer. This is cheap to call.
 	 */
 	int uploadQueueBytes() const;
 
+	/**
+	 * @brief Get upload queue statistics
+	 */
+	const QueueStats &queueStats() const { return m_queueStats; }
+
 	/**
 	 * @brief Is there still data in the upload buffer?
 	 */
@@ -121,6 +207,46 @@ public:
 	 */
 	void setPingInterval(int msecs);
 
+	/**
+	 * @brief Coalesce queued messages into larger socket writes?
+	 *
+	 * When enabled (the default,) as many queued messages as fit in the
+	 * upload buffer are written with a single socket write. Disabling this
+	 * writes each message separately, which is only useful for benchmarking.
+	 */
+	void setBatchWrites(bool batch) { m_batchWrites = batch; }
+
+	/**
+	 * @brief Is stream compression available in this build?
+	 */
+	static bool isCompressionSupported();
+
+	/**
+	 * @brief Compress outgoing messages?
+	 *
+	 * When enabled, each batch of queued messages is deflated and sent
+	 * wrapped in a single MSG_COMPRESSED message. The same deflate stream
+	 * is used for the whole connection, so repetitive content compresses
+	 * well even when the batches are small. Each batch ends in a sync flush,
+	 * so the remote end can decode everything as soon as it has arrived.
+	 * When the connection is busy, batches grow bigger and the flushes become
+	 * less frequent.
+	 *
+	 * The remote end must be known to support compressed messages. Incoming
+	 * compressed messages are always accepted.
+	 *
+	 * @return false if compression is not supported
+	 */
+	bool setCompressOutgoing(bool compress);
+
+	bool isCompressingOutgoing() const { return m_deflate != nullptr; }
+
+	//! Get statistics on outgoing compressed messages
+	const CompressionStats &sentCompressionStats() const { return m_deflateStats; }
+
+	//! Get statistics on incoming compressed messages
+	const CompressionStats &receivedCompressionStats() const { return m_inflateStats; }
+
 #ifndef NDEBUG
 	void setRandomLag(uint lag) { m_randomlag = lag; }
 #endif
@@ -182,19 +308,52 @@ private slots:
 
 private:
 	void sendNow(MessagePtr msg);
+	struct QueuedMessage {
+		MessagePtr msg;
+		qint64 queuedAt; // m_queueClock timestamp
+	};
+
+	void enqueue(const MessagePtr &msg, bool live);
+	void addQueued(int bytes);
+	MessagePtr takeQueued(QQueue<QueuedMessage> &lane);
+	void clearQueue();
+	bool hasOutgoing() const;
+	QQueue<QueuedMessage> *nextOutgoingLane();
 
 	void writeData();
+	void fillSendBuffer();
+	void reserveReceiveSpace();
+	bool receiveMessage(const MessageBufferPtr &chunk, int offset, int len);
+	bool receiveCompressed(const uchar *data, int len);
+	void compressSendBuffer();
 
 	QTcpSocket *m_socket;
 
-	char *m_recvbuffer; // raw message reception buffer
+	MessageBufferPtr m_recvchunk; // raw message reception buffer (possibly shared with received messages)
+	char *m_recvbuffer; // m_recvchunk's data
 	char *m_sendbuffer; // raw message upload buffer
-	int m_recvbytes;    // number of bytes in reception buffer
+	char *m_compressbuffer; // compressed batch is written here and then swapped with m_sendbuffer
+	NullableMessageRef m_sendmsg; // the message whose wire bytes are being uploaded
+	QByteArray m_sendbytes; // shared serialized message being uploaded (used instead of m_sendbuffer if set)
+	int m_recvstart;    // start of the unprocessed data in the reception buffer
+	int m_recvbytes;    // end of the data in reception buffer
 	int m_sentbytes;    // number of bytes in upload buffer already sent
 	int m_sendbuflen;   // length of the data in the upload buffer
 
+	MessageBufferPtr m_inflatechunk; // decompressed messages (possibly shared with received messages)
+	int m_inflatebytes; // end of the data in the decompression buffer
+
+	z_stream_s *m_deflate; // outgoing compression stream (null if not compressing)
+	z_stream_s *m_inflate; // incoming decompression stream (created on first use)
+	CompressionStats m_deflateStats;
+	CompressionStats m_inflateStats;
+
 	QQueue<MessagePtr> m_inbox;  // pending messages
-	QQueue<MessagePtr> m_outbox; // messages to be sent
+	QQueue<QueuedMessage> m_outbox[LANE_COUNT]; // messages to be sent
+	QSet<int> m_laserTrails; // users whose laser trail is on (as of the last queued message)
+	QHash<int, int> m_queuedLaserTrails; // number of laser trail messages in the drawing lane per user
+	QueueStats m_queueStats;
+	QElapsedTimer m_queueClock;
 
 	QTimer *m_idleTimer;
 	QTimer *m_pingTimer;
@@ -206,6 +365,8 @@ private:
 	bool m_ignoreIncoming;
 
 	bool m_decodeOpaque;
+	bool m_batchWrites;
+	bool m_sharedRecvBuffers;
 
 #ifndef NDEBUG
 	uint m_randomlag;
@@ -27,25 +27,37 @@
 #include "undo.h"
 #include "recording.h"
 
+#include <QtEndian>
 #include <cstring>
 
 namespace protocol {
 
 OpaqueMessage::OpaqueMessage(MessageType type, uint8_t ctx, const uchar *payload, int payloadLen)
-	: Message(type, ctx), m_length(payloadLen)
+	: Message(type, ctx), m_buffer(new MessageBuffer(HEADER_LEN + payloadLen)), m_length(payloadLen)
 {
 	Q_ASSERT(type >= 64);
-	if(payloadLen>0) {
-		m_payload = new uchar[payloadLen];
-		memcpy(m_payload, payload, payloadLen);
-	} else {
-		m_payload = nullptr;
-	}
+	Q_ASSERT(payloadLen <= 0xffff);
+
+	m_wire = m_buffer->data();
+	qToBigEndian(quint16(payloadLen), m_wire);
+	m_wire[2] = type;
+	m_wire[3] = ctx;
+	if(payloadLen>0)
+		memcpy(m_wire + HEADER_LEN, payload, payloadLen);
+}
+
+OpaqueMessage::OpaqueMessage(const MessageBufferPtr &buffer, int offset)
+	: Message(MessageType(buffer->data()[offset+2]), buffer->data()[offset+3]),
+	  m_buffer(buffer),
+	  m_wire(buffer->data() + offset),
+	  m_length(qFromBigEndian<quint16>(buffer->data() + offset))
+{
+	Q_ASSERT(type() >= 64);
+	Q_ASSERT(offset + HEADER_LEN + m_length <= buffer->size());
 }
 
 OpaqueMessage::~OpaqueMessage()
 {
-	delete []m_payload;
 }
 
 NullableMessageRef OpaqueMessage::decode(MessageType type, uint8_t ctx, const uchar *data, uint len)
@@ -96,7 +108,31 @@ NullableMessageRef OpaqueMessage::decode(MessageType type, uint8_t ctx, const uc
 
 NullableMessageRef OpaqueMessage::decode() const
 {
-	return decode(type(), contextId(), m_payload, m_length);
+	return decode(type(), contextId(), payload(), payloadLength());
+}
+
+QByteArray OpaqueMessage::wireBytes() const
+{
+	// The server rewrites the context IDs of messages it receives.
+	// (This part of the buffer belongs to this message only.)
+	m_wire[3] = contextId();
+
+	return QByteArray::fromRawData(reinterpret_cast<const char*>(m_wire), HEADER_LEN + m_length);
+}
+
+const MessageBuffer *OpaqueMessage::sharedBuffer() const
+{
+	// A buffer of the message's own is exactly the size of the message
+	if(m_buffer->size() == HEADER_LEN + m_length)
+		return nullptr;
+	return m_buffer.constData();
+}
+
+Message *OpaqueMessage::unsharedCopy() const
+{
+	if(!sharedBuffer())
+		return nullptr;
+	return new OpaqueMessage(type(), contextId(), payload(), m_length);
 }
 
 int OpaqueMessage::payloadLength() const
@@ -106,17 +142,17 @@ int OpaqueMessage::payloadLength() const
 
 int OpaqueMessage::serializePayload(uchar *data) const
 {
-	memcpy(data, m_payload, m_length);
+	memcpy(data, payload(), m_length);
 	return m_length;
 }
 
 bool OpaqueMessage::payloadEquals(const Message &m) const
 {
 	const OpaqueMessage &om = static_cast<const OpaqueMessage&>(m);
-	if(m_length != om.m_length)
+	if(payloadLength() != om.payloadLength())
 		return false;
 
-	return memcmp(m_payload, om.m_payload, m_length) == 0;
+	return memcmp(payload(), om.payload(), payloadLength()) == 0;
 }
 
 }
@@ -22,20 +22,63 @@
 #include "message.h"
 
 #include <QByteArray>
+#include <QSharedData>
+#include <QExplicitlySharedDataPointer>
 
 namespace protocol {
 
+/**
+ * @brief A reference counted block of serialized messages
+ *
+ * Opaque messages can be views into a shared buffer (such as a chunk of
+ * received data) rather than having their own copies. The buffer is freed
+ * when the last message referencing it is deleted.
+ */
+class MessageBuffer : public QSharedData
+{
+public:
+	explicit MessageBuffer(int size) : m_data(new uchar[size]), m_size(size) { }
+	~MessageBuffer() { delete [] m_data; }
+	MessageBuffer(const MessageBuffer&) = delete;
+	MessageBuffer &operator=(const MessageBuffer&) = delete;
+
+	uchar *data() const { return m_data; }
+	int size() const { return m_size; }
+
+private:
+	uchar *m_data;
+	int m_size;
+};
+
+typedef QExplicitlySharedDataPointer<MessageBuffer> MessageBufferPtr;
+
 /**
  * @brief An opaque message
  *
  * This is treated as opaque binary data by the server. The client needs to be able
  * to decode these, though.
  *
+ * The message is stored in its serialized form, which is shared
+ * by all the connections the message is sent to. The serialized
+ * message can be either in a buffer of its own, or in a buffer shared
+ * with other messages.
  */
 class OpaqueMessage : public Message
 {
 public:
 	OpaqueMessage(MessageType type, uint8_t ctx, const uchar *payload, int payloadLen);
+
+	/**
+	 * @brief Construct a message that is a view into a shared buffer
+	 *
+	 * The buffer must contain a complete serialized message at the given offset.
+	 * That part of the buffer must not be used for anything else while the
+	 * message exists.
+	 *
+	 * @param buffer the shared buffer
+	 * @param offset offset of the message header
+	 */
+	OpaqueMessage(const MessageBufferPtr &buffer, int offset);
 	~OpaqueMessage();
 	OpaqueMessage(const OpaqueMessage &m) = delete;
 	OpaqueMessage &operator=(const OpaqueMessage &m) = delete;
@@ -50,6 +93,10 @@ public:
 
 	QString messageName() const override { return QStringLiteral("_opaque"); }
 
+	QByteArray wireBytes() const override;
+	const MessageBuffer *sharedBuffer() const override;
+	Message *unsharedCopy() const override;
+
 protected:
 	int payloadLength() const override;
 	int serializePayload(uchar *data) const override;
@@ -57,8 +104,11 @@ protected:
 	Kwargs kwargs() const override { return Kwargs(); }
 
 private:
-	uchar *m_payload;
-	int m_length;
+	const uchar *payload() const { return m_wire + HEADER_LEN; }
+
+	MessageBufferPtr m_buffer;
+	uchar *m_wire; // header + payload inside m_buffer. The context ID byte is refreshed in case it was changed.
+	int m_length;  // payload length
 };
 
 }
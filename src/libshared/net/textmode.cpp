@@ -28,48 +28,169 @@
 #include "recording.h"
 #include "undo.h"
 
+#include <QVarLengthArray>
+
+#include <cstring>
+
 namespace protocol {
 namespace text {
 
-Parser::Result Parser::parseLine(const QString &line)
+namespace {
+
+inline bool isSpace(char c)
+{
+	return c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\v' || c=='\f';
+}
+
+inline bool isDigit(char c)
+{
+	return c>='0' && c<='9';
+}
+
+inline const char *findChar(const char *begin, const char *end, char c)
+{
+	const void *found = memchr(begin, c, end-begin);
+	return found ? static_cast<const char*>(found) : end;
+}
+
+inline QString toQString(const char *begin, const char *end)
+{
+	return QString::fromUtf8(begin, int(end-begin));
+}
+
+struct Token {
+	const char *begin;
+	const char *end;
+
+	bool operator==(const char *str) const { return int(strlen(str)) == end-begin && memcmp(begin, str, end-begin) == 0; }
+};
+
+// Parse an integer. Plain decimal numbers are handled here and anything
+// else by QString, so the result is always the same as QString::toInt()
+int tokenToInt(const char *begin, const char *end)
+{
+	const char *p = begin;
+	bool negative = false;
+	if(p<end && (*p=='-' || *p=='+')) {
+		negative = *p=='-';
+		++p;
+	}
+
+	if(p<end && end-p <= 9) {
+		int value = 0;
+		for(;p<end && isDigit(*p);++p)
+			value = value * 10 + (*p - '0');
+		if(p==end)
+			return negative ? -value : value;
+	}
+
+	return toQString(begin, end).toInt();
+}
+
+// Parse a classic dab coordinate and convert it to quarter pixels.
+// Numbers with at most two decimals are exact in fixed point and can't
+// round differently than int(QString::toFloat() * 4), which handles
+// everything else.
+int tokenToQuarters(const char *begin, const char *end)
+{
+	const char *p = begin;
+	bool negative = false;
+	if(p<end && (*p=='-' || *p=='+')) {
+		negative = *p=='-';
+		++p;
+	}
+
+	int whole = 0, wholeDigits = 0;
+	for(;p<end && isDigit(*p) && wholeDigits<5;++p,++wholeDigits)
+		whole = whole * 10 + (*p - '0');
+
+	int hundredths = 0;
+	bool fractionOk = true;
+	if(p<end && *p=='.') {
+		++p;
+		int fractionDigits = 0;
+		for(;p<end && isDigit(*p) && fractionDigits<2;++p,++fractionDigits)
+			hundredths = hundredths * 10 + (*p - '0');
+		if(fractionDigits == 1)
+			hundredths *= 10;
+		fractionOk = fractionDigits > 0;
+	}
+
+	if(p==end && wholeDigits>0 && wholeDigits<5 && fractionOk) {
+		const int quarters = (whole * 100 + hundredths) * 4 / 100;
+		return negative ? -quarters : quarters;
+	}
+
+	return int(toQString(begin, end).toFloat() * 4);
+}
+
+}
+
+Parser::Result Parser::parseLine(const char *line, int len)
 {
+	const char *end = line + len;
+	while(line<end && isSpace(*line))
+		++line;
+	while(end>line && isSpace(*(end-1)))
+		--end;
+
 	switch(m_state) {
 	case ExpectCommand: {
-		if(line.isEmpty() || line.at(0) == '#')
+		if(line==end || *line == '#')
 			return Result { Result::Skip, nullptr };
 
-		if(line.at(0) == '!') {
+		if(*line == '!') {
 			// Metadata line
-			int i = line.indexOf('=');
-			if(i>1) {
-				QString key = line.mid(1, i-1);
-				QString value = line.mid(i+1);
-				m_metadata[key] = value;
-			}
+			const char *eq = findChar(line, end, '=');
+			if(eq != end && eq-line > 1)
+				m_metadata[toQString(line+1, eq)] = toQString(eq+1, end);
 			return Result { Result::Skip, nullptr };
 		}
 
-		QStringList tokens = line.split(' ', QString::SkipEmptyParts);
-		if(tokens.length() < 2) {
+		QVarLengthArray<Token, 16> tokens;
+		for(const char *p=line;p<end;) {
+			const char *tokenEnd = findChar(p, end, ' ');
+			if(tokenEnd > p)
+				tokens.append(Token { p, tokenEnd });
+			p = tokenEnd + 1;
+		}
+
+		if(tokens.size() < 2) {
 			m_error = "Expected at least two tokens";
 			return Result { Result::Error, nullptr };
 		}
 
 		// Get context ID
 		{
-			bool ok;
-			int ctxId = tokens[0].toInt(&ok);
-			if(!ok || ctxId<0 || ctxId>255) {
-				m_error = "Invalid context id: " + tokens[0];
+			const Token &t = tokens[0];
+			bool ok = t.end - t.begin <= 3;
+			int ctxId = 0;
+			for(const char *p=t.begin;ok && p<t.end;++p) {
+				ok = isDigit(*p);
+				ctxId = ctxId * 10 + (*p - '0');
+			}
+			if(!ok || ctxId>255) {
+				m_error = "Invalid context id: " + toQString(t.begin, t.end);
 				return Result { Result::Error, nullptr };
 			}
 			m_ctx = ctxId;
 		}
 
 		// Get message name
-		m_cmd = tokens[1];
+		m_cmd = QByteArray(tokens[1].begin, int(tokens[1].end - tokens[1].begin));
 		m_kwargs = Kwargs();
-		m_dabs = QStringList();
+
+		if(m_cmd == "classicdabs")
+			m_dabFormat = ClassicDabs;
+		else if(m_cmd == "pixeldabs" || m_cmd == "squarepixeldabs")
+			m_dabFormat = PixelDabs;
+		else if(m_cmd.endsWith("dabs"))
+			m_dabFormat = UnknownDabs;
+		else
+			m_dabFormat = NoDabs;
+		m_classicDabs = ClassicBrushDabVector();
+		m_pixelDabs = PixelBrushDabVector();
+		m_dabField = 0;
 
 		// Check if this is a multiline message
 		bool multiline = false;
@@ -80,16 +201,17 @@ Parser::Result Parser::parseLine(const QString &line)
 
 		// Extract named arguments
 		for(int i=2;i<tokens.size();++i) {
-			int j = tokens[i].indexOf('=');
-			if(j<0) {
-				m_error = "No value in keyword argument: " + tokens[i];
+			const Token &t = tokens[i];
+			const char *eq = findChar(t.begin, t.end, '=');
+			if(eq == t.end) {
+				m_error = "No value in keyword argument: " + toQString(t.begin, t.end);
 				return Result { Result::Error, nullptr };
 			}
-			m_kwargs[tokens[i].left(j)] = tokens[i].mid(j+1);
+			m_kwargs[toQString(t.begin, eq)] = toQString(eq+1, t.end);
 		}
 
 		if(multiline) {
-			if(m_cmd.endsWith("dabs"))
+			if(m_dabFormat != NoDabs)
 				m_state = ExpectDab;
 			else
 				m_state = ExpectKwargLine;
@@ -101,16 +223,16 @@ Parser::Result Parser::parseLine(const QString &line)
 
 	case ExpectKwargLine: {
 		// Extract named argument
-		if(line=="}")
+		if(end-line == 1 && *line == '}')
 			break;
 
-		const int i = line.indexOf('=');
-		if(i<0) {
-			m_error = "Invalid named argument: " + line;
+		const char *eq = findChar(line, end, '=');
+		if(eq == end) {
+			m_error = "Invalid named argument: " + toQString(line, end);
 			return Result { Result::Error, nullptr };
 		}
-		const QString name = line.left(i);
-		const QString value = line.mid(i+1);
+		const QString name = toQString(line, eq);
+		const QString value = toQString(eq+1, end);
 		if(m_kwargs.contains(name)) {
 			m_kwargs[name] += "\n";
 			m_kwargs[name] += value;
@@ -122,22 +244,77 @@ Parser::Result Parser::parseLine(const QString &line)
 
 	case ExpectDab: {
 		// Extract dab points
-		if(line=="}")
+		if(end-line == 1 && *line == '}')
 			break;
-		m_dabs << line.split(' ');
+		parseDabLine(line, end);
 		return { Result::NeedMore, nullptr };
 	}
 	}
 
 	// Message finished!
 	m_state = ExpectCommand;
+	return finishMessage();
+}
+
+void Parser::parseDabLine(const char *line, const char *end)
+{
+	// Dab fields are separated by single spaces and a dab
+	// may continue on the next line.
+	while(true) {
+		const char *tokenEnd = findChar(line, end, ' ');
+
+		switch(m_dabFormat) {
+		case ClassicDabs:
+			m_dabFields[m_dabField] = m_dabField < 2 ? tokenToQuarters(line, tokenEnd) : tokenToInt(line, tokenEnd);
+			if(++m_dabField == 5) {
+				m_classicDabs << ClassicBrushDab {
+					int8_t(m_dabFields[0]),
+					int8_t(m_dabFields[1]),
+					uint16_t(m_dabFields[2]),
+					uint8_t(m_dabFields[3]),
+					uint8_t(m_dabFields[4])
+				};
+				m_dabField = 0;
+			}
+			break;
+		case PixelDabs:
+			m_dabFields[m_dabField] = tokenToInt(line, tokenEnd);
+			if(++m_dabField == 4) {
+				m_pixelDabs << PixelBrushDab {
+					int8_t(m_dabFields[0]),
+					int8_t(m_dabFields[1]),
+					uint8_t(m_dabFields[2]),
+					uint8_t(m_dabFields[3])
+				};
+				m_dabField = 0;
+			}
+			break;
+		case NoDabs:
+		case UnknownDabs:
+			break;
+		}
+
+		if(tokenEnd == end)
+			break;
+		line = tokenEnd + 1;
+	}
+}
 
+Parser::Result Parser::finishMessage()
+{
 	Message *msg=nullptr;
 
 #define FROMTEXT(name, Cls) if(m_cmd==name) msg = Cls::fromText(uint8_t(m_ctx), m_kwargs)
-	if(m_cmd=="classicdabs") msg = DrawDabsClassic::fromText(m_ctx, m_kwargs, m_dabs);
-	else if(m_cmd=="pixeldabs") msg = DrawDabsPixel::fromText(DabShape::Round, m_ctx, m_kwargs, m_dabs);
-	else if(m_cmd=="squarepixeldabs") msg = DrawDabsPixel::fromText(DabShape::Square, m_ctx, m_kwargs, m_dabs);
+	if(m_cmd=="classicdabs") {
+		// A partial dab at the end of the list is an error
+		if(m_dabField == 0)
+			msg = DrawDabsClassic::fromText(m_ctx, m_kwargs, m_classicDabs);
+		m_classicDabs = ClassicBrushDabVector();
+	} else if(m_cmd=="pixeldabs" || m_cmd=="squarepixeldabs") {
+		if(m_dabField == 0)
+			msg = DrawDabsPixel::fromText(m_cmd=="pixeldabs" ? DabShape::Round : DabShape::Square, m_ctx, m_kwargs, m_pixelDabs);
+		m_pixelDabs = PixelBrushDabVector();
+	}
 	else FROMTEXT("join", UserJoin);
 	else FROMTEXT("leave", UserLeave);
 	else FROMTEXT("owner", SessionOwner);
@@ -175,7 +352,7 @@ Parser::Result Parser::parseLine(const QString &line)
 	else if(m_cmd=="undo") msg = Undo::fromText(m_ctx, m_kwargs, false);
 	else if(m_cmd=="redo") msg = Undo::fromText(m_ctx, m_kwargs, true);
 	else {
-		m_error = "Unknown message type: " + m_cmd;
+		m_error = "Unknown message type: " + QString::fromUtf8(m_cmd);
 		return { Result::Error, nullptr };
 	}
 #undef FROMTEXT
@@ -184,7 +361,7 @@ Parser::Result Parser::parseLine(const QString &line)
 		return { Result::Ok, NullableMessageRef(msg) };
 
 	} else {
-		m_error = "Couldn't parse " + m_cmd + " message.";
+		m_error = "Couldn't parse " + QString::fromUtf8(m_cmd) + " message.";
 		return { Result::Error, nullptr };
 	}
 }
@@ -220,6 +397,46 @@ QString argbString(quint32 color)
 		return QStringLiteral("#%1").arg(color, 8, 16, QLatin1Char('0'));
 }
 
+void appendNumber(QByteArray &buffer, int value)
+{
+	char digits[12];
+	int i = sizeof(digits);
+	unsigned int v = value < 0 ? 0u - unsigned(value) : unsigned(value);
+	do {
+		digits[--i] = '0' + v % 10;
+		v /= 10;
+	} while(v);
+	if(value < 0)
+		digits[--i] = '-';
+	buffer.append(digits + i, int(sizeof(digits)) - i);
+}
+
+static void appendHex(QByteArray &buffer, quint32 value, int width)
+{
+	static const char hexdigits[] = "0123456789abcdef";
+	char digits[8];
+	for(int i=width-1;i>=0;--i) {
+		digits[i] = hexdigits[value & 0xf];
+		value >>= 4;
+	}
+	buffer.append(digits, width);
+}
+
+void appendIdString(QByteArray &buffer, uint16_t id)
+{
+	buffer.append("0x", 2);
+	appendHex(buffer, id, 4);
+}
+
+void appendArgbString(QByteArray &buffer, quint32 color)
+{
+	buffer.append('#');
+	if((color & 0xff000000) == 0xff000000)
+		appendHex(buffer, color & 0x00ffffff, 6);
+	else
+		appendHex(buffer, color, 8);
+}
+
 quint32 parseColor(const QString &color)
 {
 	if((color.length() == 7 || color.length() == 9) && color.at(0) == '#') {
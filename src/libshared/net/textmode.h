@@ -20,12 +20,17 @@
 #define DP_NET_TEXTMODE_H
 
 #include "message.h"
+#include "brushes.h"
 
 namespace protocol {
 namespace text {
 
 /**
  * Text mode file parser
+ *
+ * The parser works on UTF-8 encoded lines. Leading and trailing
+ * whitespace is ignored. Dab lists are decoded directly into dab vectors
+ * as the lines come in, since they make up the bulk of a typical recording.
  */
 class Parser {
 public:
@@ -39,25 +44,43 @@ public:
 		NullableMessageRef msg;
 	};
 
-	Result parseLine(const QString &line);
+	Result parseLine(const char *line, int len);
+	Result parseLine(const QByteArray &line) { return parseLine(line.constData(), line.length()); }
+	Result parseLine(const QString &line) { return parseLine(line.toUtf8()); }
+
 	QString errorString() const { return m_error; }
 
 	Kwargs metadata() const { return m_metadata; }
 
-	Parser() : m_state(ExpectCommand), m_ctx(0) { }
+	Parser() : m_state(ExpectCommand), m_dabFormat(NoDabs), m_dabField(0), m_ctx(0) { }
 
 private:
+	void parseDabLine(const char *line, const char *end);
+	Result finishMessage();
+
 	enum {
 		ExpectCommand,
 		ExpectKwargLine,
 		ExpectDab,
 	} m_state;
 
+	enum {
+		NoDabs,
+		ClassicDabs,
+		PixelDabs,
+		UnknownDabs
+	} m_dabFormat;
+
 	Kwargs m_metadata;
 	QString m_error;
-	QString m_cmd;
+	QByteArray m_cmd;
 	Kwargs m_kwargs;
-	QStringList m_dabs;
+
+	ClassicBrushDabVector m_classicDabs;
+	PixelBrushDabVector m_pixelDabs;
+	int m_dabFields[5];
+	int m_dabField;
+
 	int m_ctx;
 };
 
@@ -69,6 +92,11 @@ QString rgbString(quint32 color);
 QString argbString(quint32 color);
 inline QString decimal(uint8_t value) { return QString::number(value/255.0*100.0, 'f', 2); }
 
+// Formatting helper functions for writing UTF-8 text directly
+void appendNumber(QByteArray &buffer, int value);
+void appendIdString(QByteArray &buffer, uint16_t id);
+void appendArgbString(QByteArray &buffer, quint32 color);
+
 // Parsing helper functions
 uint16_t parseIdString16(const QString &id, bool *ok=nullptr);
 QList<uint8_t> parseIdListString8(const QString &ids);
@@ -40,6 +40,7 @@ struct Reader::Private {
 	QIODevice *file;
 
 	QByteArray msgbuf;
+	QByteArray linebuf;
 
 	QJsonObject metadata;
 
@@ -168,8 +169,7 @@ static Reader::Encoding detectEncoding(QIODevice *dev)
 			break;
 		}
 
-		QString line = QString::fromUtf8(rawLine).trimmed();
-		Parser::Result res = parser.parseLine(line);
+		Parser::Result res = parser.parseLine(rawLine);
 		switch(res.status) {
 		case Parser::Result::Ok:
 		case Parser::Result::NeedMore:
@@ -293,8 +293,7 @@ Compatibility Reader::readTextHeader()
 		if(rawLine.isEmpty())
 			return NOT_DPREC;
 
-		QString line = QString::fromUtf8(rawLine).trimmed();
-		Parser::Result res = parser.parseLine(line);
+		Parser::Result res = parser.parseLine(rawLine);
 		switch(res.status) {
 		case Parser::Result::Skip:
 			// Comments or metadata. Remember this potential start of the first real message
@@ -422,17 +421,43 @@ void Reader::seekTo(int pos, qint64 position)
 	d->eof = false;
 }
 
-static protocol::NullableMessageRef readTextMessage(QIODevice *file, bool *eof)
+/**
+ * Read a line into a reusable buffer
+ *
+ * The buffer is grown as needed to fit the line.
+ * @return length of the line read or 0 at the end of the file
+ */
+static int readTextLine(QIODevice *file, QByteArray &buffer)
+{
+	if(buffer.length() < 1024)
+		buffer.resize(1024);
+
+	int len = 0;
+	while(true) {
+		const qint64 read = file->readLine(buffer.data() + len, buffer.length() - len);
+		if(read <= 0)
+			return len;
+
+		len += read;
+		if(buffer.at(len-1) == '\n' || len < buffer.length() - 1)
+			return len;
+
+		// Line didn't fit in the buffer
+		buffer.resize(buffer.length() * 2);
+	}
+}
+
+static protocol::NullableMessageRef readTextMessage(QIODevice *file, QByteArray &linebuf, bool *eof)
 {
 	Parser parser;
 	while(1) {
-		QByteArray rawLine = file->readLine();
-		if(rawLine.isEmpty()) {
+		const int len = readTextLine(file, linebuf);
+		if(len == 0) {
 			*eof = true;
 			return nullptr;
 		}
 
-		Parser::Result res = parser.parseLine(QString::fromUtf8(rawLine).trimmed());
+		Parser::Result res = parser.parseLine(linebuf.constData(), len);
 		switch(res.status) {
 		case Parser::Result::Skip:
 		case Parser::Result::NeedMore:
@@ -459,7 +484,7 @@ bool Reader::readNextToBuffer(QByteArray &buffer)
 		}
 
 	} else {
-		protocol::NullableMessageRef msg = readTextMessage(d->file, &d->eof);
+		protocol::NullableMessageRef msg = readTextMessage(d->file, d->linebuf, &d->eof);
 		if(msg.isNull())
 			return false;
 		if(buffer.length() < msg->length())
@@ -493,7 +518,7 @@ MessageRecord Reader::readNext()
 
 	} else {
 		d->currentPos = filePosition();
-		protocol::NullableMessageRef message = readTextMessage(d->file, &d->eof);
+		protocol::NullableMessageRef message = readTextMessage(d->file, d->linebuf, &d->eof);
 		if(!d->eof) {
 			if(message.isNull())
 				return MessageRecord::Invalid(0, protocol::MSG_COMMAND);
@@ -56,6 +56,8 @@ Writer::Writer(QIODevice *file, bool autoclose, QObject *parent)
 	m_autoclose(autoclose), m_minInterval(0), m_timestampInterval(0), m_lastTimestamp(0),
 	m_autoflush(nullptr), m_encoding(Encoding::Binary)
 {
+	// Reserved capacity is kept when the buffer is cleared
+	m_textbuffer.reserve(1024);
 }
 
 Writer::~Writer()
@@ -128,8 +130,10 @@ void Writer::writeFromBuffer(const QByteArray &buffer)
 
 	} else {
 		protocol::NullableMessageRef msg = protocol::Message::deserialize(reinterpret_cast<const uchar*>(buffer.constData()), buffer.length(), true);
-		m_file->write(msg->toString().toUtf8());
-		m_file->write("\n", 1);
+		m_textbuffer.resize(0);
+		msg->toText(m_textbuffer);
+		m_textbuffer += '\n';
+		m_file->write(m_textbuffer);
 	}
 }
 
@@ -164,20 +168,17 @@ bool Writer::writeMessage(const protocol::Message &msg)
 			return writeComment(comment);
 		}
 
-		QByteArray line = msg.toString().toUtf8();
-		if(m_file->write(line) != line.length())
-			return false;
-		if(m_file->write("\n", 1) != 1)
-			return false;
+		m_textbuffer.resize(0);
+		msg.toText(m_textbuffer);
+		m_textbuffer += '\n';
 
 		// Write extra newlines after certain commands to give
 		// the file some visual structure
-		switch(msg.type()) {
-		case protocol::MSG_UNDOPOINT:
-			if(m_file->write("\n", 1) != 1)
-				return false;
-		default: break;
-		}
+		if(msg.type() == protocol::MSG_UNDOPOINT)
+			m_textbuffer += '\n';
+
+		if(m_file->write(m_textbuffer) != m_textbuffer.length())
+			return false;
 	}
 
 	return true;
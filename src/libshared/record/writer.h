@@ -145,6 +145,7 @@ private:
 	qint64 m_lastTimestamp;
 	QTimer *m_autoflush;
 	Encoding m_encoding;
+	QByteArray m_textbuffer;
 };
 
 }
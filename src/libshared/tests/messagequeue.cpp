@@ -1,5 +1,8 @@
 #include "../net/messagequeue.h"
 #include "../net/meta.h"
+#include "../net/brushes.h"
+#include "../net/image.h"
+#include "../net/meta2.h"
 
 #include <QtTest/QtTest>
 #include <QTcpSocket>
@@ -12,6 +15,13 @@
 
 using namespace protocol;
 
+// The benchmarks push hundreds of thousands of messages through the
+// loopback connection, so they are only run when asked for
+static bool benchmarksEnabled()
+{
+	return qEnvironmentVariableIsSet("DRAWPILE_BENCHMARKS");
+}
+
 // A simple TCP server that echoes back whatever is written to it.
 // Used by the actual test case.
 class EchoServer : public QObject
@@ -80,7 +90,7 @@ private slots:
 		while((s=m_server->nextPendingConnection())) {
 			connect(s, &QTcpSocket::disconnected, s, &QTcpSocket::deleteLater);
 			connect(s, &QTcpSocket::readyRead, [s]() {
-				char buf[128];
+				char buf[1024*16];
 				qint64 readbytes;
 				while((readbytes=s->read(buf, sizeof(buf)))>0) {
 					s->write(buf, readbytes);
@@ -167,8 +177,15 @@ private slots:
 
 		QVERIFY(mq->isUploading());
 		QCOMPARE(mq->uploadQueueBytes(), totalSendLen);
+		QCOMPARE(mq->queueStats().maxQueuedMessages, 1);
 
 		loopUntil(allReceived);
+
+		const QueueStats &stats = mq->queueStats();
+		QCOMPARE(stats.queuedMessages, 0);
+		QCOMPARE(stats.queuedBytes, 0);
+		QCOMPARE(stats.sentMessages, qint64(sendCount));
+		QCOMPARE(stats.droppedMessages, qint64(0));
 	}
 
 	void testSendDisconnect()
@@ -189,6 +206,387 @@ private slots:
 		loopUntil(disconnected);
 	}
 
+	void testSharedReceiveBuffers()
+	{
+		auto mq = getMsgQueue();
+		mq->setSharedReceiveBuffers(true);
+
+		// Enough data to fill several receive buffers
+		const int sendCount = 3000;
+		MessageList sent;
+		for(int i=0;i<sendCount;++i)
+			sent << MessagePtr(new PutImage(1, 1, 0, i, i, 10, 10, QByteArray(1000 + i % 100, char(i))));
+
+		MessageList received;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &received, &allReceived]() {
+			while(mq->isPending()) {
+				received << mq->getPending();
+				if(received.size() == sendCount)
+					allReceived = true;
+			}
+		});
+
+		mq->send(sent);
+		loopUntil(allReceived, 10000);
+
+		// The received messages are views into the receive buffers,
+		// which must stay valid as long as the messages exist
+		for(int i=0;i<sendCount;++i) {
+			QByteArray a(sent.at(i)->length(), 0), b(received.at(i)->length(), 0);
+			sent.at(i)->serialize(a.data());
+			received.at(i)->serialize(b.data());
+			QCOMPARE(b, a);
+			QCOMPARE(received.at(i)->wireBytes(), a);
+		}
+	}
+
+	void testPriorityLanes()
+	{
+		auto mq = getMsgQueue();
+		mq->setDecodeOpaque(true);
+
+		// A big backlog of drawing commands...
+		const int drawCount = 1000;
+		MessageList drawing;
+		for(int i=0;i<drawCount;++i)
+			drawing << MessagePtr(new PutImage(1, 1, 0, i, i, 10, 10, QByteArray(1000, char(i))));
+		mq->send(drawing);
+
+		// ...followed by pointer moves and a chat message
+		const int moveCount = 10;
+		MessagePtr lastMove[2] { MessagePtr(new MovePointer(1, 0, 0)), MessagePtr(new MovePointer(2, 0, 0)) };
+		for(int i=0;i<moveCount;++i) {
+			lastMove[0] = MessagePtr(new MovePointer(1, i, i));
+			lastMove[1] = MessagePtr(new MovePointer(2, -i, -i));
+			mq->send(lastMove[0]);
+			mq->send(lastMove[1]);
+		}
+		mq->send(MessagePtr(new Chat(1, 0, 0, QByteArray("Hello world!"))));
+
+		MessageList received;
+		int drawReceived = 0;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, drawCount, &received, &drawReceived, &allReceived]() {
+			while(mq->isPending()) {
+				received << mq->getPending();
+				if(received.last()->type() == MSG_PUTIMAGE && ++drawReceived == drawCount)
+					allReceived = true;
+			}
+		});
+		loopUntil(allReceived, 10000);
+		QVERIFY(allReceived);
+
+		// Only the latest pointer move of each user was sent and
+		// they (and the chat message) jumped ahead of the drawing commands
+		int moves = 0, chatPos = -1;
+		for(int i=0;i<received.size();++i) {
+			const MessagePtr &m = received.at(i);
+			if(m->type() == MSG_MOVEPOINTER) {
+				++moves;
+				QVERIFY(m.equals(lastMove[m->contextId()-1]));
+				QVERIFY(i < drawCount / 2);
+			} else if(m->type() == MSG_CHAT) {
+				chatPos = i;
+			}
+		}
+
+		QCOMPARE(moves, 2);
+		QVERIFY(chatPos >= 0);
+		QVERIFY(chatPos < drawCount / 2);
+		QCOMPARE(received.size(), drawCount + moves + 1);
+
+		const QueueStats &stats = mq->queueStats();
+		QCOMPARE(stats.droppedMessages, qint64(2 * (moveCount - 1)));
+		QCOMPARE(stats.sentMessages, qint64(received.size()));
+		QCOMPARE(stats.queuedBytes, 0);
+		QVERIFY(stats.maxQueuedMessages > drawCount / 2);
+	}
+
+	void testLaserTrailOrder()
+	{
+		auto mq = getMsgQueue();
+		mq->setDecodeOpaque(true);
+
+		const int drawCount = 1000;
+		MessageList drawing;
+		for(int i=0;i<drawCount;++i)
+			drawing << MessagePtr(new PutImage(1, 1, 0, i, i, 10, 10, QByteArray(1000, char(i))));
+		mq->send(drawing);
+
+		// A laser trail is drawn and ended, and the pointer moved afterwards.
+		// None of this may be dropped or reordered.
+		MessageList trail;
+		trail << MessagePtr(new LaserTrail(1, 0xffff0000, 10));
+		for(int i=0;i<5;++i)
+			trail << MessagePtr(new MovePointer(1, i, i));
+		trail << MessagePtr(new LaserTrail(1, 0, 0));
+		for(int i=0;i<3;++i)
+			trail << MessagePtr(new MovePointer(1, 100+i, 100+i));
+		for(const MessagePtr &msg : trail)
+			mq->send(msg);
+
+		// Another user's pointer moves are not affected
+		const MessagePtr lastMove(new MovePointer(2, 5, 5));
+		mq->send(MessagePtr(new MovePointer(2, 1, 1)));
+		mq->send(lastMove);
+
+		MessageList received;
+		bool allReceived = false;
+		const int expected = drawCount + trail.size() + 1;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, expected, &received, &allReceived]() {
+			while(mq->isPending()) {
+				received << mq->getPending();
+				if(received.size() == expected)
+					allReceived = true;
+			}
+		});
+		loopUntil(allReceived, 10000);
+		QVERIFY(allReceived);
+
+		MessageList receivedTrail;
+		for(int i=0;i<received.size();++i) {
+			const MessagePtr &m = received.at(i);
+			if(m->contextId() == 2) {
+				QVERIFY(m.equals(lastMove));
+				QVERIFY(i < drawCount / 2);
+			} else if(m->type() == MSG_LASERTRAIL || m->type() == MSG_MOVEPOINTER) {
+				receivedTrail << m;
+			}
+		}
+
+		QCOMPARE(receivedTrail.size(), trail.size());
+		for(int i=0;i<trail.size();++i)
+			QVERIFY(receivedTrail.at(i).equals(trail.at(i)));
+	}
+
+	void testBatchedChatOrder()
+	{
+		auto mq = getMsgQueue();
+		mq->setDecodeOpaque(true);
+
+		// Chat in a history batch must not jump ahead of the rest of the batch
+		const int drawCount = 1000;
+		MessageList batch;
+		for(int i=0;i<drawCount;++i)
+			batch << MessagePtr(new PutImage(1, 1, 0, i, i, 10, 10, QByteArray(1000, char(i))));
+		batch << MessagePtr(new Chat(1, 0, 0, QByteArray("Hello world!")));
+		mq->send(batch);
+
+		MessageList received;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, &batch, &received, &allReceived]() {
+			while(mq->isPending()) {
+				received << mq->getPending();
+				if(received.size() == batch.size())
+					allReceived = true;
+			}
+		});
+		loopUntil(allReceived, 10000);
+		QVERIFY(allReceived);
+
+		QCOMPARE(received.last()->type(), MSG_CHAT);
+	}
+
+	void testBatchedPointerMoves()
+	{
+		auto mq = getMsgQueue();
+		mq->setDecodeOpaque(true);
+
+		// A history batch with lots of pointer moves. The receiver counts
+		// catch-up messages, so none of them may be merged away.
+		MessageList batch;
+		for(int i=0;i<500;++i) {
+			batch << MessagePtr(new MovePointer(1 + i % 3, i, i));
+			if(i % 10 == 0)
+				batch << MessagePtr(new PutImage(1, 1, 0, i, i, 10, 10, QByteArray(1000, char(i))));
+		}
+		mq->send(batch);
+
+		MessageList received;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, &batch, &received, &allReceived]() {
+			while(mq->isPending()) {
+				received << mq->getPending();
+				if(received.size() == batch.size())
+					allReceived = true;
+			}
+		});
+		loopUntil(allReceived, 10000);
+		QVERIFY(allReceived);
+
+		for(int i=0;i<batch.size();++i)
+			QVERIFY(received.at(i).equals(batch.at(i)));
+		QCOMPARE(mq->queueStats().droppedMessages, qint64(0));
+	}
+
+	void testCompression_data()
+	{
+		QTest::addColumn<bool>("shared");
+		QTest::newRow("copied") << false;
+		QTest::newRow("shared") << true;
+	}
+
+	void testCompression()
+	{
+		QFETCH(bool, shared);
+
+		if(!MessageQueue::isCompressionSupported())
+			QSKIP("Compression not supported");
+
+		auto mq = getMsgQueue();
+		mq->setSharedReceiveBuffers(shared);
+		QVERIFY(mq->setCompressOutgoing(true));
+
+		// A mix of small messages, messages too small to be worth compressing
+		// and messages too big to fit in a compressed batch
+		const int sendCount = 500;
+		MessageList sent;
+		for(int i=0;i<sendCount;++i) {
+			if(i % 100 == 50)
+				sent << MessagePtr(new PutImage(1, 1, 0, i, i, 10, 10, QByteArray(65000, char(i))));
+			else if(i % 3 == 0)
+				sent << MessagePtr(new Chat(1, 0, 0, QByteArray("Hello world!")));
+			else
+				sent << MessagePtr(new PutImage(1, 1, 0, i, i, 10, 10, QByteArray(100 + i * 10, char(i))));
+		}
+
+		MessageList received;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &received, &allReceived]() {
+			while(mq->isPending()) {
+				received << mq->getPending();
+				if(received.size() == sendCount)
+					allReceived = true;
+			}
+		});
+
+		// Send in a few parts to get batches of different sizes
+		for(int i=0;i<sendCount;i+=100) {
+			mq->send(sent.mid(i, 100));
+			QCoreApplication::processEvents();
+		}
+		loopUntil(allReceived, 10000);
+		QCOMPARE(received.size(), sendCount);
+
+		for(int i=0;i<sendCount;++i) {
+			QByteArray a(sent.at(i)->length(), 0), b(received.at(i)->length(), 0);
+			sent.at(i)->serialize(a.data());
+			received.at(i)->serialize(b.data());
+			QCOMPARE(b, a);
+		}
+
+		// The echoed messages are decompressed by the same queue
+		const CompressionStats &out = mq->sentCompressionStats();
+		const CompressionStats &in = mq->receivedCompressionStats();
+		QVERIFY(out.rawBytes > 0);
+		QVERIFY(out.compressedBytes < out.rawBytes);
+		QCOMPARE(in.rawBytes, out.rawBytes);
+		QCOMPARE(in.compressedBytes, out.compressedBytes);
+	}
+
+	void benchmarkThroughput_data()
+	{
+		QTest::addColumn<bool>("batched");
+		QTest::newRow("unbatched") << false;
+		QTest::newRow("batched") << true;
+	}
+
+	void benchmarkThroughput()
+	{
+		QFETCH(bool, batched);
+
+		if(!benchmarksEnabled())
+			QSKIP("Set DRAWPILE_BENCHMARKS to run benchmarks");
+
+		auto mq = getMsgQueue();
+		mq->setBatchWrites(batched);
+
+		// Lots of small dab messages, like a typical session history catch-up
+		const int sendCount = 50000;
+		MessageList msgs;
+		qint64 totalBytes = 0;
+		for(int i=0;i<sendCount;++i) {
+			ClassicBrushDabVector dabs;
+			for(int j=0;j<4;++j)
+				dabs << ClassicBrushDab { qint8(j), qint8(-j), 1000, 128, 200 };
+			msgs << MessagePtr(new DrawDabsClassic(1, 1, i, -i, 0xff000000, 0, dabs));
+			totalBytes += msgs.last()->length();
+		}
+
+		int countReceived = 0;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &countReceived, &allReceived]() {
+			while(mq->isPending()) {
+				mq->getPending();
+				if(++countReceived == sendCount)
+					allReceived = true;
+			}
+		});
+
+		QElapsedTimer t;
+		t.start();
+
+		mq->send(msgs);
+		loopUntil(allReceived, 60000);
+		QVERIFY(allReceived);
+
+		const double secs = qMax<qint64>(1, t.elapsed()) / 1000.0;
+		qInfo("%s: %d messages in %.3f s: %.0f messages/s, %.2f MB/s (sent and echoed back)",
+			batched ? "batched" : "unbatched",
+			sendCount,
+			secs,
+			sendCount / secs,
+			totalBytes / secs / (1024.0 * 1024.0)
+		);
+	}
+
+	void benchmarkReceive()
+	{
+		if(!benchmarksEnabled())
+			QSKIP("Set DRAWPILE_BENCHMARKS to run benchmarks");
+
+		// A synthetic catch-up stream: lots of small messages arriving back to back
+		const int msgCount = 200000;
+		QByteArray stream;
+		for(int i=0;i<msgCount;++i) {
+			const MessagePtr msg { new DrawDabsClassic(1, 1, i, -i, 0xff000000, 0, ClassicBrushDabVector() << ClassicBrushDab { 1, 1, 1000, 128, 200 }) };
+			const int offset = stream.length();
+			stream.resize(offset + msg->length());
+			msg->serialize(stream.data() + offset);
+		}
+
+		auto s = getConnection();
+		QVERIFY(s->waitForConnected());
+		MessageQueue mq(s.get());
+
+		int countReceived = 0;
+		bool allReceived = false;
+		connect(&mq, &MessageQueue::messageAvailable, [&mq, msgCount, &countReceived, &allReceived]() {
+			while(mq.isPending()) {
+				mq.getPending();
+				if(++countReceived == msgCount)
+					allReceived = true;
+			}
+		});
+
+		QElapsedTimer t;
+		t.start();
+
+		// Bypass the message queue's send path so only receiving is measured
+		s->write(stream);
+		loopUntil(allReceived, 60000);
+		QVERIFY(allReceived);
+
+		const double secs = qMax<qint64>(1, t.elapsed()) / 1000.0;
+		qInfo("received %d messages in %.3f s: %.0f messages/s, %.2f MB/s",
+			msgCount,
+			secs,
+			msgCount / secs,
+			stream.length() / secs / (1024.0 * 1024.0)
+		);
+	}
+
 private:
 	std::unique_ptr<QTcpSocket> getConnection()
 	{
@@ -206,8 +604,7 @@ private:
 		return q;
 	}
 
-	void loopUntil(bool &condition) {
-		const int timeout = 3000;
+	void loopUntil(bool &condition, int timeout=3000) {
 		QElapsedTimer t;
 		t.start();
 		while(!condition && t.elapsed() < timeout) {
@@ -8,6 +8,7 @@
 #include "../net/undo.h"
 #include "../net/brushes.h"
 #include "../net/textmode.h"
+#include "../net/opaque.h"
 
 #include <QtTest/QtTest>
 
@@ -129,6 +130,102 @@ private slots:
 		QVERIFY(unwrapped->equals(*original));
 	}
 
+	void testOpaqueWireBytes()
+	{
+		const MessagePtr original { new PutImage(1, 0x0101, 1, 2, 3, 4, 5, QByteArray(1000, 'x')) };
+		QByteArray serialized(original->length(), 0);
+		original->serialize(serialized.data());
+
+		// Messages decoded by the server keep their serialized form
+		NullableMessageRef opaque = Message::deserialize(reinterpret_cast<const uchar*>(serialized.constData()), serialized.length(), false);
+		QVERIFY(!opaque.isNull());
+		QCOMPARE(opaque->wireBytes(), serialized);
+
+		// Regular messages must be serialized normally
+		QVERIFY(original->wireBytes().isNull());
+
+		// The server rewrites the context ID of incoming messages
+		opaque->setContextId(10);
+		serialized[3] = 10;
+		QCOMPARE(opaque->wireBytes(), serialized);
+
+		QByteArray reserialized(opaque->length(), 0);
+		QCOMPARE(opaque->serialize(reserialized.data()), opaque->length());
+		QCOMPARE(reserialized, serialized);
+	}
+
+	void testDabText()
+	{
+		// Every classic dab coordinate survives the text round trip
+		ClassicBrushDabVector dabs;
+		for(int i=-128;i<128;++i)
+			dabs << ClassicBrushDab { int8_t(i), int8_t(-1-i), uint16_t(i * 200), uint8_t(i), uint8_t(255-i) };
+
+		const DrawDabsClassic original(1, 0x0102, -401, 399, 0x80112233, 3, dabs);
+		QByteArray text;
+		original.toText(text);
+		QCOMPARE(QString::fromUtf8(text), original.toString());
+
+		text::Parser parser;
+		text::Parser::Result r { text::Parser::Result::NeedMore, nullptr };
+		for(const QByteArray &line : text.split('\n'))
+			r = parser.parseLine(line);
+		QCOMPARE(r.status, text::Parser::Result::Ok);
+		QVERIFY(original.equals(*r.msg));
+
+		// Unusual number formats are parsed the same way as QString would
+		QCOMPARE(parser.parseLine(QByteArray("1 classicdabs layer=0x0102 x=1.5 y=2 color=#ff0000 {")).status, text::Parser::Result::NeedMore);
+		parser.parseLine(QByteArray("\t1.3333 +2 300 -1 7"));
+		parser.parseLine(QByteArray("\t1e1 .5 12"));
+		parser.parseLine(QByteArray("\t0 0"));
+		r = parser.parseLine(QByteArray("}"));
+		QCOMPARE(r.status, text::Parser::Result::Ok);
+
+		const DrawDabsClassic expected(1, 0x0102, 6, 8, 0xffff0000, 1, ClassicBrushDabVector()
+			<< ClassicBrushDab { 5, 8, 300, 255, 7 }
+			<< ClassicBrushDab { 40, 2, 12, 0, 0 }
+		);
+		QVERIFY(expected.equals(*r.msg));
+
+		// Incomplete dabs are an error
+		parser.parseLine(QByteArray("1 pixeldabs layer=0x0102 x=1 y=2 color=#ff0000 {"));
+		parser.parseLine(QByteArray("1 2 3"));
+		QCOMPARE(parser.parseLine(QByteArray("}")).status, text::Parser::Result::Error);
+	}
+
+	void testMessagePooling()
+	{
+		const MessagePtr original { new DrawDabsClassic(1, 0x0101, 10, 20, 0xff000000, 1, ClassicBrushDabVector() << ClassicBrushDab {1, 2, 3, 4, 5} << ClassicBrushDab {6, 7, 8, 9, 10}) };
+		QByteArray serialized(original->length(), 0);
+		original->serialize(serialized.data());
+
+		const auto decode = [serialized]() {
+			return Message::deserialize(reinterpret_cast<const uchar*>(serialized.constData()), serialized.length(), true);
+		};
+
+		// A freed message object and its dab vector are reused by the next decoded message
+		NullableMessageRef first = decode();
+		QVERIFY(!first.isNull());
+		const Message *firstPtr = &(*first);
+		const ClassicBrushDab *firstDabs = first.cast<DrawDabsClassic>().dabs().constData();
+		first = NullableMessageRef();
+
+		NullableMessageRef second = decode();
+		QVERIFY(!second.isNull());
+		QCOMPARE(&(*second), firstPtr);
+		QCOMPARE(second.cast<DrawDabsClassic>().dabs().constData(), firstDabs);
+		QVERIFY(second->equals(*original));
+		second = NullableMessageRef();
+
+		// Messages work the same without pooling
+		Message::setPoolingEnabled(false);
+		NullableMessageRef third = decode();
+		QVERIFY(!third.isNull());
+		QVERIFY(third->equals(*original));
+		third = NullableMessageRef();
+		Message::setPoolingEnabled(true);
+	}
+
 	void testLayerOrderSanitation_data()
 	{
 		QTest::addColumn<IdList>("reorder");
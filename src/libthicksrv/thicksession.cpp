@@ -66,6 +66,16 @@ void ThickSession::readyToAutoReset(int ctxId)
 	log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message(QString("User %1 sent ready-to-autoreset, but this is a thick server!").arg(ctxId)));
 }
 
+void ThickSession::handleCatchupSnapshotBegin(int ctxId)
+{
+	log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message(QString("User %1 sent catchup-snapshot-begin, but this is a thick server!").arg(ctxId)));
+}
+
+void ThickSession::handleCatchupSnapshotEnd(int ctxId)
+{
+	log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message(QString("User %1 sent catchup-snapshot-end, but this is a thick server!").arg(ctxId)));
+}
+
 void ThickSession::addToHistory(protocol::MessagePtr msg)
 {
 	if(state() == State::Shutdown)
@@ -43,6 +43,10 @@ public:
 	void readyToAutoReset(int ctxId) override;
 
 	bool supportsAutoReset() const override { return false; }
+	bool supportsCatchupSnapshots() const override { return false; }
+
+	void handleCatchupSnapshotBegin(int ctxId) override;
+	void handleCatchupSnapshotEnd(int ctxId) override;
 
 protected:
 	ThickSession(ServerConfig *config, sessionlisting::Announcements *announcements, canvas::StateTracker *statetracker, const canvas::AclFilter *aclFilter, const QString &id, const QString &idAlias, const QString &founder, QObject *parent=nullptr);
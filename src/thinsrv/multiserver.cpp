@@ -371,6 +371,7 @@ JsonApiResult MultiServer::serverJsonApi(JsonApiMethod method, const QStringList
 		config::ClientTimeout,
 		config::SessionSizeLimit,
 		config::AutoresetThreshold,
+		config::CatchupSnapshotInterval,
 		config::SessionCountLimit,
 		config::EnablePersistence,
 		config::ArchiveMode,
@@ -442,6 +443,7 @@ JsonApiResult MultiServer::statusJsonApi(JsonApiMethod method, const QStringList
 	result["sessions"] = m_sessions->sessionCount();
 	result["maxSessions"] = m_config->getConfigInt(config::SessionCountLimit);
 	result["users"] = m_sessions->totalUsers();
+	result["compression"] = m_sessions->compressionStats();
 	QString localhost = m_config->internalConfig().localHostname;
 	if(localhost.isEmpty())
 		localhost = WhatIsMyIp::guessLocalAddress();
@@ -0,0 +1,457 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include "../libclient/brushes/brushengine.h"
+#include "../libclient/brushes/brushpainter.h"
+#include "../libclient/core/layerstack.h"
+#include "../libclient/core/layer.h"
+#include "../libshared/net/brushes.h"
+#include "../libshared/net/layer.h"
+#include "../libshared/net/protover.h"
+#include "../libshared/record/reader.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QScopedPointer>
+#include <QFileInfo>
+#include <QHash>
+#include <QtMath>
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <cmath>
+#include <cstdio>
+
+/**
+ * A benchmark for the brush engine.
+ *
+ * Stroke generation (BrushEngine::strokeTo/takeDabs) and rasterisation
+ * (brushes::drawBrushDabs) are timed separately, so a regression in one
+ * does not hide in the noise of the other.
+ *
+ * Synthetic strokes are generated from a fixed seed, so runs with the
+ * same parameters always produce the same dabs. Alternatively, the dab
+ * messages of a recording can be replayed through the rasterisation path.
+ */
+
+static const int CANVAS_SIZE = 1024;
+static const int CONTEXT_ID = 1;
+static const int LAYER_ID = 0x0101;
+
+void printVersion()
+{
+	printf("brushbench " DRAWPILE_VERSION "\n");
+	printf("Protocol version: %s\n", qPrintable(protocol::ProtocolVersion::current().asString()));
+	printf("Qt version: %s (compiled against %s)\n", qVersion(), QT_VERSION_STR);
+}
+
+struct BenchCase {
+	QString name;
+	brushes::ClassicBrush brush;
+	bool adaptiveSpacing;
+};
+
+struct PhaseResult {
+	QVector<qint64> strokeTimes; // nanoseconds per stroke
+	qint64 totalTime = 0;
+	qint64 dabs = 0;
+	qint64 messages = 0;
+	qint64 bytes = 0;
+
+	void addStroke(qint64 ns) { strokeTimes << ns; totalTime += ns; }
+
+	double perSecond(qint64 count) const { return totalTime > 0 ? count / (totalTime / 1.0e9) : 0; }
+
+	double p99() const {
+		if(strokeTimes.isEmpty())
+			return 0;
+		QVector<qint64> sorted = strokeTimes;
+		std::sort(sorted.begin(), sorted.end());
+		const int idx = qBound(0, int(std::ceil(sorted.size() * 0.99)) - 1, sorted.size()-1);
+		return sorted.at(idx) / 1.0e6;
+	}
+};
+
+static int dabCount(const protocol::Message &msg)
+{
+	switch(msg.type()) {
+	case protocol::MSG_DRAWDABS_CLASSIC:
+		return static_cast<const protocol::DrawDabsClassic&>(msg).dabs().size();
+	case protocol::MSG_DRAWDABS_PIXEL:
+	case protocol::MSG_DRAWDABS_PIXEL_SQUARE:
+		return static_cast<const protocol::DrawDabsPixel&>(msg).dabs().size();
+	default:
+		return 0;
+	}
+}
+
+static QList<BenchCase> makeBenchCases()
+{
+	brushes::ClassicBrush base;
+	base.setShape(brushes::ClassicBrush::ROUND_SOFT);
+	base.setColor(Qt::black);
+	base.setSize(16);
+	base.setHardness(0.8);
+	base.setOpacity(1.0);
+	base.setSpacing(0.15);
+	base.setIncremental(true);
+	base.setSizePressure(true);
+
+	QList<BenchCase> cases;
+	auto variant = [&cases, &base](const QString &name, std::function<void(brushes::ClassicBrush&)> fn, bool adaptive=false) {
+		brushes::ClassicBrush b = base;
+		fn(b);
+		cases << BenchCase { name, b, adaptive };
+	};
+
+	variant("soft-base", [](brushes::ClassicBrush &) {});
+	variant("soft-size2", [](brushes::ClassicBrush &b) { b.setSize(2); });
+	variant("soft-size64", [](brushes::ClassicBrush &b) { b.setSize(64); });
+	variant("soft-size255", [](brushes::ClassicBrush &b) { b.setSize(255); });
+	variant("soft-hard0", [](brushes::ClassicBrush &b) { b.setHardness(0.0); });
+	variant("soft-hard100", [](brushes::ClassicBrush &b) { b.setHardness(1.0); });
+	variant("soft-hardpressure", [](brushes::ClassicBrush &b) { b.setHardnessPressure(true); });
+	variant("soft-spacing5", [](brushes::ClassicBrush &b) { b.setSpacing(0.05); });
+	variant("soft-spacing50", [](brushes::ClassicBrush &b) { b.setSpacing(0.5); });
+	variant("soft-smudge", [](brushes::ClassicBrush &b) { b.setSmudge(0.5); });
+	variant("soft-indirect", [](brushes::ClassicBrush &b) { b.setIncremental(false); b.setOpacity(0.5); });
+	variant("soft-indirect64", [](brushes::ClassicBrush &b) { b.setIncremental(false); b.setHardness(1.0); b.setSize(64); b.setSpacing(0.05); });
+	variant("soft-adaptive64", [](brushes::ClassicBrush &b) { b.setIncremental(false); b.setHardness(1.0); b.setSize(64); b.setSpacing(0.05); }, true);
+	variant("soft-erase", [](brushes::ClassicBrush &b) { b.setBlendingMode(paintcore::BlendMode::MODE_ERASE); });
+	variant("soft-multiply", [](brushes::ClassicBrush &b) { b.setBlendingMode(paintcore::BlendMode::MODE_MULTIPLY); });
+	variant("pixel-round", [](brushes::ClassicBrush &b) { b.setShape(brushes::ClassicBrush::ROUND_PIXEL); });
+	variant("pixel-round1", [](brushes::ClassicBrush &b) { b.setShape(brushes::ClassicBrush::ROUND_PIXEL); b.setSize(1); b.setSizePressure(false); });
+	variant("pixel-square", [](brushes::ClassicBrush &b) { b.setShape(brushes::ClassicBrush::SQUARE_PIXEL); });
+	variant("pixel-square64", [](brushes::ClassicBrush &b) { b.setShape(brushes::ClassicBrush::SQUARE_PIXEL); b.setSize(64); });
+	variant("pixel-smudge", [](brushes::ClassicBrush &b) { b.setShape(brushes::ClassicBrush::ROUND_PIXEL); b.setSmudge(0.5); });
+
+	return cases;
+}
+
+/**
+ * Generate a reproducible stroke.
+ *
+ * The stroke is a random walk with a smoothly turning heading, similar
+ * to what a real pen produces. Pressure follows a slow sine wave.
+ * (std::minstd_rand is used because its output sequence is fixed by
+ * the standard, unlike the distribution classes.)
+ */
+static paintcore::PointVector makeStroke(std::minstd_rand &rng, int points)
+{
+	auto rand01 = [&rng]() { return double(rng() - rng.min()) / (rng.max() - rng.min()); };
+
+	paintcore::PointVector stroke;
+	stroke.reserve(points);
+
+	double x = 64 + rand01() * (CANVAS_SIZE - 128);
+	double y = 64 + rand01() * (CANVAS_SIZE - 128);
+	double heading = rand01() * 2 * M_PI;
+	const double phase = rand01() * 2 * M_PI;
+
+	for(int i=0;i<points;++i) {
+		heading += (rand01() - 0.5) * 0.6;
+		const double step = 1 + rand01() * 7;
+		x = qBound(0.0, x + std::cos(heading) * step, CANVAS_SIZE - 1.0);
+		y = qBound(0.0, y + std::sin(heading) * step, CANVAS_SIZE - 1.0);
+
+		const double pressure = qBound(0.0, 0.5 + 0.5 * std::sin(phase + i * 0.05), 1.0);
+		stroke << paintcore::Point(x, y, pressure);
+	}
+
+	return stroke;
+}
+
+static paintcore::LayerStack *makeCanvas(const QColor &fill)
+{
+	auto *canvas = new paintcore::LayerStack;
+	auto editor = canvas->editor(0);
+	editor.resize(0, CANVAS_SIZE, CANVAS_SIZE, 0);
+	editor.createLayer(LAYER_ID, 0, fill, false, false, QStringLiteral("Layer"));
+	return canvas;
+}
+
+static void printHeader()
+{
+	printf("%-18s %8s %9s %8s %10s | %12s %10s %9s | %12s %9s\n",
+		"case", "strokes", "dabs", "msgs", "bytes",
+		"gen dabs/s", "gen msg/s", "gen p99",
+		"rast dabs/s", "rast p99"
+		);
+}
+
+static void printResult(const QString &name, const PhaseResult &gen, const PhaseResult &raster)
+{
+	printf("%-18s %8d %9lld %8lld %10lld | %12.0f %10.0f %6.3f ms | %12.0f %6.3f ms\n",
+		qPrintable(name),
+		raster.strokeTimes.size(),
+		raster.dabs,
+		raster.messages,
+		raster.bytes,
+		gen.perSecond(gen.dabs),
+		gen.perSecond(gen.messages),
+		gen.p99(),
+		raster.perSecond(raster.dabs),
+		raster.p99()
+		);
+}
+
+static void runSyntheticBenchmark(int strokeCount, int pointsPerStroke, uint seed, const QString &filter)
+{
+	QElapsedTimer timer;
+
+	printHeader();
+
+	for(const BenchCase &bc : makeBenchCases()) {
+		if(!filter.isEmpty() && !bc.name.contains(filter))
+			continue;
+
+		// The same strokes are used for every case, so results are comparable
+		std::minstd_rand rng(seed);
+
+		// The source layer is only read from (for smudging),
+		// so rasterising into a separate canvas doesn't affect generation.
+		QScopedPointer<paintcore::LayerStack> source(makeCanvas(QColor(200, 100, 50)));
+		QScopedPointer<paintcore::LayerStack> target(makeCanvas(Qt::white));
+		const paintcore::Layer *sourceLayer = source->getLayer(LAYER_ID);
+
+		brushes::BrushEngine engine;
+		engine.setBrush(CONTEXT_ID, LAYER_ID, bc.brush);
+		engine.setAdaptiveSpacing(bc.adaptiveSpacing);
+
+		PhaseResult gen, raster;
+
+		for(int s=0;s<strokeCount;++s) {
+			const paintcore::PointVector points = makeStroke(rng, pointsPerStroke);
+
+			// Phase 1: stroke generation
+			timer.start();
+			for(const paintcore::Point &p : points)
+				engine.strokeTo(p, sourceLayer);
+			engine.endStroke();
+			protocol::MessageList dabs = engine.takeDabs();
+			gen.addStroke(timer.nsecsElapsed());
+
+			dabs << protocol::MessagePtr(new protocol::PenUp(CONTEXT_ID));
+
+			for(const protocol::MessagePtr &msg : dabs) {
+				const int count = dabCount(*msg);
+				gen.dabs += count;
+				raster.dabs += count;
+				++gen.messages;
+				++raster.messages;
+				gen.bytes += msg->length();
+				raster.bytes += msg->length();
+			}
+
+			// Phase 2: rasterisation
+			timer.start();
+			{
+				auto editor = target->editor(CONTEXT_ID);
+				for(const protocol::MessagePtr &msg : dabs) {
+					if(msg->type() == protocol::MSG_PEN_UP)
+						editor.mergeSublayers(CONTEXT_ID);
+					else
+						brushes::drawBrushDabs(*msg, editor);
+				}
+			}
+			raster.addStroke(timer.nsecsElapsed());
+		}
+
+		printResult(bc.name, gen, raster);
+	}
+}
+
+/**
+ * Replay the dab messages of a recording.
+ *
+ * Only the messages needed to give the dabs somewhere to go (canvas resize and
+ * layer creation) are applied in addition to the dabs and pen-ups themselves.
+ * Everything else (undo, images, fills, etc.) is skipped, so the result is not
+ * the same picture as the full recording, but the brush workload is.
+ *
+ * A stroke is measured from a user's first dab until their PenUp.
+ */
+static bool runRecordingBenchmark(const QString &filename)
+{
+	recording::Reader reader(filename);
+	const recording::Compatibility compat = reader.open();
+
+	switch(compat) {
+	case recording::NOT_DPREC:
+		fprintf(stderr, "Input file is not a Drawpile recording!\n");
+		return false;
+	case recording::CANNOT_READ:
+		fprintf(stderr, "Unable to read input file: %s\n", qPrintable(reader.errorString()));
+		return false;
+	case recording::INCOMPATIBLE:
+		fprintf(stderr, "This recording is incompatible (format version %s)\n", qPrintable(reader.formatVersion().asString()));
+		return false;
+	case recording::COMPATIBLE:
+	case recording::MINOR_INCOMPATIBILITY:
+	case recording::UNKNOWN_COMPATIBILITY:
+		break;
+	}
+
+	paintcore::LayerStack canvas;
+	PhaseResult raster;
+	QHash<int, qint64> strokeTimes; // context ID -> time spent in current stroke
+	QElapsedTimer timer;
+
+	recording::MessageRecord record;
+	do {
+		record = reader.readNext();
+		if(record.status == recording::MessageRecord::INVALID) {
+			fprintf(stderr, "Invalid message type %d at index %d\n", record.invalid_type, reader.currentIndex());
+			return false;
+		}
+		if(record.status != recording::MessageRecord::OK)
+			continue;
+
+		const protocol::Message &msg = *record.message;
+		switch(msg.type()) {
+		case protocol::MSG_CANVAS_RESIZE: {
+			const auto &cr = static_cast<const protocol::CanvasResize&>(msg);
+			canvas.editor(msg.contextId()).resize(cr.top(), cr.right(), cr.bottom(), cr.left());
+			break;
+		}
+		case protocol::MSG_LAYER_CREATE: {
+			const auto &lc = static_cast<const protocol::LayerCreate&>(msg);
+			canvas.editor(msg.contextId()).createLayer(
+				lc.layer(),
+				lc.source(),
+				QColor::fromRgba(lc.fill()),
+				lc.flags() & protocol::LayerCreate::FLAG_INSERT,
+				lc.flags() & protocol::LayerCreate::FLAG_COPY,
+				lc.title()
+			);
+			break;
+		}
+		case protocol::MSG_DRAWDABS_CLASSIC:
+		case protocol::MSG_DRAWDABS_PIXEL:
+		case protocol::MSG_DRAWDABS_PIXEL_SQUARE: {
+			timer.start();
+			{
+				auto editor = canvas.editor(msg.contextId());
+				brushes::drawBrushDabs(msg, editor);
+			}
+			strokeTimes[msg.contextId()] += timer.nsecsElapsed();
+
+			raster.dabs += dabCount(msg);
+			++raster.messages;
+			raster.bytes += msg.length();
+			break;
+		}
+		case protocol::MSG_PEN_UP: {
+			timer.start();
+			canvas.editor(msg.contextId()).mergeSublayers(msg.contextId());
+			const qint64 t = strokeTimes.take(msg.contextId()) + timer.nsecsElapsed();
+			raster.addStroke(t);
+
+			++raster.messages;
+			raster.bytes += msg.length();
+			break;
+		}
+		default: break;
+		}
+	} while(record.status != recording::MessageRecord::END_OF_RECORDING);
+
+	// Unterminated strokes at the end of the recording
+	for(const qint64 t : strokeTimes)
+		raster.addStroke(t);
+
+	printf("%-18s %8s %9s %8s %10s | %12s %9s\n",
+		"recording", "strokes", "dabs", "msgs", "bytes", "rast dabs/s", "rast p99"
+		);
+	printf("%-18s %8d %9lld %8lld %10lld | %12.0f %6.3f ms\n",
+		qPrintable(QFileInfo(filename).fileName().left(18)),
+		raster.strokeTimes.size(),
+		raster.dabs,
+		raster.messages,
+		raster.bytes,
+		raster.perSecond(raster.dabs),
+		raster.p99()
+		);
+
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	QCoreApplication app(argc, argv);
+
+	QCoreApplication::setOrganizationName("drawpile");
+	QCoreApplication::setOrganizationDomain("drawpile.net");
+	QCoreApplication::setApplicationName("brushbench");
+	QCoreApplication::setApplicationVersion(DRAWPILE_VERSION);
+
+	// Set up command line arguments
+	QCommandLineParser parser;
+
+	parser.setApplicationDescription("Brush engine benchmark");
+	parser.addHelpOption();
+
+	// --version, -v
+	QCommandLineOption versionOption(QStringList() << "v" << "version", "Displays version information.");
+	parser.addOption(versionOption);
+
+	// --strokes, -n <count>
+	QCommandLineOption strokesOption(QStringList() << "n" << "strokes", "Number of strokes per case (default 100)", "count", "100");
+	parser.addOption(strokesOption);
+
+	// --points, -p <count>
+	QCommandLineOption pointsOption(QStringList() << "p" << "points", "Number of input points per stroke (default 200)", "count", "200");
+	parser.addOption(pointsOption);
+
+	// --seed, -s <seed>
+	QCommandLineOption seedOption(QStringList() << "s" << "seed", "Random seed for stroke generation", "seed", "1");
+	parser.addOption(seedOption);
+
+	// --case, -c <filter>
+	QCommandLineOption caseOption(QStringList() << "c" << "case", "Run only cases whose name contains this string", "filter");
+	parser.addOption(caseOption);
+
+	// --replay, -r <input.dprec>
+	QCommandLineOption replayOption(QStringList() << "r" << "replay", "Replay dabs from a recording instead of synthetic strokes", "input.dprec");
+	parser.addOption(replayOption);
+
+	// Parse
+	parser.process(app);
+
+	if(parser.isSet(versionOption)) {
+		printVersion();
+		return 0;
+	}
+
+	if(parser.isSet(replayOption))
+		return runRecordingBenchmark(parser.value(replayOption)) ? 0 : 1;
+
+	const int strokes = parser.value(strokesOption).toInt();
+	const int points = parser.value(pointsOption).toInt();
+	if(strokes < 1 || points < 2) {
+		fprintf(stderr, "At least one stroke of two points is needed\n");
+		return 1;
+	}
+
+	runSyntheticBenchmark(strokes, points, parser.value(seedOption).toUInt(), parser.value(caseOption));
+
+	return 0;
+}
@@ -0,0 +1,637 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include "../libshared/net/annotation.h"
+#include "../libshared/net/brushes.h"
+#include "../libshared/net/control.h"
+#include "../libshared/net/image.h"
+#include "../libshared/net/layer.h"
+#include "../libshared/net/meta.h"
+#include "../libshared/net/meta2.h"
+#include "../libshared/net/undo.h"
+#include "../libshared/net/textmode.h"
+#include "../libshared/net/protover.h"
+#include "../libshared/record/reader.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QDir>
+#include <QFile>
+#include <QMap>
+
+#include <functional>
+#include <random>
+#include <cstdio>
+
+/**
+ * A benchmark for the message codecs.
+ *
+ * A message mix (either generated from a fixed seed or read from a recording)
+ * is grouped by message type and each group is run through:
+ *
+ *  - serialize: Message::serialize
+ *  - deserialize: Message::deserialize without decoding opaque messages (the server's path)
+ *  - decode: Message::deserialize with opaque decoding (the client's path)
+ *  - text: Message::toText and text::Parser (the .dptxt path)
+ *
+ * Every round trip is also checked for correctness.
+ *
+ * In check mode, the tool fails if any codec is so slow it can only be
+ * a regression. The budgets are deliberately generous so the check can be
+ * run as a part of the test suite on any machine, but they assume an
+ * optimized build. (Use --budget-scale for debug or instrumented builds.)
+ *
+ * The same message mix can be written out as a seed corpus for fuzzers,
+ * or used for a quick built-in mutation fuzzing run.
+ */
+
+typedef std::minstd_rand Rng;
+
+// Check mode budgets: nanoseconds per message + nanoseconds per byte
+static const double BINARY_BUDGET_BASE = 2000;
+static const double BINARY_BUDGET_PER_BYTE = 1;
+static const double TEXT_BUDGET_BASE = 50000;
+static const double TEXT_BUDGET_PER_BYTE = 50;
+
+// Number of messages of each type to write to the fuzzing corpus
+static const int CORPUS_PER_TYPE = 8;
+
+void printVersion()
+{
+	printf("codecbench " DRAWPILE_VERSION "\n");
+	printf("Protocol version: %s\n", qPrintable(protocol::ProtocolVersion::current().asString()));
+	printf("Qt version: %s (compiled against %s)\n", qVersion(), QT_VERSION_STR);
+}
+
+struct TypeResult {
+	QString name;
+	int count = 0;
+	int textCount = 0;
+	qint64 bytes = 0;
+	qint64 serializeNs = 0;
+	qint64 deserializeNs = 0;
+	qint64 decodeNs = 0;
+	qint64 textNs = 0;
+	int errors = 0;
+
+	double avgBytes() const { return count > 0 ? double(bytes) / count : 0; }
+	double perMessage(qint64 ns, int n) const { return n > 0 ? double(ns) / n : 0; }
+};
+
+static int randInt(Rng &rng, int min, int max)
+{
+	return min + int((rng() - rng.min()) % uint(max - min + 1));
+}
+
+/**
+ * Generate a reproducible message mix resembling a typical drawing session.
+ *
+ * Most of the messages are brush dabs, followed by pen-ups, pointer
+ * movements and undo points. Images, fills, layer operations,
+ * chat and server commands are rarer.
+ */
+static protocol::MessageList makeMessageMix(int count, uint seed)
+{
+	using namespace protocol;
+
+	Rng rng(seed);
+
+	// A few compressed image payloads of different sizes
+	QList<QByteArray> images;
+	for(int i=0;i<8;++i) {
+		const int size = 16 << (i % 4);
+		QByteArray pixels(size * size * 4, 0);
+		for(int p=0;p<pixels.size();++p)
+			pixels[p] = char((p / 4 + p % 4 * 50 + randInt(rng, 0, 8)) & 0xff);
+		images << qCompress(pixels);
+	}
+
+	auto ctx = [&rng]() { return uint8_t(randInt(rng, 1, 8)); };
+	auto layer = [&rng](uint8_t c) { return uint16_t((c << 8) | randInt(rng, 1, 3)); };
+
+	struct Kind {
+		int weight;
+		std::function<MessagePtr()> make;
+	};
+
+	const QList<Kind> kinds {
+		{ 550, [&]() {
+			const uint8_t c = ctx();
+			ClassicBrushDabVector dabs;
+			const int n = randInt(rng, 5, 30);
+			for(int i=0;i<n;++i)
+				dabs << ClassicBrushDab { qint8(randInt(rng, -20, 20)), qint8(randInt(rng, -20, 20)), uint16_t(randInt(rng, 256, 8000)), uint8_t(randInt(rng, 0, 255)), uint8_t(randInt(rng, 0, 255)) };
+			return MessagePtr(new DrawDabsClassic(c, layer(c), randInt(rng, 0, 40000), randInt(rng, 0, 40000), 0xff000000 | rng(), 1, dabs));
+		}},
+		{ 80, [&]() {
+			const uint8_t c = ctx();
+			PixelBrushDabVector dabs;
+			const int n = randInt(rng, 5, 30);
+			for(int i=0;i<n;++i)
+				dabs << PixelBrushDab { qint8(randInt(rng, -10, 10)), qint8(randInt(rng, -10, 10)), uint8_t(randInt(rng, 1, 20)), uint8_t(randInt(rng, 0, 255)) };
+			return MessagePtr(new DrawDabsPixel(DabShape::Round, c, layer(c), randInt(rng, 0, 4000), randInt(rng, 0, 4000), 0xff000000 | rng(), 1, dabs));
+		}},
+		{ 100, [&]() { return MessagePtr(new PenUp(ctx())); }},
+		{ 100, [&]() { return MessagePtr(new MovePointer(ctx(), randInt(rng, 0, 40000), randInt(rng, 0, 40000))); }},
+		{ 50, [&]() { return MessagePtr(new UndoPoint(ctx())); }},
+		{ 20, [&]() {
+			const uint8_t c = ctx();
+			const int size = 16 << randInt(rng, 0, 3);
+			return MessagePtr(new PutImage(c, layer(c), 1, randInt(rng, 0, 4000), randInt(rng, 0, 4000), size, size, images.at(randInt(rng, 0, images.size()-1))));
+		}},
+		{ 10, [&]() {
+			const uint8_t c = ctx();
+			return MessagePtr(new FillRect(c, layer(c), 1, randInt(rng, 0, 4000), randInt(rng, 0, 4000), randInt(rng, 1, 500), randInt(rng, 1, 500), rng()));
+		}},
+		{ 5, [&]() {
+			const uint8_t c = ctx();
+			return MessagePtr(new LayerCreate(c, layer(c), 0, 0, 0, QStringLiteral("Layer %1").arg(rng() % 100)));
+		}},
+		{ 5, [&]() {
+			const uint8_t c = ctx();
+			return MessagePtr(new LayerAttributes(c, layer(c), 0, 0, uint8_t(randInt(rng, 0, 255)), 1));
+		}},
+		{ 5, [&]() { return MessagePtr(new PutTile(ctx(), 0x0101, 0, randInt(rng, 0, 100), randInt(rng, 0, 100), randInt(rng, 0, 50), rng())); }},
+		{ 20, [&]() { return MessagePtr(new Chat(ctx(), 0, 0, QStringLiteral("Hello number %1!").arg(rng() % 1000).toUtf8())); }},
+		{ 10, [&]() { return MessagePtr(new Undo(ctx(), 0, rng() % 2)); }},
+		{ 5, [&]() { return MessagePtr(new AnnotationEdit(ctx(), 0x0101, 0x80ffffff, 0, 0, QByteArray("<p>Annotation</p>"))); }},
+		{ 5, [&]() { return MessagePtr(new LaserTrail(ctx(), 0xffff0000, uint8_t(randInt(rng, 0, 10)))); }},
+		{ 10, [&]() { return MessagePtr(new Command(0, QByteArray("{\"type\":\"reply\",\"message\":\"Hello\",\"reply\":{\"count\":123}}"))); }},
+	};
+
+	int totalWeight = 0;
+	for(const Kind &k : kinds)
+		totalWeight += k.weight;
+
+	MessageList msgs;
+	msgs.reserve(count);
+	for(int i=0;i<count;++i) {
+		int pick = randInt(rng, 0, totalWeight-1);
+		for(const Kind &k : kinds) {
+			if(pick < k.weight) {
+				msgs << k.make();
+				break;
+			}
+			pick -= k.weight;
+		}
+	}
+
+	return msgs;
+}
+
+static bool readMessages(const QString &filename, protocol::MessageList &msgs)
+{
+	recording::Reader reader(filename);
+	const recording::Compatibility compat = reader.open();
+
+	switch(compat) {
+	case recording::NOT_DPREC:
+		fprintf(stderr, "Input file is not a Drawpile recording!\n");
+		return false;
+	case recording::CANNOT_READ:
+		fprintf(stderr, "Unable to read input file: %s\n", qPrintable(reader.errorString()));
+		return false;
+	case recording::INCOMPATIBLE:
+		fprintf(stderr, "This recording is incompatible (format version %s)\n", qPrintable(reader.formatVersion().asString()));
+		return false;
+	case recording::COMPATIBLE:
+	case recording::MINOR_INCOMPATIBILITY:
+	case recording::UNKNOWN_COMPATIBILITY:
+		break;
+	}
+
+	recording::MessageRecord record;
+	do {
+		record = reader.readNext();
+		if(record.status == recording::MessageRecord::INVALID) {
+			fprintf(stderr, "Invalid message type %d at index %d\n", record.invalid_type, reader.currentIndex());
+			return false;
+		}
+		if(record.status == recording::MessageRecord::OK)
+			msgs << protocol::MessagePtr::fromNullable(record.message);
+	} while(record.status != recording::MessageRecord::END_OF_RECORDING);
+
+	return true;
+}
+
+static QMap<int, protocol::MessageList> groupByType(const protocol::MessageList &msgs)
+{
+	QMap<int, protocol::MessageList> groups;
+	for(const protocol::MessagePtr &msg : msgs)
+		groups[msg->type()] << msg;
+	return groups;
+}
+
+static protocol::NullableMessageRef parseText(const QByteArray &text, QString *error)
+{
+	protocol::text::Parser parser;
+	protocol::text::Parser::Result r { protocol::text::Parser::Result::NeedMore, nullptr };
+
+	for(int start=0;start<=text.length();) {
+		int end = text.indexOf('\n', start);
+		if(end < 0)
+			end = text.length();
+
+		r = parser.parseLine(text.constData() + start, end - start);
+		if(r.status == protocol::text::Parser::Result::Error) {
+			if(error)
+				*error = parser.errorString();
+			return protocol::NullableMessageRef();
+		}
+		start = end + 1;
+	}
+
+	if(r.status != protocol::text::Parser::Result::Ok)
+		return protocol::NullableMessageRef();
+	return r.msg;
+}
+
+static TypeResult benchmarkType(const protocol::MessageList &msgs)
+{
+	using namespace protocol;
+
+	TypeResult result;
+	result.name = msgs.first()->messageName();
+	result.count = msgs.size();
+
+	QElapsedTimer timer;
+
+	for(const MessagePtr &msg : msgs)
+		result.bytes += msg->length();
+
+	// Serialization
+	QByteArray stream(int(result.bytes), 0);
+	timer.start();
+	{
+		char *ptr = stream.data();
+		for(const MessagePtr &msg : msgs)
+			ptr += msg->serialize(ptr);
+	}
+	result.serializeNs = timer.nsecsElapsed();
+
+	const uchar *data = reinterpret_cast<const uchar*>(stream.constData());
+
+	// Deserialization without decoding (server side)
+	int deserialized = 0;
+	timer.start();
+	for(int offset=0;offset<stream.length();) {
+		const NullableMessageRef msg = Message::deserialize(data + offset, stream.length() - offset, false);
+		if(!msg.isNull())
+			++deserialized;
+		offset += Message::sniffLength(stream.constData() + offset);
+	}
+	result.deserializeNs = timer.nsecsElapsed();
+	result.errors += msgs.size() - deserialized;
+
+	// Deserialization with decoding (client side)
+	QList<NullableMessageRef> decoded;
+	decoded.reserve(msgs.size());
+	timer.start();
+	for(int offset=0;offset<stream.length();) {
+		decoded << Message::deserialize(data + offset, stream.length() - offset, true);
+		offset += Message::sniffLength(stream.constData() + offset);
+	}
+	result.decodeNs = timer.nsecsElapsed();
+
+	for(int i=0;i<msgs.size();++i) {
+		if(decoded.at(i).isNull() || !msgs.at(i)->equals(*decoded.at(i)))
+			++result.errors;
+	}
+
+	// Text mode round trip
+	if(msgs.first()->isRecordable()) {
+		QList<NullableMessageRef> parsed;
+		parsed.reserve(msgs.size());
+		QByteArray text;
+		text.reserve(1024);
+		timer.start();
+		for(const MessagePtr &msg : msgs) {
+			text.truncate(0);
+			msg->toText(text);
+			parsed << parseText(text, nullptr);
+		}
+		result.textNs = timer.nsecsElapsed();
+		result.textCount = msgs.size();
+
+		for(int i=0;i<msgs.size();++i) {
+			if(parsed.at(i).isNull() || !msgs.at(i)->equals(*parsed.at(i)))
+				++result.errors;
+		}
+	}
+
+	return result;
+}
+
+static void printHeader()
+{
+	printf("%-18s %8s %9s | %10s %10s %10s %10s\n",
+		"type", "count", "avg bytes",
+		"ser ns", "deser ns", "decode ns", "text ns"
+		);
+}
+
+static void printResult(const TypeResult &r)
+{
+	printf("%-18s %8d %9.1f | %10.1f %10.1f %10.1f %10.1f%s\n",
+		qPrintable(r.name.left(18)),
+		r.count,
+		r.avgBytes(),
+		r.perMessage(r.serializeNs, r.count),
+		r.perMessage(r.deserializeNs, r.count),
+		r.perMessage(r.decodeNs, r.count),
+		r.perMessage(r.textNs, r.textCount),
+		r.errors > 0 ? " ROUNDTRIP ERRORS" : ""
+		);
+}
+
+static void printTotals(const QList<TypeResult> &results)
+{
+	qint64 bytes = 0, ser = 0, deser = 0, decode = 0, textBytes = 0, text = 0;
+	for(const TypeResult &r : results) {
+		bytes += r.bytes;
+		ser += r.serializeNs;
+		deser += r.deserializeNs;
+		decode += r.decodeNs;
+		if(r.textCount > 0) {
+			textBytes += r.bytes;
+			text += r.textNs;
+		}
+	}
+
+	auto mbps = [](qint64 bytes, qint64 ns) { return ns > 0 ? bytes / (ns / 1.0e9) / (1024.0 * 1024.0) : 0; };
+
+	printf("\nThroughput (MB/s of binary message data): serialize %.1f, deserialize %.1f, decode %.1f, text %.1f\n",
+		mbps(bytes, ser),
+		mbps(bytes, deser),
+		mbps(bytes, decode),
+		mbps(textBytes, text)
+		);
+}
+
+/**
+ * Check the results against the regression budgets
+ * @return number of budgets exceeded
+ */
+static int checkBudgets(const QList<TypeResult> &results, double scale)
+{
+	int failures = 0;
+
+	auto check = [&failures](const TypeResult &r, const char *phase, double measured, double budget) {
+		if(measured > budget) {
+			fprintf(stderr, "%s %s: %.1f ns/message exceeds budget of %.1f ns\n", qPrintable(r.name), phase, measured, budget);
+			++failures;
+		}
+	};
+
+	for(const TypeResult &r : results) {
+		const double binaryBudget = (BINARY_BUDGET_BASE + BINARY_BUDGET_PER_BYTE * r.avgBytes()) * scale;
+		const double textBudget = (TEXT_BUDGET_BASE + TEXT_BUDGET_PER_BYTE * r.avgBytes()) * scale;
+
+		check(r, "serialize", r.perMessage(r.serializeNs, r.count), binaryBudget);
+		check(r, "deserialize", r.perMessage(r.deserializeNs, r.count), binaryBudget);
+		check(r, "decode", r.perMessage(r.decodeNs, r.count), binaryBudget);
+		if(r.textCount > 0)
+			check(r, "text", r.perMessage(r.textNs, r.textCount), textBudget);
+
+		if(r.errors > 0) {
+			fprintf(stderr, "%s: %d round trip errors\n", qPrintable(r.name), r.errors);
+			++failures;
+		}
+	}
+
+	return failures;
+}
+
+/**
+ * Write the first few messages of each type as fuzzing seeds.
+ *
+ * Binary seeds go in the "binary" subdirectory and the
+ * text mode representations in the "text" subdirectory.
+ */
+static bool writeCorpus(const QMap<int, protocol::MessageList> &groups, const QString &path)
+{
+	QDir dir(path);
+	if(!dir.mkpath("binary") || !dir.mkpath("text")) {
+		fprintf(stderr, "Couldn't create corpus directory %s\n", qPrintable(path));
+		return false;
+	}
+
+	int written = 0;
+	for(const protocol::MessageList &msgs : groups) {
+		for(int i=0;i<msgs.size() && i<CORPUS_PER_TYPE;++i) {
+			const protocol::MessagePtr &msg = msgs.at(i);
+			const QString name = QStringLiteral("%1-%2").arg(msg->messageName()).arg(i);
+
+			QByteArray data(msg->length(), 0);
+			msg->serialize(data.data());
+
+			QFile bin(dir.filePath(QStringLiteral("binary/%1.bin").arg(name)));
+			if(!bin.open(QFile::WriteOnly) || bin.write(data) != data.length()) {
+				fprintf(stderr, "Couldn't write %s\n", qPrintable(bin.fileName()));
+				return false;
+			}
+			++written;
+
+			if(msg->isRecordable()) {
+				QFile txt(dir.filePath(QStringLiteral("text/%1.txt").arg(name)));
+				if(!txt.open(QFile::WriteOnly) || txt.write(msg->toString().toUtf8() + '\n') < 0) {
+					fprintf(stderr, "Couldn't write %s\n", qPrintable(txt.fileName()));
+					return false;
+				}
+				++written;
+			}
+		}
+	}
+
+	printf("Wrote %d seed files to %s\n", written, qPrintable(path));
+	return true;
+}
+
+/**
+ * Run the deserializers on randomly mutated corpus messages.
+ *
+ * This doesn't check the results, only that nothing crashes
+ * (or trips a sanitizer, if enabled.)
+ */
+static void runFuzzer(const protocol::MessageList &corpus, int iterations, uint seed)
+{
+	using namespace protocol;
+
+	Rng rng(seed);
+
+	int accepted = 0, textAccepted = 0;
+	for(int i=0;i<iterations;++i) {
+		const MessagePtr &seedMsg = corpus.at(randInt(rng, 0, corpus.size()-1));
+
+		QByteArray data(seedMsg->length(), 0);
+		seedMsg->serialize(data.data());
+
+		const int mutations = randInt(rng, 1, 4);
+		for(int m=0;m<mutations && !data.isEmpty();++m) {
+			const int pos = randInt(rng, 0, data.length()-1);
+			switch(randInt(rng, 0, 5)) {
+			case 0: data[pos] = char(data.at(pos) ^ (1 << randInt(rng, 0, 7))); break;
+			case 1: data[pos] = char(rng()); break;
+			case 2: data[pos] = char(randInt(rng, 0, 1) ? 0 : 0xff); break;
+			case 3: data.truncate(pos); break;
+			case 4: data.insert(pos, data.mid(pos, randInt(rng, 1, 16))); break;
+			case 5: // length field
+				if(data.length() >= 2)
+					data[randInt(rng, 0, 1)] = char(rng());
+				break;
+			}
+		}
+
+		if(data.length() >= Message::HEADER_LEN && Message::sniffLength(data.constData()) <= data.length()) {
+			const uchar *ptr = reinterpret_cast<const uchar*>(data.constData());
+			const NullableMessageRef opaque = Message::deserialize(ptr, data.length(), false);
+			const NullableMessageRef msg = Message::deserialize(ptr, data.length(), true);
+			if(!msg.isNull()) {
+				++accepted;
+				QByteArray reserialized(msg->length(), 0);
+				msg->serialize(reserialized.data());
+				if(msg->isRecordable() && !parseText(msg->toString().toUtf8(), nullptr).isNull())
+					++textAccepted;
+			}
+			Q_UNUSED(opaque);
+		}
+
+		// Mutate the text mode form too
+		if(seedMsg->isRecordable()) {
+			QString text = seedMsg->toString();
+			const int pos = randInt(rng, 0, text.length()-1);
+			switch(randInt(rng, 0, 2)) {
+			case 0: text[pos] = QChar(randInt(rng, 32, 126)); break;
+			case 1: text.truncate(pos); break;
+			case 2: text.insert(pos, text.mid(pos, randInt(rng, 1, 16))); break;
+			}
+			parseText(text.toUtf8(), nullptr);
+		}
+	}
+
+	printf("Fuzzed %d mutated messages: %d accepted by the decoder, %d of those survived a text round trip\n",
+		iterations, accepted, textAccepted);
+}
+
+int main(int argc, char *argv[]) {
+	QCoreApplication app(argc, argv);
+
+	QCoreApplication::setOrganizationName("drawpile");
+	QCoreApplication::setOrganizationDomain("drawpile.net");
+	QCoreApplication::setApplicationName("codecbench");
+	QCoreApplication::setApplicationVersion(DRAWPILE_VERSION);
+
+	// Set up command line arguments
+	QCommandLineParser parser;
+
+	parser.setApplicationDescription("Message codec benchmark");
+	parser.addHelpOption();
+
+	// --version, -v
+	QCommandLineOption versionOption(QStringList() << "v" << "version", "Displays version information.");
+	parser.addOption(versionOption);
+
+	// --count, -n <count>
+	QCommandLineOption countOption(QStringList() << "n" << "count", "Number of messages to generate (default 200000, or 20000 in check mode)", "count");
+	parser.addOption(countOption);
+
+	// --seed, -s <seed>
+	QCommandLineOption seedOption(QStringList() << "s" << "seed", "Random seed for message generation", "seed", "1");
+	parser.addOption(seedOption);
+
+	// --replay, -r <input.dprec>
+	QCommandLineOption replayOption(QStringList() << "r" << "replay", "Use the messages of a recording instead of generated ones", "input.dprec");
+	parser.addOption(replayOption);
+
+	// --check
+	QCommandLineOption checkOption(QStringList() << "check", "Fail if a codec is much slower than expected");
+	parser.addOption(checkOption);
+
+	// --budget-scale <factor>
+	QCommandLineOption budgetOption(QStringList() << "budget-scale", "Multiply the check mode budgets by this factor (default 1.0)", "factor", "1.0");
+	parser.addOption(budgetOption);
+
+	// --corpus <dir>
+	QCommandLineOption corpusOption(QStringList() << "corpus", "Write a fuzzing seed corpus to this directory", "dir");
+	parser.addOption(corpusOption);
+
+	// --fuzz <iterations>
+	QCommandLineOption fuzzOption(QStringList() << "fuzz", "Feed this many mutated messages to the decoders", "iterations");
+	parser.addOption(fuzzOption);
+
+	// Parse
+	parser.process(app);
+
+	if(parser.isSet(versionOption)) {
+		printVersion();
+		return 0;
+	}
+
+	const bool checkMode = parser.isSet(checkOption);
+	const uint seed = parser.value(seedOption).toUInt();
+
+	protocol::MessageList msgs;
+	if(parser.isSet(replayOption)) {
+		if(!readMessages(parser.value(replayOption), msgs))
+			return 1;
+	} else {
+		const int count = parser.isSet(countOption) ? parser.value(countOption).toInt() : (checkMode ? 20000 : 200000);
+		msgs = makeMessageMix(count, seed);
+	}
+
+	if(msgs.isEmpty()) {
+		fprintf(stderr, "No messages to benchmark\n");
+		return 1;
+	}
+
+	const QMap<int, protocol::MessageList> groups = groupByType(msgs);
+
+	if(parser.isSet(corpusOption)) {
+		if(!writeCorpus(groups, parser.value(corpusOption)))
+			return 1;
+	}
+
+	if(parser.isSet(fuzzOption)) {
+		runFuzzer(msgs, parser.value(fuzzOption).toInt(), seed);
+		return 0;
+	}
+
+	QList<TypeResult> results;
+
+	printHeader();
+	for(const protocol::MessageList &group : groups) {
+		results << benchmarkType(group);
+		printResult(results.last());
+	}
+	printTotals(results);
+
+	if(checkMode) {
+		const int failures = checkBudgets(results, parser.value(budgetOption).toDouble());
+		if(failures > 0) {
+			fprintf(stderr, "%d check(s) failed\n", failures);
+			return 1;
+		}
+		printf("All checks passed\n");
+	}
+
+	return 0;
+}
@@ -21,6 +21,7 @@
 
 #include "renderer.h"
 #include "../libshared/net/protover.h"
+#include "../libshared/net/message.h"
 
 #include <QGuiApplication>
 #include <QStringList>
@@ -97,6 +98,10 @@ int main(int argc, char *argv[]) {
 	QCommandLineOption fixedSizeOption(QStringList() << "S" << "fixedsize", "Make all images the same size (maxsize if set)");
 	parser.addOption(fixedSizeOption);
 
+	// --no-message-pool
+	QCommandLineOption noPoolOption(QStringList() << "no-message-pool", "Don't recycle message objects (for benchmarking)");
+	parser.addOption(noPoolOption);
+
 	// Parse
 	parser.process(app);
 
@@ -171,6 +176,9 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	if(parser.isSet(noPoolOption))
+		protocol::Message::setPoolingEnabled(false);
+
 	const DrawpileCmdSettings settings {
 		inputfiles.at(0),
 		outputFilePattern,
@@ -160,9 +160,11 @@ bool renderDrawpileRecording(const DrawpileCmdSettings &settings)
 	aclfilter.reset(1, false);
 
 	// Benchmarking
+	QElapsedTimer readTime;
 	QElapsedTimer renderTime;
 	QElapsedTimer saveTime;
 	QElapsedTimer totalTime;
+	qint64 totalReadTime = 0;
 	qint64 totalRenderTime = 0;
 	qint64 totalSaveTime = 0;
 	totalTime.start();
@@ -178,7 +180,9 @@ bool renderDrawpileRecording(const DrawpileCmdSettings &settings)
 	recording::MessageRecord record;
 	do {
 		const qint64 offset = reader.filePosition();
+		readTime.start();
 		record = reader.readNext();
+		totalReadTime += readTime.nsecsElapsed();
 
 		if(record.status == recording::MessageRecord::OK) {
 			if(settings.acl && !aclfilter.filterMessage(*record.message)) {
@@ -229,7 +233,10 @@ bool renderDrawpileRecording(const DrawpileCmdSettings &settings)
 	} while(record.status != recording::MessageRecord::END_OF_RECORDING);
 
 	fprintf(stderr, "[I] Total processing time: %s\n", qPrintable(prettyDuration(totalTime.nsecsElapsed())));
+	fprintf(stderr, "[I] Cumulative read time: %s\n", qPrintable(prettyDuration(totalReadTime)));
 	fprintf(stderr, "[I] Cumulative render time: %s\n", qPrintable(prettyDuration(totalRenderTime)));
+	if(!protocol::Message::isPoolingEnabled())
+		fprintf(stderr, "[I] Message pooling was disabled\n");
 
 	// Save the final result
 	saveTime.start();